@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/*
+   A small micro-benchmark harness. Each sample times a fixed number of
+   calls, the first samples only warm up caches and branch predictors. The
+   results are per operation, a call may do several.
+*/
+
+struct BenchOptions {
+  int warmup_samples = 20;
+  int samples = 200;
+  int calls_per_sample = 100;
+};
+
+struct BenchResult {
+  const char *name;
+  int ops_per_call;
+  double median_ns;
+  double p99_ns;
+  double min_ns;
+};
+
+// Keeps the compiler from dropping the computation of value
+template <class T>
+inline void
+do_not_optimize(const T &value) {
+#if defined(__GNUC__)
+  asm volatile("" : : "r,m"(value) : "memory");
+#else
+  static volatile const void *sink;
+  sink = &value;
+#endif
+}
+
+// Keeps the compiler from caching memory across the barrier
+inline void
+clobber_memory() {
+#if defined(__GNUC__)
+  asm volatile("" : : : "memory");
+#endif
+}
+
+// Runs the benchmarks on one cpu so they don't migrate mid sample. Returns
+// false where that isn't supported.
+inline bool
+pin_to_cpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+// Sample below which a fraction q of the sorted samples are
+inline double
+sorted_percentile(const std::vector<double> &sorted, double q) {
+  int i = std::min((int)(q * sorted.size()), (int)sorted.size() - 1);
+  return sorted[i];
+}
+
+// fn() does ops_per_call operations
+template <class F>
+BenchResult
+run_bench(const char *name, const BenchOptions &options, int ops_per_call,
+          F &&fn) {
+  using clock = std::chrono::steady_clock;
+  std::vector<double> ns(options.samples);
+  for (int sample = -options.warmup_samples; sample < options.samples;
+       ++sample) {
+    clock::time_point start = clock::now();
+    for (int call = 0; call < options.calls_per_sample; ++call) {
+      fn();
+      clobber_memory();
+    }
+    double elapsed =
+        std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    if (sample >= 0) {
+      ns[sample] = elapsed / ((double)options.calls_per_sample * ops_per_call);
+    }
+  }
+  std::sort(ns.begin(), ns.end());
+  return BenchResult{name, ops_per_call, sorted_percentile(ns, 0.5),
+                     sorted_percentile(ns, 0.99), ns[0]};
+}
+
+inline void
+print_bench_result(const BenchResult &r) {
+  printf("%-32s median %9.2f ns  p99 %9.2f ns  min %9.2f ns\n", r.name,
+         r.median_ns, r.p99_ns, r.min_ns);
+}
+
+// One object per benchmark. commit and variant are free form labels, null
+// leaves them out.
+inline bool
+write_bench_json(const char *path, const char *commit, const char *variant,
+                 const std::vector<BenchResult> &results) {
+  FILE *f = fopen(path, "w");
+  if (f == nullptr) {
+    return false;
+  }
+  fprintf(f, "{\n");
+  if (commit != nullptr) {
+    fprintf(f, "  \"commit\": \"%s\",\n", commit);
+  }
+  if (variant != nullptr) {
+    fprintf(f, "  \"variant\": \"%s\",\n", variant);
+  }
+  fprintf(f, "  \"unit\": \"ns/op\",\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult &r = results[i];
+    fprintf(f,
+            "    {\"name\": \"%s\", \"ops_per_call\": %d, \"median\": %.3f, "
+            "\"p99\": %.3f, \"min\": %.3f}%s\n",
+            r.name, r.ops_per_call, r.median_ns, r.p99_ns, r.min_ns,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  return fclose(f) == 0;
+}
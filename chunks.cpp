@@ -0,0 +1,266 @@
+#include "chunks.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+static uint32_t
+hash_chunk(int cx, int cz) {
+  uint32_t h = (uint32_t)cx * 0x9e3779b1U ^ (uint32_t)cz * 0x85ebca77U;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6dU;
+  h ^= h >> 12;
+  return h;
+}
+
+static int
+find_slot(const ChunkCache *cache, int cx, int cz) {
+  int mask = cache->table_size - 1;
+  for (int i = (int)(hash_chunk(cx, cz) & mask); cache->table[i] >= 0;
+       i = (i + 1) & mask) {
+    const ChunkSlot &slot = cache->slots[cache->table[i]];
+    if (slot.cx == cx && slot.cz == cz) {
+      return cache->table[i];
+    }
+  }
+  return -1;
+}
+
+static void
+insert_slot(ChunkCache *cache, int slot) {
+  int mask = cache->table_size - 1;
+  const ChunkSlot &s = cache->slots[slot];
+  int i = (int)(hash_chunk(s.cx, s.cz) & mask);
+  while (cache->table[i] >= 0) {
+    i = (i + 1) & mask;
+  }
+  cache->table[i] = slot;
+}
+
+// Shifts the entries after it back so the probe sequences stay unbroken
+static void
+erase_slot(ChunkCache *cache, int slot) {
+  int mask = cache->table_size - 1;
+  const ChunkSlot &s = cache->slots[slot];
+  int i = (int)(hash_chunk(s.cx, s.cz) & mask);
+  while (cache->table[i] != slot) {
+    i = (i + 1) & mask;
+  }
+  cache->table[i] = -1;
+  for (int j = (i + 1) & mask; cache->table[j] >= 0; j = (j + 1) & mask) {
+    const ChunkSlot &other = cache->slots[cache->table[j]];
+    int home = (int)(hash_chunk(other.cx, other.cz) & mask);
+    // Moves back unless its home is in (i, j]
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (!stays) {
+      cache->table[i] = cache->table[j];
+      cache->table[j] = -1;
+      i = j;
+    }
+  }
+}
+
+// A free slot, or the least recently seen one not in view and not being
+// generated. -1 when all are in use.
+static int
+take_slot(ChunkCache *cache) {
+  int oldest = -1;
+  for (int i = 0; i < cache->n_slots; ++i) {
+    const ChunkSlot &slot = cache->slots[i];
+    if (slot.state == ChunkState::Free) {
+      return i;
+    }
+    if (slot.state != ChunkState::Generating &&
+        slot.last_used < cache->frame &&
+        (oldest < 0 || slot.last_used < cache->slots[oldest].last_used)) {
+      oldest = i;
+    }
+  }
+  if (oldest >= 0) {
+    erase_slot(cache, oldest);
+  }
+  return oldest;
+}
+
+// Noise of cells x cells samples over the chunk, the first at its corner
+static void
+fill_chunk(const ChunkCache *cache, const NoiseParams &noise, int cx, int cz,
+           int cells, float *out) {
+  const ChunkParams &p = cache->params;
+  float to_noise = 1 / p.noise_size;
+  float x0 = ((float)cx - 0.5F) * p.chunk_size * to_noise;
+  float z0 = ((float)cz - 0.5F) * p.chunk_size * to_noise;
+  float step = p.chunk_size / cells * to_noise;
+  generate_noise_region(out, cells, x0, z0, step, noise);
+  for (int i = 0; i < cells * cells; ++i) {
+    out[i] *= p.height;
+  }
+}
+
+static void
+chunk_worker(ChunkCache *cache) {
+  const ChunkParams &p = cache->params;
+  std::unique_lock<std::mutex> lock(cache->mutex);
+  while (!cache->quit) {
+    // The nearest chunk in view the last frame or this one
+    int best = -1;
+    for (int i = 0; i < cache->n_slots; ++i) {
+      const ChunkSlot &slot = cache->slots[i];
+      if (slot.state == ChunkState::Queued &&
+          slot.last_used + 1 >= cache->frame &&
+          (best < 0 || slot.priority < cache->slots[best].priority)) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      cache->wake.wait(lock);
+      continue;
+    }
+    ChunkSlot *slot = &cache->slots[best];
+    slot->state = ChunkState::Generating;
+    int cx = slot->cx;
+    int cz = slot->cz;
+    lock.unlock();
+    fill_chunk(cache, cache->noise, cx, cz, p.cells,
+               cache->heights + (size_t)best * p.cells * p.cells);
+    lock.lock();
+    slot->state = ChunkState::Ready;
+    ++slot->version;
+  }
+}
+
+void
+init_chunk_cache(ChunkCache *cache, NoiseParams noise, ChunkParams params,
+                 int n_threads) {
+  cache->noise = noise;
+  cache->params = params;
+  size_t slot_bytes =
+      sizeof(ChunkSlot) + 2 * sizeof(int) +
+      sizeof(float) * (params.cells * params.cells +
+                       chunk_coarse_cells * chunk_coarse_cells);
+  cache->n_slots = std::max((int)(params.budget_bytes / slot_bytes), 1);
+  cache->slots = (ChunkSlot *)calloc(cache->n_slots, sizeof(ChunkSlot));
+  cache->heights = (float *)malloc(sizeof(float) * params.cells *
+                                   params.cells * cache->n_slots);
+  cache->coarse = (float *)malloc(sizeof(float) * chunk_coarse_cells *
+                                  chunk_coarse_cells * cache->n_slots);
+  cache->table_size = 1;
+  while (cache->table_size < 2 * cache->n_slots) {
+    cache->table_size *= 2;
+  }
+  cache->table = (int *)malloc(sizeof(int) * cache->table_size);
+  for (int i = 0; i < cache->table_size; ++i) {
+    cache->table[i] = -1;
+  }
+  cache->frame = 0;
+  cache->quit = false;
+
+  if (n_threads < 0) {
+    n_threads = (int)std::thread::hardware_concurrency() / 2;
+  }
+  cache->n_threads = std::clamp(n_threads, 1, max_chunk_threads);
+  for (int i = 0; i < cache->n_threads; ++i) {
+    cache->threads[i] = std::thread(chunk_worker, cache);
+  }
+}
+
+void
+free_chunk_cache(ChunkCache *cache) {
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->quit = true;
+  }
+  cache->wake.notify_all();
+  for (int i = 0; i < cache->n_threads; ++i) {
+    cache->threads[i].join();
+  }
+  free(cache->slots);
+  free(cache->heights);
+  free(cache->coarse);
+  free(cache->table);
+}
+
+int
+update_chunks(ChunkCache *cache, vec2f focus, float radius, ChunkView *out,
+              int max_out) {
+  const ChunkParams &p = cache->params;
+  // Chunks whose centers are within radius of the focus
+  std::vector<ChunkView> views;
+  std::vector<float> dists;
+  int min_cx = (int)floorf((focus.x - radius) / p.chunk_size + 0.5F);
+  int max_cx = (int)floorf((focus.x + radius) / p.chunk_size + 0.5F);
+  int min_cz = (int)floorf((focus.y - radius) / p.chunk_size + 0.5F);
+  int max_cz = (int)floorf((focus.y + radius) / p.chunk_size + 0.5F);
+  for (int cx = min_cx; cx <= max_cx; ++cx) {
+    for (int cz = min_cz; cz <= max_cz; ++cz) {
+      float dx = cx * p.chunk_size - focus.x;
+      float dz = cz * p.chunk_size - focus.y;
+      float dist = sqrtf(dx * dx + dz * dz);
+      if (dist <= radius && !(cx == 0 && cz == 0)) {
+        views.push_back(ChunkView{cx, cz, -1, false, 0});
+        dists.push_back(dist);
+      }
+    }
+  }
+  std::vector<int> order(views.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = (int)i;
+  }
+  std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return dists[a] < dists[b]; });
+
+  // The coarse heights, fewer octaves
+  NoiseParams coarse_noise = cache->noise;
+  coarse_noise.octaves = std::min(coarse_noise.octaves, 2);
+
+  int n = std::min((int)order.size(), max_out);
+  bool any_queued = false;
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    ++cache->frame;
+    for (int k = 0; k < n; ++k) {
+      ChunkView view = views[order[k]];
+      int s = find_slot(cache, view.cx, view.cz);
+      if (s < 0) {
+        s = take_slot(cache);
+        if (s >= 0) {
+          ChunkSlot *slot = &cache->slots[s];
+          slot->cx = view.cx;
+          slot->cz = view.cz;
+          slot->state = ChunkState::Queued;
+          ++slot->version;
+          insert_slot(cache, s);
+          fill_chunk(cache, coarse_noise, view.cx, view.cz,
+                     chunk_coarse_cells,
+                     cache->coarse +
+                         (size_t)s * chunk_coarse_cells * chunk_coarse_cells);
+        }
+      }
+      if (s >= 0) {
+        ChunkSlot *slot = &cache->slots[s];
+        slot->last_used = cache->frame;
+        slot->priority = dists[order[k]];
+        view.slot = s;
+        view.ready = slot->state == ChunkState::Ready;
+        view.version = slot->version;
+        any_queued |= slot->state == ChunkState::Queued;
+      }
+      out[k] = view;
+    }
+  }
+  if (any_queued) {
+    cache->wake.notify_all();
+  }
+  return n;
+}
+
+const float *
+chunk_heights(const ChunkCache *cache, const ChunkView &view) {
+  if (view.ready) {
+    int cells = cache->params.cells;
+    return cache->heights + (size_t)view.slot * cells * cells;
+  }
+  return cache->coarse +
+         (size_t)view.slot * chunk_coarse_cells * chunk_coarse_cells;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "math.hpp"
+#include "noise.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+constexpr int max_chunk_threads = 8;
+// Placeholder heights per side, computed when a chunk first comes in view
+constexpr int chunk_coarse_cells = 4;
+
+/*
+   Terrain without end, square chunks of noise around a focus point. Worker
+   threads generate the chunks nearest the focus first. Chunks out of view
+   stay in their slots until the slots are needed, the least recently seen
+   go first. The number of slots comes from a memory budget.
+
+   update_chunks never waits on the workers, chunks that aren't generated
+   yet come with coarse heights to draw instead.
+*/
+struct ChunkParams {
+  // World units per side, chunk (0, 0) is centered on the origin
+  float chunk_size = 6.0F;
+  int cells = 48;
+  // World units per unit square of the noise
+  float noise_size = 24.0F;
+  // Heights are this times the noise
+  float height = 0.5F;
+  size_t budget_bytes = 16 << 20;
+};
+
+enum class ChunkState {
+  Free,
+  Queued,
+  Generating,
+  Ready,
+};
+
+struct ChunkSlot {
+  int cx;
+  int cz;
+  ChunkState state;
+  // Frame the chunk was last in view
+  uint64_t last_used;
+  // Distance from the focus, the nearest are generated first
+  float priority;
+  // Changes when the heights or the coarse heights are rewritten
+  uint32_t version;
+};
+
+struct ChunkCache {
+  NoiseParams noise;
+  ChunkParams params;
+  int n_slots;
+  ChunkSlot *slots;
+  // cells * cells per slot, written by the workers while Generating
+  float *heights;
+  // chunk_coarse_cells^2 per slot
+  float *coarse;
+  // Open addressing from the chunk coordinates to the slot, -1 for empty
+  int table_size;
+  int *table;
+  uint64_t frame;
+
+  // Guards the slot states, the table and quit
+  std::mutex mutex;
+  std::condition_variable wake;
+  int n_threads;
+  std::thread threads[max_chunk_threads];
+  bool quit;
+};
+
+// A chunk in view, slot is -1 when the budget has no slot left for it
+struct ChunkView {
+  int cx;
+  int cz;
+  int slot;
+  // The full heights are there, else only the coarse ones
+  bool ready;
+  uint32_t version;
+};
+
+void
+init_chunk_cache(ChunkCache *cache, NoiseParams noise, ChunkParams params,
+                 int n_threads);
+
+void
+free_chunk_cache(ChunkCache *cache);
+
+// The chunks within radius of focus nearest first, except chunk (0, 0).
+// Queues the ones not generated yet, writes at most max_out and returns how
+// many.
+int
+update_chunks(ChunkCache *cache, vec2f focus, float radius, ChunkView *out,
+              int max_out);
+
+// Heights of a slot, cells * cells of them when the view is ready and
+// chunk_coarse_cells^2 otherwise. Row r is along x.
+const float *
+chunk_heights(const ChunkCache *cache, const ChunkView &view);
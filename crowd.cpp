@@ -0,0 +1,296 @@
+#include "crowd.hpp"
+#include "fast_math.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Agents per update job, a multiple of crowd_block
+constexpr int crowd_job_size = 2048;
+// Separation looks at no more than this many agents of each bin, agents
+// piled up at a goal don't make it quadratic
+constexpr int max_per_bin = 8;
+// A stalled frame is simulated as this long
+constexpr float max_tick = 0.1F;
+
+void
+init_flow_field(FlowField *flow, int width) {
+  flow->width = width;
+  flow->dir_x = (float *)calloc(width * width, sizeof(float));
+  flow->dir_z = (float *)calloc(width * width, sizeof(float));
+}
+
+void
+free_flow_field(FlowField *flow) {
+  free(flow->dir_x);
+  free(flow->dir_z);
+}
+
+static void
+update_flow_tile(FlowField *flow, const DistanceField *goals,
+                 const Heightfield *prev, const Heightfield *cur,
+                 CrowdParams params, int tile) {
+  int width = flow->width;
+  int tiles_per_side = (width + flow_tile_size - 1) / flow_tile_size;
+  int row0 = tile / tiles_per_side * flow_tile_size;
+  int col0 = tile % tiles_per_side * flow_tile_size;
+  int row1 = std::min(row0 + flow_tile_size, width);
+  int col1 = std::min(col0 + flow_tile_size, width);
+  // Heights are per cell, the gradient is per cell size
+  float inv_cell = 0.5F * width / cur->scale;
+
+  for (int row = row0; row < row1; ++row) {
+    for (int col = col0; col < col1; ++col) {
+      int i = row * width + col;
+      float fx = 0;
+      float fz = 0;
+
+      int dir = goals->next[i];
+      if (dir >= 0) {
+        float k = params.seek / sqrtf((float)(dir_rows[dir] * dir_rows[dir] +
+                                              dir_cols[dir] * dir_cols[dir]));
+        fx += k * dir_rows[dir];
+        fz += k * dir_cols[dir];
+      }
+
+      if (cur->vals[i] > prev->vals[i]) {
+        int up = std::max(row - 1, 0) * width + col;
+        int down = std::min(row + 1, width - 1) * width + col;
+        int left = row * width + std::max(col - 1, 0);
+        int right = row * width + std::min(col + 1, width - 1);
+        fx -= params.flee * inv_cell * (cur->vals[down] - cur->vals[up]);
+        fz -= params.flee * inv_cell * (cur->vals[right] - cur->vals[left]);
+      }
+
+      float l = sqrtf(fx * fx + fz * fz);
+      if (l > 1) {
+        fx /= l;
+        fz /= l;
+      }
+      flow->dir_x[i] = fx;
+      flow->dir_z[i] = fz;
+    }
+  }
+}
+
+void
+update_flow_field(FlowField *flow, JobPool *pool, const DistanceField *goals,
+                  const Heightfield *prev, const Heightfield *cur,
+                  CrowdParams params) {
+  int tiles_per_side = (flow->width + flow_tile_size - 1) / flow_tile_size;
+  run_jobs(pool, tiles_per_side * tiles_per_side, [&](int tile) {
+    update_flow_tile(flow, goals, prev, cur, params, tile);
+  });
+}
+
+void
+init_crowd(Crowd *crowd, int capacity, float scale, CrowdParams params) {
+  capacity = (capacity + crowd_block - 1) / crowd_block * crowd_block;
+  crowd->params = params;
+  crowd->capacity = capacity;
+  crowd->n = 0;
+  crowd->scale = scale;
+  crowd->positions = (float *)calloc(3 * capacity, sizeof(float));
+  crowd->x = crowd->positions;
+  crowd->y = crowd->positions + capacity;
+  crowd->z = crowd->positions + 2 * capacity;
+  crowd->vx = (float *)calloc(capacity, sizeof(float));
+  crowd->vz = (float *)calloc(capacity, sizeof(float));
+  crowd->sorted_x = (float *)calloc(capacity, sizeof(float));
+  crowd->sorted_z = (float *)calloc(capacity, sizeof(float));
+  crowd->sorted_vx = (float *)calloc(capacity, sizeof(float));
+  crowd->sorted_vz = (float *)calloc(capacity, sizeof(float));
+
+  crowd->bins_per_side = std::max((int)(scale / params.radius), 1);
+  crowd->bin_size = scale / crowd->bins_per_side;
+  int n_bins = crowd->bins_per_side * crowd->bins_per_side;
+  crowd->bin_start = (int *)malloc(sizeof(int) * (n_bins + 1));
+  crowd->bin_fill = (int *)malloc(sizeof(int) * n_bins);
+  crowd->bin_of = (int *)malloc(sizeof(int) * capacity);
+}
+
+void
+free_crowd(Crowd *crowd) {
+  free(crowd->positions);
+  free(crowd->vx);
+  free(crowd->vz);
+  free(crowd->sorted_x);
+  free(crowd->sorted_z);
+  free(crowd->sorted_vx);
+  free(crowd->sorted_vz);
+  free(crowd->bin_start);
+  free(crowd->bin_fill);
+  free(crowd->bin_of);
+}
+
+void
+spawn_agents(Crowd *crowd, int n, uint32_t seed) {
+  // xorshift, the same agents for the same seed on every platform
+  uint32_t state = seed | 1;
+  auto next = [&] {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (float)(state >> 8) / (float)(1 << 24);
+  };
+  int end = std::min(crowd->n + n, crowd->capacity);
+  for (int i = crowd->n; i < end; ++i) {
+    crowd->x[i] = (next() - 0.5F) * crowd->scale;
+    crowd->z[i] = (next() - 0.5F) * crowd->scale;
+    crowd->y[i] = 0;
+    crowd->vx[i] = 0;
+    crowd->vz[i] = 0;
+  }
+  crowd->n = end;
+}
+
+static int
+bin_coord(const Crowd *crowd, float v) {
+  int b = (int)floorf((v / crowd->scale + 0.5F) * crowd->bins_per_side);
+  return std::clamp(b, 0, crowd->bins_per_side - 1);
+}
+
+// Counting sort of the agents by bin into the sorted_* arrays
+static void
+sort_agents(Crowd *crowd) {
+  int n_bins = crowd->bins_per_side * crowd->bins_per_side;
+  memset(crowd->bin_start, 0, sizeof(int) * (n_bins + 1));
+  for (int i = 0; i < crowd->n; ++i) {
+    int b = bin_coord(crowd, crowd->x[i]) * crowd->bins_per_side +
+            bin_coord(crowd, crowd->z[i]);
+    crowd->bin_of[i] = b;
+    ++crowd->bin_start[b + 1];
+  }
+  for (int b = 0; b < n_bins; ++b) {
+    crowd->bin_start[b + 1] += crowd->bin_start[b];
+  }
+  memcpy(crowd->bin_fill, crowd->bin_start, sizeof(int) * n_bins);
+  for (int i = 0; i < crowd->n; ++i) {
+    int dst = crowd->bin_fill[crowd->bin_of[i]]++;
+    crowd->sorted_x[dst] = crowd->x[i];
+    crowd->sorted_z[dst] = crowd->z[i];
+    crowd->sorted_vx[dst] = crowd->vx[i];
+    crowd->sorted_vz[dst] = crowd->vz[i];
+  }
+}
+
+// Push away from the agents within radius of agent i
+static void
+separation(const Crowd *crowd, int i, float *push_x, float *push_z) {
+  float px = crowd->sorted_x[i];
+  float pz = crowd->sorted_z[i];
+  float r = crowd->params.radius;
+  int bx = bin_coord(crowd, px);
+  int bz = bin_coord(crowd, pz);
+  int side = crowd->bins_per_side;
+  float r2 = r * r;
+  float inv_r = 1 / r;
+  float sx = 0;
+  float sz = 0;
+  for (int row = std::max(bx - 1, 0); row <= std::min(bx + 1, side - 1);
+       ++row) {
+    for (int col = std::max(bz - 1, 0); col <= std::min(bz + 1, side - 1);
+         ++col) {
+      int begin = crowd->bin_start[row * side + col];
+      int end = crowd->bin_start[row * side + col + 1];
+      end = std::min(end, begin + max_per_bin);
+      for (int j = begin; j < end; ++j) {
+        float dx = px - crowd->sorted_x[j];
+        float dz = pz - crowd->sorted_z[j];
+        float d2 = dx * dx + dz * dz;
+        // (r - d) / (r d), agent i itself and agents on the same spot give
+        // d2 == 0
+        float k = d2 < r2 && d2 > 0 ? math_rsqrt(d2) - inv_r : 0;
+        sx += k * dx;
+        sz += k * dz;
+      }
+    }
+  }
+  *push_x = sx;
+  *push_z = sz;
+}
+
+static void
+update_agents(Crowd *crowd, const FlowField *flow, const PassGrid *grid,
+              const Heightfield *hf, float dt, int begin, int end) {
+  const CrowdParams &params = crowd->params;
+  int width = hf->width;
+  float cell = hf->scale / width;
+  float lo = -0.5F * hf->scale;
+  float hi = 0.5F * hf->scale - cell;
+  float k = fminf(params.steer * dt, 1);
+  auto cell_of = [&](float v) {
+    int c = (int)floorf((v / hf->scale + 0.5F) * width + 0.5F);
+    return std::clamp(c, 0, width - 1);
+  };
+
+  for (int i0 = begin; i0 < end; i0 += crowd_block) {
+    int lanes = std::min(crowd_block, end - i0);
+    const float *__restrict sx = crowd->sorted_x + i0;
+    const float *__restrict sz = crowd->sorted_z + i0;
+    const float *__restrict svx = crowd->sorted_vx + i0;
+    const float *__restrict svz = crowd->sorted_vz + i0;
+    float *__restrict x = crowd->x + i0;
+    float *__restrict z = crowd->z + i0;
+    float *__restrict vx = crowd->vx + i0;
+    float *__restrict vz = crowd->vz + i0;
+
+    // Gathers, one lane at a time
+    alignas(32) float want_x[crowd_block] = {};
+    alignas(32) float want_z[crowd_block] = {};
+    alignas(32) float push_x[crowd_block] = {};
+    alignas(32) float push_z[crowd_block] = {};
+    for (int l = 0; l < lanes; ++l) {
+      int c = cell_of(sx[l]) * width + cell_of(sz[l]);
+      want_x[l] = flow->dir_x[c];
+      want_z[l] = flow->dir_z[c];
+      separation(crowd, i0 + l, &push_x[l], &push_z[l]);
+    }
+
+    // Steering and integration, the same operations on all lanes
+    for (int l = 0; l < crowd_block; ++l) {
+      float tx = params.max_speed * want_x[l] + params.separation * push_x[l];
+      float tz = params.max_speed * want_z[l] + params.separation * push_z[l];
+      float nvx = svx[l] + k * (tx - svx[l]);
+      float nvz = svz[l] + k * (tz - svz[l]);
+      float speed2 = nvx * nvx + nvz * nvz;
+      float limit = speed2 > params.max_speed * params.max_speed
+                        ? params.max_speed * math_rsqrt(speed2)
+                        : 1.0F;
+      nvx *= limit;
+      nvz *= limit;
+      vx[l] = nvx;
+      vz[l] = nvz;
+      x[l] = fminf(fmaxf(sx[l] + dt * nvx, lo), hi);
+      z[l] = fminf(fmaxf(sz[l] + dt * nvz, lo), hi);
+    }
+
+    // Blocked moves are undone, agents stand on the columns
+    for (int l = 0; l < lanes; ++l) {
+      int c = cell_of(x[l]) * width + cell_of(z[l]);
+      if (!grid->passable[c] &&
+          grid->passable[cell_of(sx[l]) * width + cell_of(sz[l])]) {
+        x[l] = sx[l];
+        z[l] = sz[l];
+        vx[l] = 0;
+        vz[l] = 0;
+        c = cell_of(x[l]) * width + cell_of(z[l]);
+      }
+      crowd->y[i0 + l] = hf->vals[c];
+    }
+  }
+}
+
+void
+update_crowd(Crowd *crowd, JobPool *pool, const FlowField *flow,
+             const PassGrid *grid, const Heightfield *hf, float dt) {
+  dt = fminf(dt, max_tick);
+  sort_agents(crowd);
+  int n_jobs = (crowd->n + crowd_job_size - 1) / crowd_job_size;
+  run_jobs(pool, n_jobs, [&](int job) {
+    int begin = job * crowd_job_size;
+    int end = std::min(begin + crowd_job_size, crowd->n);
+    update_agents(crowd, flow, grid, hf, dt, begin, end);
+  });
+}
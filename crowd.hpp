@@ -0,0 +1,95 @@
+#pragma once
+
+#include "jobs.hpp"
+#include "path.hpp"
+#include "terrain.hpp"
+
+#include <cstdint>
+
+// Agents are updated in blocks of crowd_block lanes, the agent arrays are
+// padded to a multiple of it
+constexpr int crowd_block = 8;
+constexpr int flow_tile_size = 16;
+
+struct CrowdParams {
+  // Agents closer than this push each other apart
+  float radius = 0.015F;
+  float max_speed = 0.5F;
+  // How quickly the velocity follows the wanted one, per second
+  float steer = 4.0F;
+  // Weights of seeking the goals, fleeing rising water and separation
+  float seek = 1.0F;
+  float flee = 8.0F;
+  float separation = 1.0F;
+};
+
+/*
+   Wanted direction per terrain cell: along a distance field towards the
+   nearest goal, and downhill where the water rises. Tiles of
+   flow_tile_size^2 cells are computed as separate jobs.
+*/
+struct FlowField {
+  int width;
+  float *dir_x;
+  float *dir_z;
+};
+
+void
+init_flow_field(FlowField *flow, int width);
+
+void
+free_flow_field(FlowField *flow);
+
+// prev and cur are the terrain at the start and the end of the tick
+void
+update_flow_field(FlowField *flow, JobPool *pool, const DistanceField *goals,
+                  const Heightfield *prev, const Heightfield *cur,
+                  CrowdParams params);
+
+/*
+   Agents as structure of arrays. Each update sorts them by the bin of the
+   x/z plane they are in, bins are radius wide so the neighbours of an agent
+   are in the 3x3 bins around it, next to each other in memory.
+   x, y and z are consecutive capacity long ranges of positions, ready to be
+   uploaded as per instance attributes.
+*/
+struct Crowd {
+  CrowdParams params;
+  int capacity;
+  int n;
+  float scale;
+  float *positions;
+  float *x;
+  float *y;
+  float *z;
+  float *vx;
+  float *vz;
+  // Copies of the above in bin order, the update reads only these
+  float *sorted_x;
+  float *sorted_z;
+  float *sorted_vx;
+  float *sorted_vz;
+  int bins_per_side;
+  float bin_size;
+  // Agents of bin b are sorted_*[bin_start[b], bin_start[b + 1])
+  int *bin_start;
+  int *bin_fill;
+  int *bin_of;
+};
+
+// scale is the size of the terrain the agents walk on
+void
+init_crowd(Crowd *crowd, int capacity, float scale, CrowdParams params);
+
+void
+free_crowd(Crowd *crowd);
+
+// Adds up to n agents at rest, spread uniformly over the terrain
+void
+spawn_agents(Crowd *crowd, int n, uint32_t seed);
+
+// Agents keep off the cells grid does not let them walk on. The result
+// does not depend on the number of threads in pool.
+void
+update_crowd(Crowd *crowd, JobPool *pool, const FlowField *flow,
+             const PassGrid *grid, const Heightfield *hf, float dt);
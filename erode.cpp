@@ -0,0 +1,90 @@
+#include "erosion.hpp"
+#include "jobs.hpp"
+#include "noise.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+   Generates an eroded base terrain for the game (game -base FILE):
+   erode [-size N] [-seed S] [-droplets D] [-threads T]
+         [-noise value|perlin|simplex] [-ridged] [-warp W] -out FILE
+*/
+
+static void
+print_progress(float done, void *) {
+  printf("\rEroding %3d%%", (int)(100 * done));
+  fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+  int width = 2048;
+  uint32_t seed = 1;
+  int n_threads = -1;
+  const char *out = nullptr;
+  ErosionParams params;
+  NoiseParams noise;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+      width = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      seed = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-droplets") == 0 && i + 1 < argc) {
+      params.droplets_per_cell = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+      n_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-noise") == 0 && i + 1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "value") == 0) {
+        noise.kind = NoiseKind::Value;
+      } else if (strcmp(argv[i], "perlin") == 0) {
+        noise.kind = NoiseKind::Perlin;
+      } else if (strcmp(argv[i], "simplex") == 0) {
+        noise.kind = NoiseKind::Simplex;
+      } else {
+        out = nullptr;
+        break;
+      }
+    } else if (strcmp(argv[i], "-ridged") == 0) {
+      noise.fractal = NoiseFractal::Ridged;
+    } else if (strcmp(argv[i], "-warp") == 0 && i + 1 < argc) {
+      noise.warp = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc) {
+      out = argv[++i];
+    } else {
+      out = nullptr;
+      break;
+    }
+  }
+  if (out == nullptr || width < 2) {
+    fprintf(stderr, "Usage: erode [-size N] [-seed S] [-droplets D] "
+                    "[-threads T] [-noise value|perlin|simplex] [-ridged] "
+                    "[-warp W] -out FILE\n");
+    exit(1);
+  }
+
+  JobPool pool;
+  init_job_pool(&pool, n_threads);
+  float *vals = (float *)malloc(sizeof(float) * width * width);
+  noise.seed = seed;
+  generate_base_terrain(vals, width, 0.4F, noise, &pool);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  erode_heights(vals, width, params, seed, &pool, print_progress, nullptr);
+  float seconds = std::chrono::duration<float>(
+                      std::chrono::high_resolution_clock::now() - start)
+                      .count();
+  printf("\n%d^2 with %d threads in %.2f s\n", width, pool.n_threads + 1,
+         seconds);
+
+  if (!save_heights(out, vals, width)) {
+    fprintf(stderr, "Can't write %s\n", out);
+    exit(1);
+  }
+  free(vals);
+  free_job_pool(&pool);
+  return 0;
+}
@@ -0,0 +1,217 @@
+#include "erosion.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Droplets are spread over this many passes over the checkerboard, the
+// tiles of one color see each others droplets between passes
+constexpr int erosion_passes = 8;
+// A droplet moves a cell per step, it never gets further than this from
+// the tile it started in
+constexpr int erosion_margin = erosion_tile_size / 2;
+static_assert(erosion_margin < erosion_tile_size,
+              "Tiles of the same color must not share cells");
+
+static uint32_t
+hash(uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t h = a * 0x9e3779b1U ^ b * 0x85ebca77U ^ c * 0xc2b2ae3dU;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6dU;
+  h ^= h >> 12;
+  h *= 0x297a2d39U;
+  h ^= h >> 15;
+  return h;
+}
+
+struct Random {
+  uint32_t state;
+};
+
+// In [0, 1)
+static float
+next_float(Random *rng) {
+  uint32_t x = rng->state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  rng->state = x;
+  return (float)(x >> 8) / (float)(1 << 24);
+}
+
+struct ErosionTile {
+  int row0;
+  int col0;
+  int row1;
+  int col1;
+  // Cells the droplets of the tile may touch
+  int min_row;
+  int min_col;
+  int max_row;
+  int max_col;
+};
+
+static void
+run_droplets(float *vals, int width, const ErosionParams &params,
+             const ErosionTile &tile, uint32_t seed, int n_droplets) {
+  // Heights in cells
+  float to_cells = width / params.scale;
+  float to_height = 1 / to_cells;
+  Random rng{seed | 1};
+
+  for (int d = 0; d < n_droplets; ++d) {
+    float px = tile.row0 + next_float(&rng) * (tile.row1 - tile.row0);
+    float pz = tile.col0 + next_float(&rng) * (tile.col1 - tile.col0);
+    float dx = 0;
+    float dz = 0;
+    float speed = 1;
+    float water = 1;
+    float sediment = 0;
+
+    for (int step = 0; step < params.max_steps; ++step) {
+      int i = (int)floorf(px);
+      int j = (int)floorf(pz);
+      if (i < tile.min_row || i + 1 > tile.max_row || j < tile.min_col ||
+          j + 1 > tile.max_col) {
+        break;
+      }
+      float fx = px - i;
+      float fz = pz - j;
+      int c00 = i * width + j;
+      float h00 = vals[c00] * to_cells;
+      float h01 = vals[c00 + 1] * to_cells;
+      float h10 = vals[c00 + width] * to_cells;
+      float h11 = vals[c00 + width + 1] * to_cells;
+      float h = h00 * (1 - fx) * (1 - fz) + h01 * (1 - fx) * fz +
+                h10 * fx * (1 - fz) + h11 * fx * fz;
+      float gx = (h10 - h00) * (1 - fz) + (h11 - h01) * fz;
+      float gz = (h01 - h00) * (1 - fx) + (h11 - h10) * fx;
+
+      dx = dx * params.inertia - gx * (1 - params.inertia);
+      dz = dz * params.inertia - gz * (1 - params.inertia);
+      float len = sqrtf(dx * dx + dz * dz);
+      if (len < 1e-6F) {
+        break;
+      }
+      dx /= len;
+      dz /= len;
+      px += dx;
+      pz += dz;
+
+      int ni = (int)floorf(px);
+      int nj = (int)floorf(pz);
+      if (ni < tile.min_row || ni + 1 > tile.max_row || nj < tile.min_col ||
+          nj + 1 > tile.max_col) {
+        break;
+      }
+      float nfx = px - ni;
+      float nfz = pz - nj;
+      int n00 = ni * width + nj;
+      float new_h = (vals[n00] * (1 - nfx) * (1 - nfz) +
+                     vals[n00 + 1] * (1 - nfx) * nfz +
+                     vals[n00 + width] * nfx * (1 - nfz) +
+                     vals[n00 + width + 1] * nfx * nfz) *
+                    to_cells;
+      float dh = new_h - h;
+
+      // Deposit or erode at the corners of the cell the droplet left
+      float w[4] = {(1 - fx) * (1 - fz), (1 - fx) * fz, fx * (1 - fz),
+                    fx * fz};
+      int cells[4] = {c00, c00 + 1, c00 + width, c00 + width + 1};
+      float capacity =
+          fmaxf(-dh * speed * water * params.capacity, params.min_capacity);
+      if (sediment > capacity || dh > 0) {
+        float amount = dh > 0 ? fminf(dh, sediment)
+                              : (sediment - capacity) * params.deposit_speed;
+        sediment -= amount;
+        for (int k = 0; k < 4; ++k) {
+          vals[cells[k]] += amount * w[k] * to_height;
+        }
+      } else {
+        float amount = fminf((capacity - sediment) * params.erode_speed, -dh);
+        sediment += amount;
+        for (int k = 0; k < 4; ++k) {
+          vals[cells[k]] -= amount * w[k] * to_height;
+        }
+      }
+
+      speed = sqrtf(fmaxf(speed * speed - dh * params.gravity, 0));
+      water *= 1 - params.evaporate_speed;
+    }
+  }
+}
+
+void
+erode_heights(float *vals, int width, ErosionParams params, uint32_t seed,
+              JobPool *pool, ErosionProgress progress, void *progress_ctx) {
+  int tiles_per_side = (width + erosion_tile_size - 1) / erosion_tile_size;
+  // Tiles by checkerboard color
+  std::vector<ErosionTile> colors[4];
+  for (int tr = 0; tr < tiles_per_side; ++tr) {
+    for (int tc = 0; tc < tiles_per_side; ++tc) {
+      ErosionTile tile;
+      tile.row0 = tr * erosion_tile_size;
+      tile.col0 = tc * erosion_tile_size;
+      tile.row1 = std::min(tile.row0 + erosion_tile_size, width);
+      tile.col1 = std::min(tile.col0 + erosion_tile_size, width);
+      tile.min_row = std::max(tile.row0 - erosion_margin, 0);
+      tile.min_col = std::max(tile.col0 - erosion_margin, 0);
+      tile.max_row = std::min(tile.row1 + erosion_margin, width) - 1;
+      tile.max_col = std::min(tile.col1 + erosion_margin, width) - 1;
+      colors[(tr % 2) * 2 + tc % 2].push_back(tile);
+    }
+  }
+
+  float per_cell = params.droplets_per_cell / erosion_passes;
+  for (int pass = 0; pass < erosion_passes; ++pass) {
+    for (int color = 0; color < 4; ++color) {
+      const std::vector<ErosionTile> &tiles = colors[color];
+      run_jobs(pool, (int)tiles.size(), [&](int k) {
+        const ErosionTile &tile = tiles[k];
+        int area = (tile.row1 - tile.row0) * (tile.col1 - tile.col0);
+        int tile_id = tile.row0 / erosion_tile_size * tiles_per_side +
+                      tile.col0 / erosion_tile_size;
+        run_droplets(vals, width, params, tile, hash(seed, pass, tile_id),
+                     (int)(area * per_cell + 0.5F));
+      });
+      if (progress != nullptr) {
+        progress((float)(pass * 4 + color + 1) / (erosion_passes * 4),
+                 progress_ctx);
+      }
+    }
+  }
+}
+
+bool
+save_heights(const char *path, const float *vals, int width) {
+  FILE *f = fopen(path, "wb");
+  if (f == nullptr) {
+    return false;
+  }
+  size_t n = (size_t)width * width;
+  bool ok = fwrite(&width, sizeof(int), 1, f) == 1 &&
+            fwrite(vals, sizeof(float), n, f) == n;
+  fclose(f);
+  return ok;
+}
+
+float *
+load_heights(const char *path, int *width) {
+  FILE *f = fopen(path, "rb");
+  if (f == nullptr) {
+    return nullptr;
+  }
+  float *vals = nullptr;
+  if (fread(width, sizeof(int), 1, f) == 1 && *width > 0) {
+    size_t n = (size_t)*width * *width;
+    vals = (float *)malloc(sizeof(float) * n);
+    if (fread(vals, sizeof(float), n, f) != n) {
+      free(vals);
+      vals = nullptr;
+    }
+  }
+  fclose(f);
+  return vals;
+}
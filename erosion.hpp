@@ -0,0 +1,46 @@
+#pragma once
+
+#include "jobs.hpp"
+
+#include <cstdint>
+
+// Droplets are simulated per tile, tiles of the same color of a 2x2
+// checkerboard never share a cell so they run in parallel
+constexpr int erosion_tile_size = 64;
+
+/*
+   Droplet erosion, heights in world units on a terrain scale wide. Droplet
+   quantities are per cell with heights converted to cells, so the result
+   looks the same at any resolution.
+*/
+struct ErosionParams {
+  float scale = 6.0F;
+  float droplets_per_cell = 1.0F;
+  int max_steps = 30;
+  // How much of its direction a droplet keeps over the downhill one
+  float inertia = 0.05F;
+  float capacity = 4.0F;
+  float min_capacity = 0.01F;
+  float erode_speed = 0.3F;
+  float deposit_speed = 0.3F;
+  float evaporate_speed = 0.01F;
+  float gravity = 4.0F;
+};
+
+// Called after each checkerboard phase with the fraction of droplets done
+using ErosionProgress = void (*)(float done, void *ctx);
+
+// Erodes the width x width heights vals in place. The result depends only on
+// the heights, params and seed, not on the threads in pool.
+void
+erode_heights(float *vals, int width, ErosionParams params, uint32_t seed,
+              JobPool *pool, ErosionProgress progress = nullptr,
+              void *progress_ctx = nullptr);
+
+// A width followed by width * width floats, row by row
+bool
+save_heights(const char *path, const float *vals, int width);
+
+// Returns malloc'ed heights and sets width, null when the file can't be read
+float *
+load_heights(const char *path, int *width);
@@ -0,0 +1,166 @@
+#include "fast_math.hpp"
+
+// Same polynomials as the scalar functions in the same order, the lanes
+// round the same way: _mm_cvtps_epi32 rounds to nearest even like rintf
+#if !defined(MATH_SCALAR) && (defined(__SSE2__) || defined(_M_X64))
+#define FAST_MATH_SIMD
+#endif
+
+#ifdef FAST_MATH_SIMD
+static inline __m128
+blend(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128
+poly(__m128 x, __m128 c, __m128 rest) {
+  return _mm_add_ps(c, _mm_mul_ps(x, rest));
+}
+
+static inline void
+sincos4(__m128 x, __m128 *s, __m128 *c) {
+  __m128i quarter = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(2 / pi)));
+  __m128 q = _mm_cvtepi32_ps(quarter);
+  __m128 r = _mm_sub_ps(x, _mm_mul_ps(q, _mm_set1_ps(1.5703125F)));
+  r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(4.837512969970703125e-4F)));
+  r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(7.54978995489188216e-8F)));
+  __m128 r2 = _mm_mul_ps(r, r);
+
+  __m128 sin_r = poly(r2, _mm_set1_ps(8.3321608736e-3F),
+                      _mm_set1_ps(-1.9515295891e-4F));
+  sin_r = poly(r2, _mm_set1_ps(-1.6666654611e-1F), sin_r);
+  sin_r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, r2), sin_r));
+
+  __m128 cos_r = poly(r2, _mm_set1_ps(-1.388731625493765e-3F),
+                      _mm_set1_ps(2.443315711809948e-5F));
+  cos_r = poly(r2, _mm_set1_ps(4.166664568298827e-2F), cos_r);
+  cos_r = _mm_add_ps(
+      _mm_sub_ps(_mm_set1_ps(1), _mm_mul_ps(_mm_set1_ps(0.5F), r2)),
+      _mm_mul_ps(_mm_mul_ps(r2, r2), cos_r));
+
+  __m128i one = _mm_set1_epi32(1);
+  __m128 odd =
+      _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quarter, one), one));
+  __m128 sn = blend(odd, cos_r, sin_r);
+  __m128 cs = blend(odd, sin_r, cos_r);
+  // Bit 1 of the quarter moved to the sign bit
+  __m128i two = _mm_set1_epi32(2);
+  __m128i sin_sign = _mm_slli_epi32(_mm_and_si128(quarter, two), 30);
+  __m128i cos_sign =
+      _mm_slli_epi32(_mm_and_si128(_mm_add_epi32(quarter, one), two), 30);
+  *s = _mm_xor_ps(sn, _mm_castsi128_ps(sin_sign));
+  *c = _mm_xor_ps(cs, _mm_castsi128_ps(cos_sign));
+}
+
+static inline __m128
+exp2_4(__m128 x) {
+  x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0F)), _mm_set1_ps(127.0F));
+  __m128i k = _mm_cvtps_epi32(x);
+  __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(k));
+  __m128 p = poly(f, _mm_set1_ps(0.0013333558146428F),
+                  _mm_set1_ps(0.0001540353039338F));
+  p = poly(f, _mm_set1_ps(0.0096181291076285F), p);
+  p = poly(f, _mm_set1_ps(0.0555041086648216F), p);
+  p = poly(f, _mm_set1_ps(0.2402265069591007F), p);
+  p = poly(f, _mm_set1_ps(0.6931471805599453F), p);
+  p = poly(f, _mm_set1_ps(1), p);
+  __m128i scale =
+      _mm_slli_epi32(_mm_add_epi32(k, _mm_set1_epi32(127)), 23);
+  return _mm_mul_ps(p, _mm_castsi128_ps(scale));
+}
+
+static inline __m128
+log2_4(__m128 x) {
+  __m128i bits = _mm_castps_si128(x);
+  __m128i e =
+      _mm_srai_epi32(_mm_sub_epi32(bits, _mm_set1_epi32(0x3f3504f3)), 23);
+  __m128 m = _mm_castsi128_ps(_mm_sub_epi32(bits, _mm_slli_epi32(e, 23)));
+  __m128 one = _mm_set1_ps(1);
+  __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+  __m128 t2 = _mm_mul_ps(t, t);
+  __m128 l = poly(t2, _mm_set1_ps(0.412198583111132F),
+                  _mm_set1_ps(0.320598897975325F));
+  l = poly(t2, _mm_set1_ps(0.577078016355585F), l);
+  l = poly(t2, _mm_set1_ps(0.961796693925976F), l);
+  l = poly(t2, _mm_set1_ps(2.885390081777927F), l);
+  return _mm_add_ps(_mm_cvtepi32_ps(e), _mm_mul_ps(t, l));
+}
+
+static inline __m128
+rsqrt4(__m128 x) {
+  __m128 r = _mm_rsqrt_ps(x);
+  __m128 xrr = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5F), x), r), r);
+  return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5F), xrr));
+}
+#endif
+
+void
+fast_sincos_n(const float *xs, float *sins, float *coss, size_t n) {
+  size_t i = 0;
+#ifdef FAST_MATH_SIMD
+  for (; i + 4 <= n; i += 4) {
+    __m128 s;
+    __m128 c;
+    sincos4(_mm_loadu_ps(xs + i), &s, &c);
+    if (sins != nullptr) {
+      _mm_storeu_ps(sins + i, s);
+    }
+    if (coss != nullptr) {
+      _mm_storeu_ps(coss + i, c);
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    float s;
+    float c;
+    fast_sincos(xs[i], &s, &c);
+    if (sins != nullptr) {
+      sins[i] = s;
+    }
+    if (coss != nullptr) {
+      coss[i] = c;
+    }
+  }
+}
+
+void
+fast_pow_n(const float *xs, float y, float *out, size_t n) {
+  size_t i = 0;
+#ifdef FAST_MATH_SIMD
+  __m128 y4 = _mm_set1_ps(y);
+  for (; i + 4 <= n; i += 4) {
+    __m128 l = log2_4(_mm_loadu_ps(xs + i));
+    _mm_storeu_ps(out + i, exp2_4(_mm_mul_ps(y4, l)));
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = fast_pow(xs[i], y);
+  }
+}
+
+void
+fast_rsqrt_n(const float *xs, float *out, size_t n) {
+  size_t i = 0;
+#ifdef FAST_MATH_SIMD
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(out + i, rsqrt4(_mm_loadu_ps(xs + i)));
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = fast_rsqrt(xs[i]);
+  }
+}
+
+void
+math_sincos_n(const float *xs, float *sins, float *coss, size_t n) {
+  if (use_fast_math) {
+    fast_sincos_n(xs, sins, coss, n);
+    return;
+  }
+  for (size_t i = 0; sins != nullptr && i < n; ++i) {
+    sins[i] = sinf(xs[i]);
+  }
+  for (size_t i = 0; coss != nullptr && i < n; ++i) {
+    coss[i] = cosf(xs[i]);
+  }
+}
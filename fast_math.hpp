@@ -0,0 +1,164 @@
+#pragma once
+
+#include "math.hpp"
+
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if !defined(MATH_SCALAR) && (defined(__SSE2__) || defined(_M_X64))
+#include <immintrin.h>
+#endif
+
+/*
+   Approximations of the libm functions the per cell loops call. The errors
+   are against double precision libm over the given ranges, checked by
+   check_fast_math in math_bench.
+
+   The math_* functions are libm unless the build sets MATH_FAST, then they
+   are these.
+*/
+
+#ifdef MATH_FAST
+constexpr bool use_fast_math = true;
+#else
+constexpr bool use_fast_math = false;
+#endif
+
+// sin and cos of x, absolute error below 1e-7 for |x| <= 8192, where the
+// reduction by pi / 2 in three parts is exact
+inline void
+fast_sincos(float x, float *s, float *c) {
+  float q = rintf(x * (2 / pi));
+  float r = x - q * 1.5703125F;
+  r = r - q * 4.837512969970703125e-4F;
+  r = r - q * 7.54978995489188216e-8F;
+  float r2 = r * r;
+  float sin_r =
+      r + r * r2 *
+              (-1.6666654611e-1F + r2 * (8.3321608736e-3F +
+                                         r2 * -1.9515295891e-4F));
+  float cos_r =
+      1 - 0.5F * r2 +
+      r2 * r2 *
+          (4.166664568298827e-2F +
+           r2 * (-1.388731625493765e-3F + r2 * 2.443315711809948e-5F));
+  // Each quarter turn rotates (cos, sin) by 90 degrees
+  int quarter = (int)q;
+  float sn = quarter & 1 ? cos_r : sin_r;
+  float cs = quarter & 1 ? sin_r : cos_r;
+  *s = quarter & 2 ? -sn : sn;
+  *c = (quarter + 1) & 2 ? -cs : cs;
+}
+
+inline float
+fast_sin(float x) {
+  float s;
+  float c;
+  fast_sincos(x, &s, &c);
+  return s;
+}
+
+inline float
+fast_cos(float x) {
+  float s;
+  float c;
+  fast_sincos(x, &s, &c);
+  return c;
+}
+
+// 2^x, error below 3 ulp. x is clamped to [-126, 127].
+inline float
+fast_exp2(float x) {
+  x = fminf(fmaxf(x, -126.0F), 127.0F);
+  float k = rintf(x);
+  // 2^f for f in [-1/2, 1/2] by its Taylor series
+  float f = x - k;
+  float p =
+      1 + f * (0.6931471805599453F +
+               f * (0.2402265069591007F +
+                    f * (0.0555041086648216F +
+                         f * (0.0096181291076285F +
+                              f * (0.0013333558146428F +
+                                   f * 0.0001540353039338F)))));
+  return p * std::bit_cast<float>(((int32_t)k + 127) << 23);
+}
+
+// log2 of a positive normal x, absolute error below 1.2e-7 in [1/2, 2) and
+// 1.2 ulp of the result elsewhere
+inline float
+fast_log2(float x) {
+  // x = m 2^e with m in [sqrt(1/2), sqrt(2))
+  int32_t bits = std::bit_cast<int32_t>(x);
+  int32_t e = (bits - 0x3f3504f3) >> 23;
+  float m = std::bit_cast<float>(bits - (e << 23));
+  // 2 atanh(t) / ln(2) by its series, |t| < 0.172
+  float t = (m - 1) / (m + 1);
+  float t2 = t * t;
+  float l = t * (2.885390081777927F +
+                 t2 * (0.961796693925976F +
+                       t2 * (0.577078016355585F +
+                             t2 * (0.412198583111132F +
+                                   t2 * 0.320598897975325F))));
+  return (float)e + l;
+}
+
+// x^y for x > 0 as 2^(y log2(x)), the relative error grows with the size of
+// the exponent: below (1 + |y log2(x)|) 2.5e-7. Other x go to powf.
+inline float
+fast_pow(float x, float y) {
+  if (!(x > 0)) {
+    return powf(x, y);
+  }
+  return fast_exp2(y * fast_log2(x));
+}
+
+// 1 / sqrt(x) for x > 0 with a Newton step after the estimate. Relative
+// error below 3e-7 with SSE, 5e-6 from the bit trick without.
+inline float
+fast_rsqrt(float x) {
+#if !defined(MATH_SCALAR) && (defined(__SSE2__) || defined(_M_X64))
+  float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+  float r =
+      std::bit_cast<float>(0x5f375a86 - (std::bit_cast<int32_t>(x) >> 1));
+  r = r * (1.5F - 0.5F * x * r * r);
+#endif
+  return r * (1.5F - 0.5F * x * r * r);
+}
+
+// The same over arrays, 4 lanes at a time with SSE2. Each lane gives the
+// result of the scalar function. Either of sins and coss may be null,
+// fast_pow_n needs all xs > 0.
+void
+fast_sincos_n(const float *xs, float *sins, float *coss, size_t n);
+
+void
+fast_pow_n(const float *xs, float y, float *out, size_t n);
+
+void
+fast_rsqrt_n(const float *xs, float *out, size_t n);
+
+inline float
+math_sin(float x) {
+  return use_fast_math ? fast_sin(x) : sinf(x);
+}
+
+inline float
+math_cos(float x) {
+  return use_fast_math ? fast_cos(x) : cosf(x);
+}
+
+inline float
+math_pow(float x, float y) {
+  return use_fast_math ? fast_pow(x, y) : powf(x, y);
+}
+
+inline float
+math_rsqrt(float x) {
+  return use_fast_math ? fast_rsqrt(x) : 1 / sqrtf(x);
+}
+
+void
+math_sincos_n(const float *xs, float *sins, float *coss, size_t n);
@@ -0,0 +1,508 @@
+#define GLEW_STATIC
+#include "gpu.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <filesystem>
+#include <iterator>
+#include <thread>
+
+typedef std::chrono::high_resolution_clock clock_type;
+
+static float
+ms_between(clock_type::time_point start, clock_type::time_point end) {
+  return std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(
+             end - start)
+      .count();
+}
+
+void
+init_frame_timers(FrameTimers *timers) {
+  *timers = FrameTimers{};
+  // Timestamps are core since 3.3, llvmpipe exposes them as well
+  timers->gpu_supported = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+  if (timers->gpu_supported) {
+    glGenQueries(sizeof(timers->queries) / sizeof(GLuint),
+                 &timers->queries[0][0][0]);
+  }
+}
+
+void
+begin_frame(FrameTimers *timers) {
+  int slot = timers->frame % gpu_timer_frames;
+  FrameStats *stats = &timers->pending[slot];
+  stats->frame = timers->frame;
+  stats->n_scopes = 0;
+
+  timers->cpu_start[max_frame_scopes] = clock_type::now();
+  if (timers->gpu_supported) {
+    glQueryCounter(timers->queries[slot][max_frame_scopes][0], GL_TIMESTAMP);
+  }
+}
+
+int
+begin_scope(FrameTimers *timers, const char *name) {
+  int slot = timers->frame % gpu_timer_frames;
+  FrameStats *stats = &timers->pending[slot];
+  if (stats->n_scopes == max_frame_scopes) {
+    return -1;
+  }
+
+  int scope = stats->n_scopes++;
+  stats->names[scope] = name;
+  stats->gpu_ms[scope] = -1;
+  timers->cpu_start[scope] = clock_type::now();
+  if (timers->gpu_supported) {
+    glQueryCounter(timers->queries[slot][scope][0], GL_TIMESTAMP);
+  }
+  return scope;
+}
+
+void
+end_scope(FrameTimers *timers, int scope) {
+  if (scope < 0) {
+    return;
+  }
+  int slot = timers->frame % gpu_timer_frames;
+  FrameStats *stats = &timers->pending[slot];
+  stats->cpu_ms[scope] =
+      ms_between(timers->cpu_start[scope], clock_type::now());
+  if (timers->gpu_supported) {
+    glQueryCounter(timers->queries[slot][scope][1], GL_TIMESTAMP);
+  }
+}
+
+static float
+query_ms(GLuint start_query, GLuint end_query) {
+  GLuint64 start;
+  GLuint64 end;
+  glGetQueryObjectui64v(start_query, GL_QUERY_RESULT, &start);
+  glGetQueryObjectui64v(end_query, GL_QUERY_RESULT, &end);
+  return (float)(end - start) / 1e6F;
+}
+
+bool
+end_frame(FrameTimers *timers, FrameStats *stats) {
+  int slot = timers->frame % gpu_timer_frames;
+  FrameStats *current = &timers->pending[slot];
+  current->frame_cpu_ms =
+      ms_between(timers->cpu_start[max_frame_scopes], clock_type::now());
+  current->frame_gpu_ms = -1;
+  if (timers->gpu_supported) {
+    glQueryCounter(timers->queries[slot][max_frame_scopes][1], GL_TIMESTAMP);
+  }
+  timers->in_flight[slot] = true;
+
+  timers->frame++;
+
+  // The oldest slot is reused next frame, collect it now if the GPU is done.
+  // When it is not done yet its results are dropped instead of waited for.
+  int oldest = timers->frame % gpu_timer_frames;
+  if (!timers->in_flight[oldest]) {
+    return false;
+  }
+  timers->in_flight[oldest] = false;
+  *stats = timers->pending[oldest];
+  if (!timers->gpu_supported) {
+    return true;
+  }
+
+  GLuint(*queries)[2] = timers->queries[oldest];
+  GLint available = GL_FALSE;
+  glGetQueryObjectiv(queries[max_frame_scopes][1], GL_QUERY_RESULT_AVAILABLE,
+                     &available);
+  if (available != GL_TRUE) {
+    return true;
+  }
+
+  // Queries complete in order, once the frame end is available all are
+  for (int i = 0; i < stats->n_scopes; ++i) {
+    stats->gpu_ms[i] = query_ms(queries[i][0], queries[i][1]);
+  }
+  stats->frame_gpu_ms =
+      query_ms(queries[max_frame_scopes][0], queries[max_frame_scopes][1]);
+  return true;
+}
+
+void
+print(const FrameStats *stats) {
+  printf("frame %d: cpu %.3fms gpu %.3fms input latency %.3fms\n",
+         stats->frame, stats->frame_cpu_ms, stats->frame_gpu_ms,
+         stats->input_latency_ms);
+  for (int i = 0; i < stats->n_scopes; ++i) {
+    printf("  %-10s cpu %.3fms gpu %.3fms\n", stats->names[i],
+           stats->cpu_ms[i], stats->gpu_ms[i]);
+  }
+}
+
+void
+init_frame_latency(FrameLatency *latency, int frames_in_flight) {
+  *latency = FrameLatency{};
+  if (frames_in_flight < 1) {
+    frames_in_flight = 1;
+  }
+  if (frames_in_flight > max_frames_in_flight) {
+    frames_in_flight = max_frames_in_flight;
+  }
+  latency->frames_in_flight = frames_in_flight;
+}
+
+void
+wait_for_frame_slot(FrameLatency *latency) {
+  int slot = latency->frame % latency->frames_in_flight;
+  GLsync fence = latency->fences[slot];
+  if (fence == nullptr) {
+    return;
+  }
+
+  constexpr GLuint64 timeout_ns = 1000000000;
+  GLenum res = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns);
+  while (res == GL_TIMEOUT_EXPIRED) {
+    res = glClientWaitSync(fence, 0, timeout_ns);
+  }
+  glDeleteSync(fence);
+  latency->fences[slot] = nullptr;
+  latency->latency_ms =
+      ms_between(latency->input_time[slot], clock_type::now());
+}
+
+void
+mark_input_sampled(FrameLatency *latency) {
+  int slot = latency->frame % latency->frames_in_flight;
+  latency->input_time[slot] = clock_type::now();
+}
+
+void
+fence_frame(FrameLatency *latency) {
+  int slot = latency->frame % latency->frames_in_flight;
+  latency->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  latency->frame++;
+}
+
+static GLuint
+issue_shader(const char *source, const char *defines, GLenum type) {
+  GLuint gl_ptr = glCreateShader(type);
+
+  // Defines must come after the #version line
+  const char *version = strstr(source, "#version");
+  const char *version_end = version ? strchr(version, '\n') : nullptr;
+  if (defines != nullptr && version_end != nullptr) {
+    const char *strings[3] = {source, defines, version_end + 1};
+    GLint lengths[3] = {(GLint)(version_end + 1 - source), -1, -1};
+    glShaderSource(gl_ptr, 3, strings, lengths);
+  } else {
+    glShaderSource(gl_ptr, 1, &source, nullptr);
+  }
+  // No status query here, that would wait for the compile
+  glCompileShader(gl_ptr);
+  return gl_ptr;
+}
+
+static uint64_t
+hash_string(uint64_t hash, const char *str) {
+  // FNV-1a, the terminating zero is hashed too so "ab", "c" != "a", "bc"
+  if (str == nullptr) {
+    str = "";
+  }
+  do {
+    hash ^= (unsigned char)*str;
+    hash *= 0x100000001b3ULL;
+  } while (*str++ != 0);
+  return hash;
+}
+
+void
+init_program_cache(ProgramCache *cache, const char *dir) {
+  *cache = ProgramCache{};
+  cache->dir = dir;
+
+  GLint n_formats = 0;
+  if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) {
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+  }
+  std::error_code err;
+  std::filesystem::create_directories(dir, err);
+  cache->supported = n_formats > 0 && !err;
+
+  // Let the driver compile on as many threads as it likes
+  if (GLEW_KHR_parallel_shader_compile) {
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    cache->parallel = true;
+  } else if (GLEW_ARB_parallel_shader_compile) {
+    glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    cache->parallel = true;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = hash_string(hash, (const char *)glGetString(GL_VENDOR));
+  hash = hash_string(hash, (const char *)glGetString(GL_RENDERER));
+  hash = hash_string(hash, (const char *)glGetString(GL_VERSION));
+  cache->driver_hash = hash;
+}
+
+static void
+cache_path(const ProgramCache *cache, const ProgramSource *source,
+           char *path, size_t path_size) {
+  uint64_t hash = cache->driver_hash;
+  hash = hash_string(hash, source->vertex);
+  hash = hash_string(hash, source->fragment);
+  hash = hash_string(hash, source->compute);
+  hash = hash_string(hash, source->frag_out);
+  hash = hash_string(hash, source->defines);
+  for (const char *attrib : source->attribs) {
+    hash = hash_string(hash, attrib);
+  }
+  snprintf(path, path_size, "%s/%016llx.bin", cache->dir,
+           (unsigned long long)hash);
+}
+
+static bool
+load_cached_program(GLuint program, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == nullptr) {
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  long fsize = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  bool loaded = false;
+  GLenum format;
+  if (fsize > (long)sizeof(format) &&
+      fread(&format, sizeof(format), 1, f) == 1) {
+    size_t blob_size = fsize - sizeof(format);
+    void *blob = malloc(blob_size);
+    if (fread(blob, 1, blob_size, f) == blob_size) {
+      glProgramBinary(program, format, blob, blob_size);
+      GLint status;
+      glGetProgramiv(program, GL_LINK_STATUS, &status);
+      loaded = status == GL_TRUE;
+    }
+    free(blob);
+  }
+  fclose(f);
+  return loaded;
+}
+
+static void
+store_cached_program(GLuint program, const char *path) {
+  GLint blob_size = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &blob_size);
+  if (blob_size <= 0) {
+    return;
+  }
+  void *blob = malloc(blob_size);
+  GLenum format;
+  glGetProgramBinary(program, blob_size, nullptr, &format, blob);
+
+  FILE *f = fopen(path, "wb");
+  if (f != nullptr) {
+    fwrite(&format, sizeof(format), 1, f);
+    fwrite(blob, 1, blob_size, f);
+    fclose(f);
+  }
+  free(blob);
+}
+
+void
+begin_program(ProgramCache *cache, const ProgramSource *source,
+              PendingProgram *pending) {
+  *pending = PendingProgram{};
+  pending->source = source;
+  pending->program = glCreateProgram();
+
+  if (cache->supported) {
+    cache_path(cache, source, pending->cache_path,
+               sizeof(pending->cache_path));
+    if (load_cached_program(pending->program, pending->cache_path)) {
+      pending->from_cache = true;
+      return;
+    }
+  }
+
+  GLuint program = pending->program;
+  if (source->compute != nullptr) {
+    pending->shaders[pending->n_shaders++] =
+        issue_shader(source->compute, source->defines, GL_COMPUTE_SHADER);
+  } else {
+    pending->shaders[pending->n_shaders++] =
+        issue_shader(source->vertex, source->defines, GL_VERTEX_SHADER);
+    pending->shaders[pending->n_shaders++] =
+        issue_shader(source->fragment, source->defines, GL_FRAGMENT_SHADER);
+  }
+
+  for (int i = 0; i < pending->n_shaders; ++i) {
+    glAttachShader(program, pending->shaders[i]);
+  }
+  for (GLuint i = 0; i < max_program_attribs; ++i) {
+    if (source->attribs[i] != nullptr) {
+      glBindAttribLocation(program, i, source->attribs[i]);
+    }
+  }
+  if (source->frag_out != nullptr) {
+    glBindFragDataLocation(program, 0, source->frag_out);
+  }
+  if (cache->supported) {
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+  glLinkProgram(program);
+}
+
+static bool
+program_done(const ProgramCache *cache, const PendingProgram *pending) {
+  if (pending->from_cache || !cache->parallel) {
+    return true;
+  }
+  GLint done = GL_FALSE;
+  glGetProgramiv(pending->program, GL_COMPLETION_STATUS_KHR, &done);
+  return done == GL_TRUE;
+}
+
+static void
+print_log(const char *what, GLuint object, bool is_program) {
+  GLint log_size = 0;
+  if (is_program) {
+    glGetProgramiv(object, GL_INFO_LOG_LENGTH, &log_size);
+  } else {
+    glGetShaderiv(object, GL_INFO_LOG_LENGTH, &log_size);
+  }
+  if (log_size <= 1) {
+    return;
+  }
+  char *log = (char *)malloc(log_size);
+  if (is_program) {
+    glGetProgramInfoLog(object, log_size, nullptr, log);
+  } else {
+    glGetShaderInfoLog(object, log_size, nullptr, log);
+  }
+  fprintf(stderr, "%s:\n%s\n", what, log);
+  free(log);
+}
+
+static void
+finish_program(ProgramCache *cache, PendingProgram *pending) {
+  if (pending->from_cache) {
+    return;
+  }
+
+  GLuint program = pending->program;
+  GLint status;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (status != GL_TRUE) {
+    const char *name = pending->source->name;
+    fprintf(stderr, "Fail link program %s\n", name);
+    const char *stages[2] = {"vertex shader", "fragment shader"};
+    if (pending->source->compute != nullptr) {
+      stages[0] = "compute shader";
+    }
+    for (int i = 0; i < pending->n_shaders; ++i) {
+      GLint compiled;
+      glGetShaderiv(pending->shaders[i], GL_COMPILE_STATUS, &compiled);
+      if (compiled != GL_TRUE) {
+        fprintf(stderr, "Fail compile %s %s\n", name, stages[i]);
+      }
+      print_log(stages[i], pending->shaders[i], false);
+    }
+    print_log("link", program, true);
+    exit(1);
+  }
+
+  if (cache->supported) {
+    store_cached_program(program, pending->cache_path);
+  }
+
+  for (int i = 0; i < pending->n_shaders; ++i) {
+    glDetachShader(program, pending->shaders[i]);
+    glDeleteShader(pending->shaders[i]);
+  }
+}
+
+void
+finish_programs(ProgramCache *cache, PendingProgram *pending, size_t n) {
+  bool finished[16] = {};
+  assert(n <= std::size(finished));
+
+  size_t n_finished = 0;
+  while (n_finished < n) {
+    size_t n_before = n_finished;
+    for (size_t i = 0; i < n; ++i) {
+      if (!finished[i] && program_done(cache, &pending[i])) {
+        finish_program(cache, &pending[i]);
+        finished[i] = true;
+        n_finished++;
+      }
+    }
+    if (n_finished == n_before) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void
+init_async_readback(AsyncReadback *readback, size_t size) {
+  *readback = AsyncReadback{};
+  readback->size = size;
+  glGenBuffers(readback_frames, readback->buffers);
+  for (GLuint buffer : readback->buffers) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+int
+begin_readback(AsyncReadback *readback) {
+  int slot = readback->frame % readback_frames;
+  // The copy in this slot was never fetched, it is too old by now
+  if (readback->fences[slot] != nullptr) {
+    glDeleteSync(readback->fences[slot]);
+    readback->fences[slot] = nullptr;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffers[slot]);
+  return slot;
+}
+
+void
+end_readback(AsyncReadback *readback) {
+  int slot = readback->frame % readback_frames;
+  readback->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  readback->frame++;
+}
+
+int
+fetch_readback(AsyncReadback *readback, void *out) {
+  // Newest first, older finished copies are dropped
+  int fetched = -1;
+  for (int i = 1; i <= readback_frames; ++i) {
+    int slot = (readback->frame - i + readback_frames) % readback_frames;
+    GLsync fence = readback->fences[slot];
+    if (fence == nullptr) {
+      continue;
+    }
+    if (fetched < 0) {
+      GLint status = GL_UNSIGNALED;
+      glGetSynciv(fence, GL_SYNC_STATUS, 1, nullptr, &status);
+      if (status != GL_SIGNALED) {
+        continue;
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffers[slot]);
+      void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback->size,
+                                    GL_MAP_READ_BIT);
+      if (data != nullptr) {
+        memcpy(out, data, readback->size);
+        fetched = slot;
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    if (fetched >= 0) {
+      glDeleteSync(fence);
+      readback->fences[slot] = nullptr;
+    }
+  }
+  return fetched;
+}
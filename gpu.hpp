@@ -0,0 +1,169 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <chrono>
+#include <cstdint>
+
+constexpr int max_frame_scopes = 12;
+
+// GPU timer results are read back this many frames after they were issued, by
+// then the GPU is done with them and reading never stalls the pipeline.
+constexpr int gpu_timer_frames = 3;
+
+struct FrameStats {
+  int frame;
+  int n_scopes;
+  const char *names[max_frame_scopes];
+  float cpu_ms[max_frame_scopes];
+  float gpu_ms[max_frame_scopes];
+  float frame_cpu_ms;
+  float frame_gpu_ms;
+  float input_latency_ms;
+};
+
+/*
+   Named CPU/GPU scopes. GPU time is measured with glQueryCounter timestamps
+   (so scopes may nest), the last pair of queries of each slot measures the
+   whole frame.
+*/
+struct FrameTimers {
+  bool gpu_supported;
+  int frame;
+  GLuint queries[gpu_timer_frames][max_frame_scopes + 1][2];
+  bool in_flight[gpu_timer_frames];
+  FrameStats pending[gpu_timer_frames];
+  std::chrono::high_resolution_clock::time_point cpu_start[max_frame_scopes +
+                                                           1];
+};
+
+void
+init_frame_timers(FrameTimers *timers);
+
+void
+begin_frame(FrameTimers *timers);
+
+int
+begin_scope(FrameTimers *timers, const char *name);
+
+void
+end_scope(FrameTimers *timers, int scope);
+
+// Returns true when the stats of an older frame are complete, CPU and GPU
+// times in stats belong to the same frame.
+bool
+end_frame(FrameTimers *timers, FrameStats *stats);
+
+void
+print(const FrameStats *stats);
+
+constexpr int max_frames_in_flight = 4;
+
+/*
+   Bounds how many frames the driver may queue. A fence is inserted after each
+   frame and before simulating the next one we wait for the fence from
+   frames_in_flight frames ago, so input is never older than that.
+*/
+struct FrameLatency {
+  int frames_in_flight;
+  int frame;
+  GLsync fences[max_frames_in_flight];
+  std::chrono::high_resolution_clock::time_point
+      input_time[max_frames_in_flight];
+  // Time from sampling input until the GPU finished the frame that used it,
+  // measured at the last wait
+  float latency_ms;
+};
+
+void
+init_frame_latency(FrameLatency *latency, int frames_in_flight);
+
+void
+wait_for_frame_slot(FrameLatency *latency);
+
+void
+mark_input_sampled(FrameLatency *latency);
+
+// Call right after swapping buffers
+void
+fence_frame(FrameLatency *latency);
+
+constexpr int max_program_attribs = 5;
+
+struct ProgramSource {
+  const char *name = nullptr;
+  const char *vertex = nullptr;
+  const char *fragment = nullptr;
+  // A compute program when set, vertex and fragment are then unused
+  const char *compute = nullptr;
+  const char *frag_out = nullptr;
+  // Attribute i is bound to location i
+  const char *attribs[max_program_attribs] = {};
+  // Inserted right after the #version line of both shaders, may be null
+  const char *defines = nullptr;
+};
+
+/*
+   Linked programs are stored as glGetProgramBinary blobs in dir, keyed by a
+   hash of the sources, the defines and the driver vendor/renderer/version.
+*/
+struct ProgramCache {
+  bool supported;
+  // KHR/ARB_parallel_shader_compile, completion can be polled
+  bool parallel;
+  const char *dir;
+  uint64_t driver_hash;
+};
+
+void
+init_program_cache(ProgramCache *cache, const char *dir);
+
+struct PendingProgram {
+  const ProgramSource *source;
+  GLuint program;
+  int n_shaders;
+  GLuint shaders[2];
+  bool from_cache;
+  char cache_path[512];
+};
+
+// Loads the program from the cache or issues its compile and link, without
+// waiting for them to finish
+void
+begin_program(ProgramCache *cache, const ProgramSource *source,
+              PendingProgram *pending);
+
+// Waits for the programs, the ones done first are handled first. Compile and
+// link errors are printed with their full logs and exit.
+void
+finish_programs(ProgramCache *cache, PendingProgram *pending, size_t n);
+
+constexpr int readback_frames = 3;
+
+/*
+   GPU to CPU copies through a ring of pixel pack buffers. A copy is consumed
+   only once its fence has signaled, so reading never stalls the pipeline.
+*/
+struct AsyncReadback {
+  size_t size;
+  int frame;
+  GLuint buffers[readback_frames];
+  GLsync fences[readback_frames];
+};
+
+void
+init_async_readback(AsyncReadback *readback, size_t size);
+
+// Binds the next pack buffer to GL_PIXEL_PACK_BUFFER, issue the
+// glReadPixels/glGetTexImage into it and then call end_readback. Returns the
+// slot of the copy.
+int
+begin_readback(AsyncReadback *readback);
+
+void
+end_readback(AsyncReadback *readback);
+
+// Copies the newest finished readback into out and returns its slot, -1 when
+// none has finished yet
+int
+fetch_readback(AsyncReadback *readback, void *out);
@@ -0,0 +1,284 @@
+#include "hero.hpp"
+#include "math.hpp"
+#include "terrain.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+constexpr float gravity = 9.8F;
+constexpr float jump_speed = 3.0F;
+// How quickly the horizontal velocity follows the input, per second
+constexpr float ground_control = 12.0F;
+constexpr float air_control = 2.0F;
+// A stalled frame is simulated as this long
+constexpr float max_tick = 0.1F;
+constexpr int max_substeps = 16;
+// Columns push with at most this speed, a column that jumped up within a
+// tick (a wave added or reset) lifts the hero without throwing it
+constexpr float max_push_speed = 4.0F;
+
+void
+init_hero(Hero *hero, vec3f pos, float radius) {
+  *hero = Hero{};
+  hero->pos = pos;
+  hero->radius = radius;
+}
+
+// Column whose center is nearest to v along one axis
+static int
+cell_of(const Heightfield *hf, float v) {
+  return (int)floorf((v / hf->scale + 0.5F) * hf->width + 0.5F);
+}
+
+static bool
+covers(const HeightCache *cache, int row0, int col0, int row1, int col1) {
+  return cache->row0 <= row0 && row1 < cache->row0 + cache->rows &&
+         cache->col0 <= col0 && col1 < cache->col0 + cache->cols;
+}
+
+// Cells [row0, row1] x [col0, col1] clamped to the terrain, at most
+// height_cache_size of them along each axis
+static void
+fill_cache(HeightCache *cache, const Heightfield *prev, const Heightfield *cur,
+           int row0, int col0, int row1, int col1) {
+  int width = cur->width;
+  row0 = std::clamp(row0, 0, width - 1);
+  col0 = std::clamp(col0, 0, width - 1);
+  row1 = std::clamp(row1, row0, std::min(width, row0 + height_cache_size) - 1);
+  col1 = std::clamp(col1, col0, std::min(width, col0 + height_cache_size) - 1);
+  cache->row0 = row0;
+  cache->col0 = col0;
+  cache->rows = row1 - row0 + 1;
+  cache->cols = col1 - col0 + 1;
+  for (int r = 0; r < cache->rows; ++r) {
+    for (int c = 0; c < cache->cols; ++c) {
+      int i = (row0 + r) * width + col0 + c;
+      cache->prev[r * height_cache_size + c] = prev->vals[i];
+      cache->cur[r * height_cache_size + c] = cur->vals[i];
+    }
+  }
+}
+
+// Makes sure the cache holds the cells under [min_x, max_x] x [min_z, max_z]
+static void
+cache_area(HeightCache *cache, const Heightfield *prev,
+           const Heightfield *cur, float min_x, float min_z, float max_x,
+           float max_z) {
+  int width = cur->width;
+  int row0 = std::max(cell_of(cur, min_x), 0);
+  int col0 = std::max(cell_of(cur, min_z), 0);
+  int row1 = std::min(cell_of(cur, max_x), width - 1);
+  int col1 = std::min(cell_of(cur, max_z), width - 1);
+  if (!covers(cache, row0, col0, row1, col1)) {
+    fill_cache(cache, prev, cur, row0, col0, row1, col1);
+  }
+}
+
+// Fraction in [0, 1] of the move d before the sphere first touches a column,
+// 1 when it touches none. Columns are boxes grown by the radius, a little
+// less on top so resting on flat ground isn't a hit, with their heights s
+// into the tick. The ones the sphere already overlaps are left to
+// resolve_contacts. normal is the face of the box that is hit. The move can
+// reach past the cache, the heights are read from the terrain.
+static float
+sweep_columns(const Hero *hero, const Heightfield *prev,
+              const Heightfield *cur, vec3f d, float s, vec3f *normal) {
+  int width = cur->width;
+  float r = hero->radius;
+  float half = 0.5F * cur->scale / width;
+  float skin = 0.01F * r;
+  vec3f p = hero->pos;
+  vec3f q = p + d;
+
+  int row0 = std::max(cell_of(cur, fminf(p.x, q.x) - r), 0);
+  int col0 = std::max(cell_of(cur, fminf(p.z, q.z) - r), 0);
+  int row1 = std::min(cell_of(cur, fmaxf(p.x, q.x) + r), width - 1);
+  int col1 = std::min(cell_of(cur, fmaxf(p.z, q.z) + r), width - 1);
+
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  float from[3] = {p.x, p.y, p.z};
+  float dir[3] = {d.x, d.y, d.z};
+  float t_hit = 1;
+  for (int row = row0; row <= row1; ++row) {
+    for (int col = col0; col <= col1; ++col) {
+      int i = row * width + col;
+      float h = prev->vals[i] + s * (cur->vals[i] - prev->vals[i]);
+      float cx = ((float)row / width - 0.5F) * cur->scale;
+      float cz = ((float)col / width - 0.5F) * cur->scale;
+      float lo[3] = {cx - half - r, -inf, cz - half - r};
+      float hi[3] = {cx + half + r, h + r - skin, cz + half + r};
+
+      float t_enter = -inf;
+      float t_exit = inf;
+      int axis = -1;
+      for (int a = 0; a < 3 && t_enter <= t_exit; ++a) {
+        if (dir[a] == 0) {
+          if (from[a] < lo[a] || from[a] > hi[a]) {
+            t_exit = -inf;
+          }
+          continue;
+        }
+        float t0 = (lo[a] - from[a]) / dir[a];
+        float t1 = (hi[a] - from[a]) / dir[a];
+        if (t0 > t1) {
+          std::swap(t0, t1);
+        }
+        if (t0 > t_enter) {
+          t_enter = t0;
+          axis = a;
+        }
+        t_exit = fminf(t_exit, t1);
+      }
+      if (axis >= 0 && 0 <= t_enter && t_enter <= t_exit &&
+          t_enter < t_hit) {
+        t_hit = t_enter;
+        float n[3] = {0, 0, 0};
+        n[axis] = dir[axis] > 0 ? -1.0F : 1.0F;
+        *normal = vec3f{n[0], n[1], n[2]};
+      }
+    }
+  }
+  return t_hit;
+}
+
+// Pushes the sphere out of the columns it overlaps. s in [0, 1] is how far
+// into the tick the heights are taken.
+static void
+resolve_contacts(Hero *hero, const Heightfield *cur, float s, float dt) {
+  HeightCache *cache = &hero->cache;
+  float r = hero->radius;
+  float cell = cur->scale / cur->width;
+  float half = 0.5F * cell;
+
+  int row0 = std::max(cell_of(cur, hero->pos.x - r), cache->row0);
+  int col0 = std::max(cell_of(cur, hero->pos.z - r), cache->col0);
+  int row1 = std::min(cell_of(cur, hero->pos.x + r),
+                      cache->row0 + cache->rows - 1);
+  int col1 = std::min(cell_of(cur, hero->pos.z + r),
+                      cache->col0 + cache->cols - 1);
+  for (int row = row0; row <= row1; ++row) {
+    for (int col = col0; col <= col1; ++col) {
+      int i = (row - cache->row0) * height_cache_size + col - cache->col0;
+      float h = cache->prev[i] + s * (cache->cur[i] - cache->prev[i]);
+      float rise =
+          fminf((cache->cur[i] - cache->prev[i]) / dt, max_push_speed);
+
+      float cx = ((float)row / cur->width - 0.5F) * cur->scale;
+      float cz = ((float)col / cur->width - 0.5F) * cur->scale;
+      vec3f p = hero->pos;
+      vec3f closest{std::clamp(p.x, cx - half, cx + half), fminf(p.y, h),
+                    std::clamp(p.z, cz - half, cz + half)};
+      vec3f d = p - closest;
+      float dist = len(d);
+      if (dist >= r) {
+        continue;
+      }
+
+      vec3f n;
+      float depth;
+      if (dist < 1e-6F) {
+        // The center is inside the column, it rose past the sphere
+        n = vec3f{0, 1, 0};
+        depth = h - p.y + r;
+      } else {
+        n = (1 / dist) * d;
+        depth = r - dist;
+      }
+      hero->pos = hero->pos + depth * n;
+
+      // Remove the velocity into the column, relative to its own
+      float rel = dot(hero->vel, n) - n.y * rise;
+      if (rel < 0) {
+        hero->vel = hero->vel - rel * n;
+      }
+      if (n.y > 0.7F) {
+        hero->grounded = true;
+      }
+    }
+  }
+}
+
+void
+update_hero(Hero *hero, const Heightfield *prev, const Heightfield *cur,
+            vec2f move, bool jump, float dt) {
+  dt = fminf(dt, max_tick);
+  if (dt <= 0) {
+    return;
+  }
+
+  float control = hero->grounded ? ground_control : air_control;
+  float k = fminf(control * dt, 1);
+  hero->vel.x += k * (move.x - hero->vel.x);
+  hero->vel.z += k * (move.y - hero->vel.z);
+  if (jump && hero->grounded) {
+    hero->vel.y = jump_speed;
+  }
+
+  // Everything the sphere can touch this tick, assuming the speed stays.
+  // The heights changed since the last tick so the cache is always refilled.
+  float r = hero->radius;
+  float reach = r + len(hero->vel) * dt;
+  fill_cache(&hero->cache, prev, cur, cell_of(cur, hero->pos.x - reach),
+             cell_of(cur, hero->pos.z - reach),
+             cell_of(cur, hero->pos.x + reach),
+             cell_of(cur, hero->pos.z + reach));
+
+  // Sub-steps so that neither the sphere nor a column under it moves more
+  // than half the radius per step. When max_substeps isn't enough the
+  // sphere is swept against the columns, so it doesn't pass through them.
+  float max_rise = 0;
+  const HeightCache *cache = &hero->cache;
+  for (int row = 0; row < cache->rows; ++row) {
+    for (int col = 0; col < cache->cols; ++col) {
+      int i = row * height_cache_size + col;
+      max_rise = fmaxf(max_rise, fabsf(cache->cur[i] - cache->prev[i]));
+    }
+  }
+  float travel = len(hero->vel) * dt + gravity * dt * dt + max_rise;
+  int n_steps = std::clamp((int)ceilf(travel / (0.5F * r)), 1, max_substeps);
+  float step = dt / n_steps;
+
+  // The hero stays over the terrain
+  float cell = cur->scale / cur->width;
+  float lo = -0.5F * cur->scale;
+  float hi = 0.5F * cur->scale - cell;
+
+  hero->grounded = false;
+  for (int i = 0; i < n_steps; ++i) {
+    hero->vel.y -= gravity * step;
+    // A fast sphere stops at the first column in the way and slides along
+    // it, a few times for the corners
+    float s = (float)(i + 1) / n_steps;
+    float left = len(hero->vel) * step > 0.5F * r ? step : 0;
+    hero->pos = hero->pos + (step - left) * hero->vel;
+    for (int slide = 0; slide < 3 && left > 0; ++slide) {
+      vec3f n{0, 1, 0};
+      float t = sweep_columns(hero, prev, cur, left * hero->vel, s, &n);
+      hero->pos = hero->pos + (t * left) * hero->vel;
+      left *= 1 - t;
+      if (t == 1) {
+        break;
+      }
+      float into = dot(hero->vel, n);
+      if (into < 0) {
+        hero->vel = hero->vel - into * n;
+      }
+      if (n.y > 0.7F) {
+        hero->grounded = true;
+      }
+    }
+    if (hero->pos.x < lo || hero->pos.x > hi) {
+      hero->pos.x = std::clamp(hero->pos.x, lo, hi);
+      hero->vel.x = 0;
+    }
+    if (hero->pos.z < lo || hero->pos.z > hi) {
+      hero->pos.z = std::clamp(hero->pos.z, lo, hi);
+      hero->vel.z = 0;
+    }
+
+    cache_area(&hero->cache, prev, cur, hero->pos.x - r, hero->pos.z - r,
+               hero->pos.x + r, hero->pos.z + r);
+    resolve_contacts(hero, cur, s, dt);
+  }
+}
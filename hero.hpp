@@ -0,0 +1,44 @@
+#pragma once
+
+#include "math.hpp"
+#include "terrain.hpp"
+
+constexpr int height_cache_size = 16;
+
+/*
+   Copy of the heights around a body at the start and end of the tick.
+   Contacts of all sub-steps are tested against it. It is refilled at the
+   start of every tick, the heights change each tick, and again during the
+   tick only when the body leaves it.
+*/
+struct HeightCache {
+  int row0;
+  int col0;
+  int rows;
+  int cols;
+  float prev[height_cache_size * height_cache_size];
+  float cur[height_cache_size * height_cache_size];
+};
+
+/*
+   A sphere moving over the terrain columns, swept against them so it
+   doesn't tunnel through at any speed. Rising columns push it along with
+   them, so waves carry it.
+*/
+struct Hero {
+  vec3f pos;
+  vec3f vel;
+  float radius;
+  bool grounded;
+  HeightCache cache;
+};
+
+void
+init_hero(Hero *hero, vec3f pos, float radius);
+
+// Advances the hero by dt. prev and cur are the terrain at the start and the
+// end of the tick, contacts interpolate between them. move is the wanted
+// velocity along x and z.
+void
+update_hero(Hero *hero, const Heightfield *prev, const Heightfield *cur,
+            vec2f move, bool jump, float dt);
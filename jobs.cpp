@@ -0,0 +1,88 @@
+#include "jobs.hpp"
+
+#include <algorithm>
+
+static void
+take_jobs(JobPool *pool) {
+  for (int job = pool->next_job.fetch_add(1); job < pool->n_jobs;
+       job = pool->next_job.fetch_add(1)) {
+    pool->fn(pool->ctx, job);
+  }
+}
+
+static void
+worker(JobPool *pool) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(pool->mutex);
+      pool->start.wait(lock,
+                       [&] { return pool->quit || pool->batch != seen; });
+      if (pool->quit) {
+        return;
+      }
+      seen = pool->batch;
+    }
+    take_jobs(pool);
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    if (--pool->n_busy == 0) {
+      pool->done.notify_one();
+    }
+  }
+}
+
+void
+init_job_pool(JobPool *pool, int n_threads) {
+  if (n_threads < 0) {
+    n_threads = (int)std::thread::hardware_concurrency() - 1;
+  }
+  pool->n_threads = std::clamp(n_threads, 0, max_job_threads);
+  pool->batch = 0;
+  pool->n_jobs = 0;
+  pool->next_job = 0;
+  pool->n_busy = 0;
+  pool->quit = false;
+  for (int i = 0; i < pool->n_threads; ++i) {
+    pool->threads[i] = std::thread(worker, pool);
+  }
+}
+
+void
+free_job_pool(JobPool *pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->quit = true;
+  }
+  pool->start.notify_all();
+  for (int i = 0; i < pool->n_threads; ++i) {
+    pool->threads[i].join();
+  }
+  pool->n_threads = 0;
+}
+
+void
+run_jobs(JobPool *pool, int n_jobs, void (*fn)(void *ctx, int job), void *ctx) {
+  if (pool->n_threads == 0 || n_jobs <= 1) {
+    for (int job = 0; job < n_jobs; ++job) {
+      fn(ctx, job);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->n_jobs = n_jobs;
+    pool->next_job = 0;
+    pool->n_busy = pool->n_threads;
+    ++pool->batch;
+  }
+  pool->start.notify_all();
+  take_jobs(pool);
+
+  // Every worker takes part in every batch, so none can still be reading
+  // fn and ctx once they are all done
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->done.wait(lock, [&] { return pool->n_busy == 0; });
+}
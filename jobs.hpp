@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+constexpr int max_job_threads = 64;
+
+/*
+   Worker threads that stay alive between batches. run_jobs hands out the
+   jobs of a batch one at a time to the workers and the calling thread, and
+   returns once all of them are done.
+*/
+struct JobPool {
+  int n_threads;
+  std::thread threads[max_job_threads];
+  std::mutex mutex;
+  std::condition_variable start;
+  std::condition_variable done;
+  // The current batch, set under mutex
+  uint64_t batch;
+  void (*fn)(void *ctx, int job);
+  void *ctx;
+  int n_jobs;
+  std::atomic<int> next_job;
+  int n_busy;
+  bool quit;
+};
+
+// n_threads workers besides the calling thread, -1 for one less than the
+// hardware threads
+void
+init_job_pool(JobPool *pool, int n_threads);
+
+void
+free_job_pool(JobPool *pool);
+
+void
+run_jobs(JobPool *pool, int n_jobs, void (*fn)(void *ctx, int job), void *ctx);
+
+template <typename F>
+void
+run_jobs(JobPool *pool, int n_jobs, F &&f) {
+  using Fn = std::remove_reference_t<F>;
+  run_jobs(
+      pool, n_jobs, [](void *ctx, int job) { (*(Fn *)ctx)(job); },
+      (void *)&f);
+}
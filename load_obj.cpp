@@ -3,7 +3,9 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include "jobs.hpp"
 #include "math.hpp"
+#include "obj.hpp"
 
 #include <cassert>
 #include <cmath>
@@ -12,8 +14,9 @@
 #include <cstdlib>
 #include <ctime>
 
-#include <array>
+#include <algorithm>
 #include <chrono>
+#include <utility>
 
 typedef std::chrono::high_resolution_clock::time_point time_point;
 
@@ -49,12 +52,6 @@ compile_shader(const char *source, GLenum type) {
   return gl_ptr;
 };
 
-struct VertsContent {
-  size_t size;
-  vec3f *verts;
-  vec3f *normals;
-};
-
 constexpr int screen_width = 800;
 constexpr int screen_height = 800;
 
@@ -63,8 +60,36 @@ struct DrawContext {
   GLuint shader_program;
 };
 
+// Position and normal of each triangle corner, the face normal where the
+// file has none
+static void
+fill_attrs(float *attr, const ObjMesh *mesh, size_t first, size_t last) {
+  for (size_t tri = first; tri < last; ++tri) {
+    const ObjIndex *corners = &mesh->corners[3 * tri];
+    vec3f p0 = mesh->positions[corners[0].position];
+    vec3f p1 = mesh->positions[corners[1].position];
+    vec3f p2 = mesh->positions[corners[2].position];
+    vec3f face_normal = cross(p1 - p0, p2 - p0);
+    // Degenerate triangles are common in scans
+    float area = len(face_normal);
+    face_normal = area > 0 ? (1 / area) * face_normal : vec3f{0, 1, 0};
+    for (int j = 0; j < 3; ++j) {
+      vec3f pos = mesh->positions[corners[j].position];
+      vec3f normal = corners[j].normal >= 0 ? mesh->normals[corners[j].normal]
+                                            : face_normal;
+      float *out = &attr[(3 * tri + j) * 6];
+      out[0] = pos.x;
+      out[1] = pos.y;
+      out[2] = pos.z;
+      out[3] = normal.x;
+      out[4] = normal.y;
+      out[5] = normal.z;
+    }
+  }
+}
+
 void
-render(GLFWwindow *window) {
+render(GLFWwindow *window, const ObjMesh *mesh, JobPool *pool) {
 
   DrawContext cube_context;
   glGenVertexArrays(1, &(cube_context.vao));
@@ -72,101 +97,52 @@ render(GLFWwindow *window) {
   glBindVertexArray(cube_context.vao);
 
   //********************************************************************************
-  // Cube Def
-
-  // <<<========= Here we should define loaded OBJ file
-  //
-  // clang-format off
-  vec3f cube_verts[8] = {
-      	{-0.5F,  0.5F, -0.5F},
-      	{ 0.5F,  0.5F, -0.5F},
-      	{ 0.5F, -0.5F, -0.5F},
-      	{-0.5F, -0.5F, -0.5F},
-      	{-0.5F,  0.5F,  0.5F},
-      	{ 0.5F,  0.5F,  0.5F},
-      	{ 0.5F, -0.5F,  0.5F},
-      	{-0.5F, -0.5F,  0.5F}
-      };
+  // Mesh, unindexed so corners can differ in normals
 
-  std::pair<std::array<int, 4>, vec3f> rects[6]
-  {
-	  {{0, 1, 2, 3}, vec3f{0, 0, -1}},
-	  {{1, 5, 6, 2}, vec3f{1, 0, 0}},
-	  {{3, 2, 6, 7}, vec3f{0, -1, 0}},
-	  {{0, 3, 7, 4}, vec3f{-1, 0, 0}},
-	  {{0, 4, 5, 1}, vec3f{0, 1, 0}},
-	  {{5, 4, 7, 6}, vec3f{0, 0, 1}}
-  };
-
-  // clang-format on
-
-  VertsContent verts_content;
-  constexpr size_t n_verts = 6 * 4;
-  vec3f c_verts[n_verts];
-  vec3f c_normals[n_verts];
-
-  verts_content.size = n_verts;
-  verts_content.verts = c_verts;
-  verts_content.normals = c_normals;
+  constexpr size_t vert_size = 3;
+  constexpr size_t normal_size = 3;
+  constexpr size_t attr_size = vert_size + normal_size;
 
-  GLuint cube_elements[6 * 6];
+  size_t n_verts = 3 * mesh->n_triangles;
+  float *attr = (float *)malloc(sizeof(float) * attr_size * n_verts);
   {
-    int ver_out = 0;
-    int el_out = 0;
-    for (auto &[rect, normal] : rects) {
-      int a = ver_out;
-      for (int j = 0; j < 4; j++) {
-        verts_content.verts[ver_out] = cube_verts[rect[j]];
-        verts_content.normals[ver_out] = normal;
-        ver_out++;
-      }
+    constexpr size_t block = 1 << 16;
+    int n_blocks = (int)((mesh->n_triangles + block - 1) / block);
+    run_jobs(pool, n_blocks, [&](int i) {
+      fill_attrs(attr, mesh, i * block,
+                 std::min((i + 1) * block, mesh->n_triangles));
+    });
+  }
 
-      int b = a + 1;
-      int c = a + 2;
-      int d = a + 3;
-      for (int x : {a, b, c, c, d, a}) {
-        cube_elements[el_out++] = x;
-      }
+  // Centered and scaled to fit the view
+  mat4f model_mat = identity();
+  if (mesh->n_positions > 0) {
+    vec3f lo = mesh->positions[0];
+    vec3f hi = lo;
+    for (int i = 1; i < mesh->n_positions; ++i) {
+      vec3f p = mesh->positions[i];
+      lo = vec3f{fminf(lo.x, p.x), fminf(lo.y, p.y), fminf(lo.z, p.z)};
+      hi = vec3f{fmaxf(hi.x, p.x), fmaxf(hi.y, p.y), fmaxf(hi.z, p.z)};
     }
+    vec3f size = hi - lo;
+    float extent = fmaxf(fmaxf(size.x, size.y), fmaxf(size.z, 1e-6F));
+    float s = 4.0F / extent;
+    vec3f center = 0.5F * (lo + hi);
+    model_mat = diagonal(s, s, s, 1);
+    model_mat.elements[12] = -s * center.x;
+    model_mat.elements[13] = -s * center.y;
+    model_mat.elements[14] = -s * center.z;
   }
 
-  constexpr size_t vert_size = 3;
-  constexpr size_t texcoord_size = 2;
-  constexpr size_t normal_size = 3;
-  constexpr size_t attr_size = vert_size + texcoord_size + normal_size;
-
-  float attr[n_verts * attr_size];
-
+  // Pass the mesh to opengl
   {
-    size_t attr_idx = 0;
-    for (size_t vert_idx = 0; vert_idx < verts_content.size; vert_idx++) {
-      vec3f *vert = &verts_content.verts[vert_idx];
-      vec3f *normal = &verts_content.normals[vert_idx];
-
-      attr[attr_idx++] = vert->x;
-      attr[attr_idx++] = vert->y;
-      attr[attr_idx++] = vert->z;
-
-      attr[attr_idx++] = normal->x;
-      attr[attr_idx++] = normal->y;
-      attr[attr_idx++] = normal->z;
-    }
-  };
-
-  // Pass cube to opengl (attr for verts and elements for connections)
-  [&attr, &cube_elements] {
-    GLuint arr[2];
-    glGenBuffers(2, arr);
-
-    const GLuint vbo = arr[0];
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(attr), attr, GL_STATIC_DRAW);
-
-    const GLuint ebo = arr[1];
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_elements), cube_elements,
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * attr_size * n_verts, attr,
                  GL_STATIC_DRAW);
-  }();
+    free(attr);
+  }
 
   //--------------------------------------------------------------------------------
   // Make Cube shader
@@ -325,18 +301,15 @@ render(GLFWwindow *window) {
       glClearColor(0.0F, 0.0F, 0.0F, 1.0F);
       glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-      float scale = 6.0F;
-      mat4f scale_mat = diagonal(scale, 1.0F, scale, 1);
-
       glEnable(GL_DEPTH_TEST);
 
-      // Draw terrain
+      // Draw mesh
       glBindVertexArray(cube_context.vao);
       glUseProgram(cube_context.shader_program);
 
-      glUniformMatrix4fv(uniTrans, 1, GL_FALSE, scale_mat.elements);
+      glUniformMatrix4fv(uniTrans, 1, GL_FALSE, model_mat.elements);
 
-      glDrawElements(GL_TRIANGLES, std::size(cube_elements), GL_UNSIGNED_INT, 0);
+      glDrawArrays(GL_TRIANGLES, 0, n_verts);
 
       glfwSwapBuffers(window);
       glfwPollEvents();
@@ -378,12 +351,28 @@ open_window(int width, int height) {
 }
 
 int
-main() {
+main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: load_obj FILE\n");
+    exit(1);
+  }
+
+  JobPool jobs;
+  init_job_pool(&jobs, -1);
+  ObjMesh mesh;
+  time_point t_start = now();
+  if (!load_obj_mesh(&mesh, argv[1], &jobs)) {
+    exit(1);
+  }
+  printf("Loaded %s in %.2f s: %d vertices, %zu triangles\n", argv[1],
+         time_between(t_start, now()), mesh.n_positions, mesh.n_triangles);
 
   GLFWwindow *window = open_window(screen_width, screen_height);
-  render(window);
+  render(window, &mesh, &jobs);
 
   glfwDestroyWindow(window);
   glfwTerminate();
+  free_obj_mesh(&mesh);
+  free_job_pool(&jobs);
   return 0;
 }
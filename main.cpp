@@ -2,15 +2,30 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include "chunks.hpp"
+#include "crowd.hpp"
+#include "erosion.hpp"
+#include "fast_math.hpp"
+#include "gpu.hpp"
+#include "hero.hpp"
+#include "jobs.hpp"
 #include "math.hpp"
+#include "noise.hpp"
+#include "particles.hpp"
+#include "path.hpp"
+#include "spatial_hash.hpp"
+#include "terrain.hpp"
+#include "transforms.hpp"
 
 #include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 
+#include <algorithm>
 #include <array>
 #include <chrono>
 
@@ -41,25 +56,6 @@ update_kstate(KeyState s, int glfw_state) {
   }
 }
 
-GLuint
-compile_shader(const char *source, GLenum type) {
-  GLuint gl_ptr = glCreateShader(type);
-  glShaderSource(gl_ptr, 1, &source, nullptr);
-  glCompileShader(gl_ptr);
-
-  GLint status;
-  glGetShaderiv(gl_ptr, GL_COMPILE_STATUS, &status);
-
-  if (status != GL_TRUE) {
-    fprintf(stderr, "Fail compile shader\n");
-    exit(1);
-  }
-  char buffer[512];
-  glGetShaderInfoLog(gl_ptr, 512, nullptr, buffer);
-  printf("%s\n", buffer);
-  return gl_ptr;
-};
-
 struct VertsContent {
   size_t size;
   vec3f *verts;
@@ -69,14 +65,6 @@ struct VertsContent {
 constexpr int screen_width = 800;
 constexpr int screen_height = 800;
 
-struct Wave {
-  float x;
-  float y;
-  float speed;
-  float size;
-  float time;
-};
-
 struct DrawContext {
   GLuint vao;
   GLuint shader_program;
@@ -104,17 +92,37 @@ draw_line(DrawContext *debug_context, vec3f p1, vec3f p2, vec3f color) {
   GLint uniColor =
       glGetUniformLocation(debug_context->shader_program, "inColor");
 
-  mat4f transD = streach_from_to(p1, p2, 0.01);
+  mat4f transD = to_mat4(to_affine(line_transform(p1, p2, 0.01)));
   glUniformMatrix4fv(uniTrans, 1, GL_FALSE, transD.elements);
   glUniform3f(uniColor, color.x, color.y, color.z);
   int el_size = 6 * 6;
   glDrawElements(GL_TRIANGLES, el_size, GL_UNSIGNED_INT, 0);
 };
 
+// Draws the boxes of nodes [first, first + n) with their world matrices
 void
-draw_star(DrawContext *debug_context, vec3f p, float scale, vec3f color) {
-  vec3f adds[3 * 3 * 3 - 1];
-  int idx = 0;
+draw_nodes(DrawContext *debug_context, const TransformTree *tree, int first,
+           int n, vec3f color) {
+  GLint uniTrans = glGetUniformLocation(debug_context->shader_program, "trans");
+  GLint uniColor =
+      glGetUniformLocation(debug_context->shader_program, "inColor");
+  glUniform3f(uniColor, color.x, color.y, color.z);
+  int el_size = 6 * 6;
+  for (int i = first; i < first + n; ++i) {
+    mat4f trans = to_mat4(tree->worlds[i]);
+    glUniformMatrix4fv(uniTrans, 1, GL_FALSE, trans.elements);
+    glDrawElements(GL_TRIANGLES, el_size, GL_UNSIGNED_INT, 0);
+  }
+}
+
+// A line from the center to each neighbor of a 3x3x3 grid
+constexpr int star_spokes = 3 * 3 * 3 - 1;
+
+// A node at p with its spokes as the next star_spokes nodes, returns the
+// node
+int
+add_star(TransformTree *tree, vec3f p, float scale) {
+  int star = add_transform(tree, -1, translation_transform(p));
   for (int i = 0; i < 3; ++i) {
     for (int j = 0; j < 3; ++j) {
       for (int k = 0; k < 3; ++k) {
@@ -122,20 +130,29 @@ draw_star(DrawContext *debug_context, vec3f p, float scale, vec3f color) {
         float y = (float)(j - 1);
         float z = (float)(k - 1);
         if (!(x == 0 && y == 0 && z == 0)) {
-          adds[idx++] = vec3f{x, y, z};
+          add_transform(tree, star,
+                        line_transform(vec3f{0, 0, 0},
+                                       scale * vec3f{x, y, z}, 0.01));
         }
       }
     }
   }
-  for (vec3f add : adds) {
-    draw_line(debug_context, p, p + scale * add, color);
-  }
-};
+  return star;
+}
+
+void
+draw_star(DrawContext *debug_context, const TransformTree *tree, int star,
+          vec3f color) {
+  draw_nodes(debug_context, tree, star + 1, star_spokes, color);
+}
 
 struct UserInput {
   KeyState mouse_state = KeyState::KeyUp;
-  int keys[3] = {GLFW_KEY_G, GLFW_KEY_R, GLFW_KEY_O};
-  KeyState key_state[3] = {KeyState::KeyUp, KeyState::KeyUp, KeyState::KeyUp};
+  int keys[9] = {GLFW_KEY_G, GLFW_KEY_R, GLFW_KEY_O, GLFW_KEY_T, GLFW_KEY_C,
+                 GLFW_KEY_P, GLFW_KEY_F, GLFW_KEY_E, GLFW_KEY_N};
+  KeyState key_state[9] = {KeyState::KeyUp, KeyState::KeyUp, KeyState::KeyUp,
+                           KeyState::KeyUp, KeyState::KeyUp, KeyState::KeyUp,
+                           KeyState::KeyUp, KeyState::KeyUp, KeyState::KeyUp};
 };
 
 void
@@ -157,22 +174,449 @@ key_state(UserInput *user_input, int key) {
   return KeyState::KeyUp;
 }
 
+// Values of the ID buffer, the kind is in the top byte and the index (terrain
+// cell or star) below it. 0 is the background.
+enum class PickKind : uint32_t { None, Terrain, Star, Hero };
+
+uint32_t
+pick_id(PickKind kind, uint32_t index) {
+  return (uint32_t)kind << 24 | index;
+}
+
+PickKind
+pick_kind(uint32_t id) {
+  return (PickKind)(id >> 24);
+}
+
+uint32_t
+pick_index(uint32_t id) {
+  return id & 0xffffff;
+}
+
+const ProgramSource overlay_program_source{
+    .name = "overlay",
+    .vertex = R"glsl(
+        #version 150 core
+
+        in vec2 position;
+        in vec2 uv;
+
+        out vec2 Texcoord;
+        void
+        main() {
+          gl_Position = vec4(position, 0.0, 1.0);
+          Texcoord = uv;
+        }
+    )glsl",
+    .fragment = R"glsl(
+        #version 150 core
+        out vec4 outColor;
+        in vec2 Texcoord;
+
+        uniform sampler2D tex;
+
+        void
+        main() {
+          vec4 c = texture(tex, Texcoord);
+	  c.r /= 2.0;
+          outColor = vec4(c.r, c.r, c.r, 1.0);
+        }
+    )glsl",
+    .frag_out = "outColor",
+    .attribs = {"position", "uv"}};
+
+const char *cube_vertex_shader = R"glsl(
+        #version 150 core
+
+        in vec3 position;
+        in vec3 normal;
+
+        out vec3 FragPos;
+        out vec3 Normal;
+	out float Height;
+#ifdef ID_PASS
+        flat out uint Id;
+        uniform uint id_base;
+#endif
+
+        uniform mat4 terrain;
+        uniform mat4 view;
+        uniform mat4 proj;
+
+        uniform sampler2D heights;
+        uniform int width;
+
+        void
+        main() {
+	  // One instance per terrain cell
+	  int row = gl_InstanceID / width;
+	  int col = gl_InstanceID - row * width;
+	  float h = texelFetch(heights, ivec2(col, row), 0).r;
+	  float w_pix = 1.0 / float(width);
+	  mat4 cell = mat4(w_pix, 0.0, 0.0, 0.0,
+	                   0.0, 2.0, 0.0, 0.0,
+	                   0.0, 0.0, w_pix, 0.0,
+	                   float(row) * w_pix - 0.5, h - 1.0,
+	                   float(col) * w_pix - 0.5, 1.0);
+	  mat4 trans = terrain * cell;
+
+	  vec4 pos_t = trans * vec4(position, 1.0);
+          gl_Position = proj * view * trans * vec4(position, 1.0);
+          FragPos = vec3(trans * vec4(position, 1.0));
+          Normal = mat3(trans) * normal;
+	  Height = pos_t.y;
+#ifdef ID_PASS
+	  Id = id_base + uint(gl_InstanceID);
+#endif
+        }
+    )glsl";
+
+const char *cube_fragment_shader = R"glsl(
+        #version 150 core
+
+	in vec3 Normal;
+	in vec3 FragPos;
+	in float Height;
+
+#ifdef ID_PASS
+	flat in uint Id;
+	out uint outId;
+
+	void
+	main() {
+	  outId = Id;
+	}
+#else
+	out vec4 outColor;
+
+	uniform bool debug;
+
+	void
+	main() {
+	  vec4 black = vec4(0.2, 0.1, 0.1, 1.0);
+	  vec4 green = vec4(0.0, 1.0, 0.0, 1.0);
+	  vec4 blue = vec4(0.0, 0.0, 1.0, 1.0);
+	  vec4 red = vec4(1.0, 0.4, 0.4, 1.0);
+
+	  float th = 0.5;
+	  if (Height < 0) {
+	    outColor = mix(blue, black, -Height * 10);
+	  } else if (Height <= th) {
+	    outColor = mix(blue, green, Height / th);
+	  } else {
+	    outColor = mix(green, red, (Height - th) / th);
+	  }
+
+	  vec3 lightPos = vec3(0, 500, 400);
+	  vec3 lightDir = normalize(lightPos - FragPos);
+	  vec3 norm = normalize(Normal);
+	  float diff = max(dot(norm, lightDir), 0.0);
+
+	  outColor *= min(0.1 + diff, 1.0);
+
+	  if (debug) {
+	    outColor *= 0.5;
+	  }
+	}
+#endif
+    )glsl";
+
+const ProgramSource cube_program_source{.name = "cube",
+                                       .vertex = cube_vertex_shader,
+                                       .fragment = cube_fragment_shader,
+                                       .frag_out = "outColor",
+                                       .attribs = {"position", "normal"}};
+
+// Writes id_base + the instance (the terrain cell) into an integer target
+const ProgramSource cube_id_program_source{.name = "cube id",
+                                          .vertex = cube_vertex_shader,
+                                          .fragment = cube_fragment_shader,
+                                          .frag_out = "outId",
+                                          .attribs = {"position", "normal"},
+                                          .defines = "#define ID_PASS\n"};
+
+const char *debug_vertex_shader = R"glsl(
+            #version 150 core
+            in vec3 position;
+
+            uniform mat4 trans;
+            uniform mat4 view;
+            uniform mat4 proj;
+
+            void
+            main() {
+              gl_Position = proj * view * trans * vec4(position, 1.0);
+            }
+	)glsl";
+
+const char *debug_fragment_shader = R"glsl(
+            #version 150 core
+
+#ifdef ID_PASS
+            uniform uint id;
+            out uint outId;
+            void
+            main() {
+              outId = id;
+            }
+#else
+            uniform vec3 inColor;
+	    out vec4 outColor;
+            void
+            main() {
+              outColor = vec4(inColor, 1.0);
+            }
+#endif
+        )glsl";
+
+const ProgramSource debug_program_source{.name = "debug",
+                                        .vertex = debug_vertex_shader,
+                                        .fragment = debug_fragment_shader,
+                                        .frag_out = "outColor",
+                                        .attribs = {"position"}};
+
+// Debug geometry with the id uniform written instead of a color
+const ProgramSource debug_id_program_source{.name = "debug id",
+                                           .vertex = debug_vertex_shader,
+                                           .fragment = debug_fragment_shader,
+                                           .frag_out = "outId",
+                                           .attribs = {"position"},
+                                           .defines = "#define ID_PASS\n"};
+
+// Crowd agents, one small cube per instance. The positions are the x, y and z
+// arrays of the crowd, one float attribute each.
+const ProgramSource crowd_program_source{
+    .name = "crowd",
+    .vertex = R"glsl(
+        #version 150 core
+
+        in vec3 position;
+        in vec3 normal;
+        in float agent_x;
+        in float agent_y;
+        in float agent_z;
+
+        out vec3 Normal;
+
+        uniform mat4 view;
+        uniform mat4 proj;
+        uniform float size;
+
+        void
+        main() {
+          vec3 pos = size * position + vec3(agent_x, agent_y + 0.5 * size,
+                                            agent_z);
+          gl_Position = proj * view * vec4(pos, 1.0);
+          Normal = normal;
+        }
+    )glsl",
+    .fragment = R"glsl(
+        #version 150 core
+
+        in vec3 Normal;
+        out vec4 outColor;
+
+        void
+        main() {
+          vec3 lightDir = normalize(vec3(0, 500, 400));
+          float diff = max(dot(normalize(Normal), lightDir), 0.0);
+          outColor = vec4(vec3(1.0, 0.6, 0.2) * min(0.3 + diff, 1.0), 1.0);
+        }
+    )glsl",
+    .frag_out = "outColor",
+    .attribs = {"position", "normal", "agent_x", "agent_y", "agent_z"}};
+
+// Particles as round points, one instance per particle. An instance is x, y,
+// z and the life left.
+const ProgramSource particle_program_source{
+    .name = "particle",
+    .vertex = R"glsl(
+        #version 150 core
+
+        in vec4 particle;
+
+        out float Life;
+
+        uniform mat4 view;
+        uniform mat4 proj;
+        // Point size in pixels at distance 1
+        uniform float point_scale;
+
+        void
+        main() {
+          gl_Position = proj * view * vec4(particle.xyz, 1.0);
+          gl_PointSize = max(point_scale / gl_Position.w, 1.0);
+          Life = particle.w;
+        }
+    )glsl",
+    .fragment = R"glsl(
+        #version 150 core
+
+        in float Life;
+        out vec4 outColor;
+
+        void
+        main() {
+          vec2 d = gl_PointCoord - vec2(0.5);
+          if (dot(d, d) > 0.25) {
+            discard;
+          }
+          vec3 young = vec3(0.9, 0.95, 1.0);
+          vec3 old = vec3(0.1, 0.3, 0.9);
+          outColor = vec4(mix(old, young, clamp(Life, 0.0, 1.0)), 1.0);
+        }
+    )glsl",
+    .frag_out = "outColor",
+    .attribs = {"particle"}};
+
+// Same sum as eval_waves, written straight into the heights texture
+const ProgramSource terrain_compute_source{
+    .name = "terrain compute",
+    .compute = R"glsl(
+        #version 430 core
+        layout(local_size_x = 8, local_size_y = 8) in;
+
+        struct Wave {
+          float x;
+          float y;
+          float speed;
+          float size;
+          float time;
+        };
+
+        layout(std430, binding = 0) readonly buffer Waves {
+          Wave waves[];
+        };
+        layout(r32f, binding = 0) uniform writeonly image2D heights;
+        // The static terrain under the waves
+        layout(r32f, binding = 1) uniform readonly image2D base;
+
+        uniform int n_waves;
+        uniform int width;
+        uniform int mirror_row;
+
+        const float pi = 3.14159265358979323846;
+
+        void
+        main() {
+          int row = int(gl_GlobalInvocationID.y);
+          int col = int(gl_GlobalInvocationID.x);
+          if (row >= width || col >= width) {
+            return;
+          }
+
+          float acc_val = 0.0;
+          if (row < mirror_row) {
+            for (int step = 0; step < 2; ++step) {
+              int src_row = step == 0 ? row : mirror_row + mirror_row - row;
+              float row_norm = float(src_row) / float(width);
+              float col_norm = float(col) / float(width);
+
+              for (int i = 0; i < n_waves; ++i) {
+                Wave wave = waves[i];
+                float r = distance(vec2(col_norm, row_norm),
+                                   vec2(wave.x, wave.y));
+                float wave_place = r * pi * 4.0 - wave.time * wave.speed;
+
+                if (-0.5 * pi <= wave_place && wave_place <= 1.5 * pi) {
+                  float cos_w = cos(wave_place);
+                  if (wave_place > pi || wave_place < 0.0) {
+                    cos_w = cos_w * cos_w * cos_w;
+                  }
+                  if (cos_w < 0.0) {
+                    cos_w /= 6.0;
+                  }
+                  acc_val += wave.size * cos_w;
+                }
+              }
+            }
+          }
+          acc_val += imageLoad(base, ivec2(col, row)).r;
+          imageStore(heights, ivec2(col, row), vec4(acc_val));
+        }
+    )glsl"};
+
+struct Options {
+  int frames_in_flight = 2;
+  const char *shader_cache_dir = ".shader_cache";
+  // Evaluate the terrain with the compute shader from the start
+  bool compute_terrain = false;
+  // Compare the compute shader against eval_waves
+  bool check_compute = false;
+  // No crowd and a small particle pool unless asked for, a 100000 agent
+  // crowd alone is about 35 ms per tick on one core
+  int n_agents = 0;
+  int n_particles = 1 << 16;
+  // Base terrain from the erode tool, noise with noise_seed, or noise
+  // eroded at startup with erode_seed
+  const char *base_path = nullptr;
+  int noise_seed = -1;
+  int erode_seed = -1;
+  // Endless terrain around the play area, noise with world_seed made in the
+  // background within world_budget_mb
+  int world_seed = -1;
+  int world_budget_mb = 16;
+};
+
+void
+print_erosion_progress(float done, void *) {
+  printf("\rEroding %3d%%%s", (int)(100 * done), done < 1 ? "" : "\n");
+  fflush(stdout);
+}
+
+// Adds the static base terrain under the waves
 void
-render(GLFWwindow *window) {
+add_base(float *vals, const float *base, int n) {
+  for (int i = 0; i < n; ++i) {
+    vals[i] += base[i];
+  }
+}
+
+void
+render(GLFWwindow *window, const Options *options) {
 
   DrawContext overlay_context;
   DrawContext debug_context;
   DrawContext cube_context;
+  DrawContext cube_id_context;
+  DrawContext debug_id_context;
+  DrawContext crowd_context;
+  DrawContext particle_context;
 
-  GLuint vaos[3];
-  glGenVertexArrays(3, vaos);
+  GLuint vaos[5];
+  glGenVertexArrays(5, vaos);
   overlay_context.vao = vaos[0];
   cube_context.vao = vaos[1];
   debug_context.vao = vaos[2];
-
-  debug_context.shader_program = glCreateProgram();
-  overlay_context.shader_program = glCreateProgram();
-  cube_context.shader_program = glCreateProgram();
+  cube_id_context.vao = vaos[1];
+  debug_id_context.vao = vaos[2];
+  crowd_context.vao = vaos[3];
+  particle_context.vao = vaos[4];
+
+  ProgramCache program_cache;
+  init_program_cache(&program_cache, options->shader_cache_dir);
+
+  // All compiles and links are issued up front and finish while the buffers
+  // and textures below are set up. Attributes have fixed locations (their
+  // index in ProgramSource::attribs) so the VAOs don't need linked programs.
+  PendingProgram pending_programs[8];
+  size_t n_programs = 7;
+  begin_program(&program_cache, &overlay_program_source, &pending_programs[0]);
+  begin_program(&program_cache, &cube_program_source, &pending_programs[1]);
+  begin_program(&program_cache, &debug_program_source, &pending_programs[2]);
+  begin_program(&program_cache, &cube_id_program_source, &pending_programs[3]);
+  begin_program(&program_cache, &debug_id_program_source,
+                &pending_programs[4]);
+  begin_program(&program_cache, &crowd_program_source, &pending_programs[5]);
+  begin_program(&program_cache, &particle_program_source,
+                &pending_programs[6]);
+
+  // The compute terrain backend needs GL 4.3
+  bool compute_supported = GLEW_VERSION_4_3;
+  if (compute_supported) {
+    begin_program(&program_cache, &terrain_compute_source,
+                  &pending_programs[n_programs++]);
+  }
 
   glBindVertexArray(overlay_context.vao);
   GLuint overlay_texture;
@@ -221,46 +665,9 @@ render(GLFWwindow *window) {
       glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(elements), elements,
                    GL_STATIC_DRAW);
     }
-    GLuint vertex_shader = compile_shader(R"glsl(
-        #version 150 core
-
-        in vec2 position;
-        in vec2 uv;
-
-        out vec2 Texcoord;
-        void
-        main() {
-          gl_Position = vec4(position, 0.0, 1.0);
-          Texcoord = uv;
-        }
-    )glsl",
-                                          GL_VERTEX_SHADER);
-
-    GLuint fragment_shader = compile_shader(R"glsl(
-        #version 150 core
-        out vec4 outColor;
-        in vec2 Texcoord;
-
-        uniform sampler2D tex;
-
-        void
-        main() {
-          vec4 c = texture(tex, Texcoord);
-	  c.r /= 2.0;
-          outColor = vec4(c.r, c.r, c.r, 1.0);
-        }
-    )glsl",
-                                            GL_FRAGMENT_SHADER);
 
-    glAttachShader(overlay_context.shader_program, vertex_shader);
-    glAttachShader(overlay_context.shader_program, fragment_shader);
-    glBindFragDataLocation(overlay_context.shader_program, 0, "outColor");
-    glLinkProgram(overlay_context.shader_program);
-
-    GLuint pos_attrib =
-        glGetAttribLocation(overlay_context.shader_program, "position");
-    GLuint coord_attrib =
-        glGetAttribLocation(overlay_context.shader_program, "uv");
+    GLuint pos_attrib = 0;
+    GLuint coord_attrib = 1;
     int attr_size = sizeof(float) * 4;
     glVertexAttribPointer(pos_attrib, 2, GL_FLOAT, GL_FALSE, attr_size, 0);
     glEnableVertexAttribArray(pos_attrib);
@@ -351,8 +758,9 @@ render(GLFWwindow *window) {
   };
 
   // Pass cube to opengl (attr for verts and elements for connections)
-  [&attr, &cube_elements] {
-    GLuint arr[2];
+  GLuint cube_buffers[2];
+  [&attr, &cube_elements, &cube_buffers] {
+    GLuint *arr = cube_buffers;
     glGenBuffers(2, arr);
 
     const GLuint vbo = arr[0];
@@ -368,78 +776,6 @@ render(GLFWwindow *window) {
   //--------------------------------------------------------------------------------
   // Make Cube shader
   {
-    const char *new_vertex_source = R"glsl(
-        #version 150 core
-
-        in vec3 position;
-        in vec3 normal;
-
-        out vec3 FragPos;
-        out vec3 Normal;
-	out float Height;
-
-        uniform mat4 trans;
-        uniform mat4 view;
-        uniform mat4 proj;
-
-        void
-        main() {
-	  vec4 pos_t = trans * vec4(position, 1.0);
-          gl_Position = proj * view * trans * vec4(position, 1.0);
-          FragPos = vec3(trans * vec4(position, 1.0));
-          Normal = mat3(trans) * normal;
-	  Height = pos_t.y;
-        }
-    )glsl";
-
-    const char *new_fragment_source = R"glsl(
-        #version 150 core
-
-	in vec3 Normal;
-	in vec3 FragPos;
-	in float Height;
-
-	out vec4 outColor;
-
-	uniform bool debug;
-
-	void
-	main() {
-	  vec4 black = vec4(0.2, 0.1, 0.1, 1.0);
-	  vec4 green = vec4(0.0, 1.0, 0.0, 1.0);
-	  vec4 blue = vec4(0.0, 0.0, 1.0, 1.0);
-	  vec4 red = vec4(1.0, 0.4, 0.4, 1.0);
-
-	  float th = 0.5;
-	  if (Height < 0) {
-	    outColor = mix(blue, black, -Height * 10);
-	  } else if (Height <= th) {
-	    outColor = mix(blue, green, Height / th);
-	  } else {
-	    outColor = mix(green, red, (Height - th) / th);
-	  }
-
-	  vec3 lightPos = vec3(0, 500, 400);
-	  vec3 lightDir = normalize(lightPos - FragPos);
-	  vec3 norm = normalize(Normal);
-	  float diff = max(dot(norm, lightDir), 0.0);
-
-	  outColor *= min(0.1 + diff, 1.0);
-
-	  if (debug) {
-	    outColor *= 0.5;
-	  }
-	}
-    )glsl";
-    const GLuint vertex_shader =
-        compile_shader(new_vertex_source, GL_VERTEX_SHADER);
-    const GLuint fragment_shader =
-        compile_shader(new_fragment_source, GL_FRAGMENT_SHADER);
-
-    glAttachShader(cube_context.shader_program, vertex_shader);
-    glAttachShader(cube_context.shader_program, fragment_shader);
-    glBindFragDataLocation(cube_context.shader_program, 0, "outColor");
-    glLinkProgram(cube_context.shader_program);
 
     std::pair<const char *, size_t> program_args[] = {{"position", vert_size},
                                                       {"normal", vert_size}};
@@ -450,20 +786,19 @@ render(GLFWwindow *window) {
     }
 
     size_t offset = 0;
+    GLuint attr_location = 0;
     for (const auto &[name, el_size] : program_args) {
-      GLuint attr_location =
-          glGetAttribLocation(cube_context.shader_program, name);
       glEnableVertexAttribArray(attr_location);
       glVertexAttribPointer(attr_location, el_size, GL_FLOAT, GL_FALSE,
                             sizeof_attr, reinterpret_cast<void *>(offset));
       offset += sizeof(float) * el_size;
+      attr_location++;
     }
   }
 
   //--------------------------------------------------------------------------------
   // Define debug lines
   {
-    glUseProgram(debug_context.shader_program);
     glBindVertexArray(vaos[2]);
 
     // clang-format on
@@ -488,49 +823,28 @@ render(GLFWwindow *window) {
       glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_elements),
                    cube_elements, GL_STATIC_DRAW);
     }
-    GLuint vertex_shader = compile_shader(R"glsl(
-            #version 150 core
-            in vec3 position;
-
-            uniform mat4 trans;
-            uniform mat4 view;
-            uniform mat4 proj;
 
-            void
-            main() {
-              gl_Position = proj * view * trans * vec4(position, 1.0);
-            }
-	)glsl",
-                                          GL_VERTEX_SHADER);
-
-    GLuint fragment_shader = compile_shader(R"glsl(
-            #version 150 core
-
-            uniform vec3 inColor;
-	    out vec4 outColor;
-            void
-            main() {
-              outColor = vec4(inColor, 1.0);
-            }
-        )glsl",
-                                            GL_FRAGMENT_SHADER);
-
-    glAttachShader(debug_context.shader_program, vertex_shader);
-    glAttachShader(debug_context.shader_program, fragment_shader);
-    glBindFragDataLocation(debug_context.shader_program, 0, "outColorי");
-    glLinkProgram(debug_context.shader_program);
-
-    switch_to_context(&debug_context);
-    GLuint pos_attrib =
-        glGetAttribLocation(debug_context.shader_program, "position");
+    GLuint pos_attrib = 0;
     int attr_size = sizeof(float) * 3;
     glVertexAttribPointer(pos_attrib, 3, GL_FLOAT, GL_FALSE, attr_size, 0);
     glEnableVertexAttribArray(pos_attrib);
   }
 
+  finish_programs(&program_cache, pending_programs, n_programs);
+  overlay_context.shader_program = pending_programs[0].program;
+  cube_context.shader_program = pending_programs[1].program;
+  debug_context.shader_program = pending_programs[2].program;
+  cube_id_context.shader_program = pending_programs[3].program;
+  debug_id_context.shader_program = pending_programs[4].program;
+  crowd_context.shader_program = pending_programs[5].program;
+  particle_context.shader_program = pending_programs[6].program;
+  GLuint terrain_compute_program =
+      compute_supported ? pending_programs[7].program : 0;
+
   {
     size_t el_size = std::size(cube_elements);
-    GLint uniTrans = glGetUniformLocation(cube_context.shader_program, "trans");
+    GLint uniTerrain =
+        glGetUniformLocation(cube_context.shader_program, "terrain");
     GLuint uniView = glGetUniformLocation(cube_context.shader_program, "view");
     GLint uniProj = glGetUniformLocation(cube_context.shader_program, "proj");
     GLint uniDebug = glGetUniformLocation(cube_context.shader_program, "debug");
@@ -539,13 +853,243 @@ render(GLFWwindow *window) {
 
     float scale_f = 5.0F;
     float rot_f = 0.1;
+    // The camera orbits this point, I J K L move it
+    vec3f cam_target{0.0F, 0.0F, 0.0F};
 
     int terrain_width = 90;
-    float *terrain_vals =
-        (float *)malloc(sizeof(float *) * terrain_width * terrain_width);
+    float scale = 6.0F;
+    size_t terrain_size = sizeof(float) * terrain_width * terrain_width;
+    float *terrain_vals = (float *)calloc(1, terrain_size);
+    float *overlay_vals = (float *)malloc(terrain_size);
+    int mirror_row = (int)(0.90 * terrain_width);
+
+    // Heights of the previous frame, the hero collides with the terrain as it
+    // moves between the two
+    float *prev_terrain_vals = (float *)calloc(1, terrain_size);
+
+    // Static terrain the waves add to, flat unless loaded, noise or eroded.
+    // N makes new noise, E erodes it some more.
+    JobPool jobs;
+    init_job_pool(&jobs, -1);
+    ErosionParams erosion_params{.scale = scale};
+    uint32_t erosion_seed = options->erode_seed;
+    NoiseParams noise_params;
+    float *base_vals = (float *)calloc(1, terrain_size);
+    if (options->base_path != nullptr) {
+      int width;
+      float *loaded = load_heights(options->base_path, &width);
+      if (loaded == nullptr) {
+        fprintf(stderr, "Can't read %s\n", options->base_path);
+        exit(1);
+      }
+      // Nearest cell of the loaded terrain
+      for (int row = 0; row < terrain_width; ++row) {
+        for (int col = 0; col < terrain_width; ++col) {
+          int src_row = row * width / terrain_width;
+          int src_col = col * width / terrain_width;
+          base_vals[row * terrain_width + col] =
+              loaded[src_row * width + src_col];
+        }
+      }
+      free(loaded);
+    } else if (options->noise_seed >= 0) {
+      noise_params.seed = options->noise_seed;
+      generate_base_terrain(base_vals, terrain_width, 0.4F, noise_params,
+                            &jobs);
+    } else if (options->erode_seed >= 0) {
+      noise_params.seed = erosion_seed;
+      generate_base_terrain(base_vals, terrain_width, 0.4F, noise_params,
+                            &jobs);
+      erode_heights(base_vals, terrain_width, erosion_params, erosion_seed,
+                    &jobs, print_erosion_progress);
+    }
+    bool base_changed = true;
+
+    // Starts over cell (10, 20)
+    Hero hero;
+    init_hero(&hero, vec3f{-2.33F, 0.5F, -1.67F}, 0.1F);
+
+    // Where the hero can walk, and the way to the nearest star left. F makes
+    // the hero follow it.
+    PassGrid pass_grid;
+    init_pass_grid(&pass_grid, terrain_width, PassParams{});
+    PathSearch path_search;
+    init_path_search(&path_search, terrain_width);
+    DistanceField star_field;
+    init_distance_field(&star_field, &pass_grid);
+    bool auto_route = false;
+    int route[64];
+    int n_route = 0;
+
+    // Creatures fleeing the waves and seeking the stars, simulated on all
+    // cores
+    FlowField crowd_flow;
+    init_flow_field(&crowd_flow, terrain_width);
+    Crowd crowd;
+    init_crowd(&crowd, options->n_agents, scale, CrowdParams{});
+    spawn_agents(&crowd, options->n_agents, 1);
+
+    // The cube mesh drawn once per agent, the positions are streamed from
+    // crowd.positions every frame
+    GLuint agents_vbo;
+    {
+      glBindVertexArray(crowd_context.vao);
+      glBindBuffer(GL_ARRAY_BUFFER, cube_buffers[0]);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_buffers[1]);
+      GLsizei stride = sizeof(float) * 6;
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride,
+                            (void *)(sizeof(float) * 3));
+      glEnableVertexAttribArray(1);
+
+      glGenBuffers(1, &agents_vbo);
+      glBindBuffer(GL_ARRAY_BUFFER, agents_vbo);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * crowd.capacity,
+                   nullptr, GL_STREAM_DRAW);
+      for (GLuint axis = 0; axis < 3; ++axis) {
+        size_t offset = sizeof(float) * axis * crowd.capacity;
+        glVertexAttribPointer(2 + axis, 1, GL_FLOAT, GL_FALSE, 0,
+                              (void *)offset);
+        glVertexAttribDivisor(2 + axis, 1);
+        glEnableVertexAttribArray(2 + axis);
+      }
+    }
+
+    // Splashes of placed waves and sparks of collected stars. The live ones
+    // are written straight into the mapped instance buffer.
+    Particles particles;
+    init_particles(&particles, options->n_particles, ParticleParams{});
+    GLuint particles_vbo;
+    {
+      glBindVertexArray(particle_context.vao);
+      glGenBuffers(1, &particles_vbo);
+      glBindBuffer(GL_ARRAY_BUFFER, particles_vbo);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 4 * particles.capacity,
+                   nullptr, GL_STREAM_DRAW);
+      glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
+      glVertexAttribDivisor(0, 1);
+      glEnableVertexAttribArray(0);
+      glEnable(GL_PROGRAM_POINT_SIZE);
+    }
+
+    // Min/max blocks over terrain_vals for the ray queries
+    HeightPyramid terrain_pyramid;
+    init_height_pyramid(&terrain_pyramid, terrain_width);
+    bool pyramid_built = false;
+
+    // Heights read by the cube shader, written by eval_waves on the CPU or
+    // by the compute shader
+    GLuint heights_texture;
+    {
+      glGenTextures(1, &heights_texture);
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, heights_texture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, terrain_width, terrain_width, 0,
+                   GL_RED, GL_FLOAT, terrain_vals);
+      glActiveTexture(GL_TEXTURE0);
+
+      glUseProgram(cube_context.shader_program);
+      glUniform1i(glGetUniformLocation(cube_context.shader_program, "heights"),
+                  1);
+      glUniform1i(glGetUniformLocation(cube_context.shader_program, "width"),
+                  terrain_width);
+
+      glUseProgram(cube_id_context.shader_program);
+      glUniform1i(
+          glGetUniformLocation(cube_id_context.shader_program, "heights"), 1);
+      glUniform1i(glGetUniformLocation(cube_id_context.shader_program, "width"),
+                  terrain_width);
+      glUniform1ui(
+          glGetUniformLocation(cube_id_context.shader_program, "id_base"),
+          pick_id(PickKind::Terrain, 0));
+    }
+
+    // Chunks of endless terrain around the play area, generated in the
+    // background. Each slot gets a texture on unit 3 when first drawn, the
+    // heights go up again when the slot's version changes.
+    ChunkCache world;
+    ChunkView *world_views = nullptr;
+    GLuint *world_textures = nullptr;
+    uint32_t *world_versions = nullptr;
+    if (options->world_seed >= 0) {
+      NoiseParams world_noise = noise_params;
+      world_noise.seed = options->world_seed;
+      ChunkParams world_params{
+          .chunk_size = scale,
+          .budget_bytes = (size_t)options->world_budget_mb << 20};
+      init_chunk_cache(&world, world_noise, world_params, -1);
+      world_views = (ChunkView *)malloc(sizeof(ChunkView) * world.n_slots);
+      world_textures = (GLuint *)calloc(world.n_slots, sizeof(GLuint));
+      world_versions = (uint32_t *)calloc(world.n_slots, sizeof(uint32_t));
+      printf("World: %d chunk slots, %d threads\n", world.n_slots,
+             world.n_threads);
+    }
+    GLint uniHeights =
+        glGetUniformLocation(cube_context.shader_program, "heights");
+    GLint uniWidth = glGetUniformLocation(cube_context.shader_program, "width");
+
+    // GPU picking: ids are drawn into an offscreen integer target and only
+    // the pixel under the cursor is read back, a frame or two later
+    GLuint id_fbo;
+    {
+      glGenFramebuffers(1, &id_fbo);
+      glBindFramebuffer(GL_FRAMEBUFFER, id_fbo);
+
+      GLuint renderbuffers[2];
+      glGenRenderbuffers(2, renderbuffers);
+      glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, screen_width,
+                            screen_height);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                GL_RENDERBUFFER, renderbuffers[0]);
+      glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24,
+                            screen_width, screen_height);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                GL_RENDERBUFFER, renderbuffers[1]);
+
+      if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+          GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "ID buffer is incomplete\n");
+        exit(1);
+      }
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    AsyncReadback pick_readback;
+    init_async_readback(&pick_readback, sizeof(uint32_t));
+    uint32_t picked_id = 0;
+
+    // Compute backend: waves go up as an SSBO, the heights come back to
+    // terrain_vals a few frames later for picking and the stars
+    bool compute_terrain = options->compute_terrain && compute_supported;
+    GLuint waves_ssbo = 0;
+    GLuint base_texture = 0;
+    AsyncReadback terrain_readback;
+    float *check_vals = nullptr;
+    if (compute_supported) {
+      glGenBuffers(1, &waves_ssbo);
+      glGenTextures(1, &base_texture);
+      glActiveTexture(GL_TEXTURE2);
+      glBindTexture(GL_TEXTURE_2D, base_texture);
+      glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, terrain_width, terrain_width);
+      glActiveTexture(GL_TEXTURE0);
+      init_async_readback(&terrain_readback, terrain_size);
+      if (options->check_compute) {
+        check_vals = (float *)malloc(terrain_size * readback_frames);
+      }
+    } else if (options->compute_terrain) {
+      fprintf(stderr, "Compute terrain needs GL 4.3, using the CPU\n");
+    }
 
     bool debug_overlay = false;
     bool overlay_texture = false;
+    bool print_stats = false;
+    bool gpu_picking = false;
     UserInput user_input;
     KeyState mouse_state = KeyState::KeyUp;
 
@@ -560,13 +1104,99 @@ render(GLFWwindow *window) {
     // Star collection demo params
     constexpr int n_pts = 15;
     bool collected[n_pts];
+    vec3f star_positions[n_pts];
+    {
+      vec3f p0{0, 0.5, 0};
+      vec3f addy{0, 0.3, 0};
+      float radius = 2;
+      for (int i = 0; i < n_pts; ++i) {
+        float t = 2 * pi * (float)i / (float)n_pts;
+        vec3f c_dir = vec3f{cosf(t), 0, sinf(t)};
+        star_positions[i] = p0 + addy + 0.7 * radius * c_dir;
+      }
+    }
+
+    // Stars the base terrain alone reaches, found again when the base changes
+    int base_reached[n_pts];
+    int n_base_reached = 0;
+    bool base_reached_dirty = true;
+
+    // Stars not collected yet, by tiles of about 8x8 terrain cells
+    SpatialHash star_hash;
+    init_spatial_hash(&star_hash, 0.5F, 64, n_pts);
     for (int i = 0; i < n_pts; ++i) {
       collected[i] = false;
+      insert_entity(&star_hash, i,
+                    vec2f{star_positions[i].x, star_positions[i].z});
     }
 
+    // The debug shapes that only move with their parents. The hero goes
+    // last, updating it doesn't sweep over the static nodes.
+    TransformTree transforms;
+    init_transform_tree(&transforms, terrain_width + 2 * n_pts +
+                                         (2 * n_pts + 1) * (1 + star_spokes));
+    int first_wall_line = transforms.n;
+    {
+      // The mirror wall markers, all x then all y then all z
+      float *wall_pos = (float *)malloc(sizeof(float) * 3 * terrain_width);
+      float *xs = wall_pos;
+      float *ys = wall_pos + terrain_width;
+      float *zs = wall_pos + 2 * terrain_width;
+      float row_norm = (float)mirror_row / terrain_width;
+      for (int col = 0; col < terrain_width; ++col) {
+        xs[col] = row_norm - 0.5F;
+        ys[col] = 0;
+        zs[col] = (float)col / terrain_width - 0.5F;
+      }
+      transform_points_affine(diagonal(scale, 1.0F, scale, 1), xs, ys, zs, xs,
+                              ys, zs, terrain_width);
+      for (int col = 0; col < terrain_width; ++col) {
+        vec3f pppos{xs[col], ys[col], zs[col]};
+        vec3f addy{0, 2, 0};
+        add_transform(&transforms, -1,
+                      line_transform(pppos, pppos + addy, 0.01));
+      }
+      free(wall_pos);
+    }
+    int first_demo_line = transforms.n;
+    {
+      vec3f p0{0, 0.5, 0};
+      float radius = 2;
+      for (int i = 0; i < n_pts; ++i) {
+        float t = 2 * pi * (float)i / (float)n_pts;
+        vec3f c_dir = vec3f{cosf(t), 0, sinf(t)};
+        add_transform(&transforms, -1,
+                      line_transform(p0, p0 + radius * c_dir, 0.01));
+        add_transform(&transforms, -1,
+                      line_transform(vec3f{0, 0, 0}, radius * c_dir, 0.01));
+      }
+    }
+    // Each star and its shadow on the ground
+    int star_nodes[n_pts];
+    int shadow_nodes[n_pts];
+    for (int i = 0; i < n_pts; ++i) {
+      vec3f star_pos = star_positions[i];
+      star_nodes[i] = add_star(&transforms, star_pos, 0.03);
+      star_pos.y = 0;
+      shadow_nodes[i] = add_star(&transforms, star_pos, 0.1);
+    }
+    int hero_node = add_star(&transforms, hero.pos, hero.radius);
+
+    FrameTimers frame_timers;
+    init_frame_timers(&frame_timers);
+    FrameStats frame_stats;
+
+    FrameLatency frame_latency;
+    init_frame_latency(&frame_latency, options->frames_in_flight);
+
     while (!glfwWindowShouldClose(window)) {
+      wait_for_frame_slot(&frame_latency);
 
-      // User input
+      // User input, sampled as late as possible before the camera and the
+      // mouse ray are set up
+      glfwPollEvents();
+      mark_input_sampled(&frame_latency);
+      begin_frame(&frame_timers);
 
       double mouse_x, mouse_y;
       glfwGetCursorPos(window, &mouse_x, &mouse_y);
@@ -586,9 +1216,48 @@ render(GLFWwindow *window) {
         overlay_texture = !overlay_texture;
       }
 
+      if (key_state(&user_input, GLFW_KEY_T) == KeyState::KeyPressed) {
+        print_stats = !print_stats;
+      }
+
+      if (key_state(&user_input, GLFW_KEY_C) == KeyState::KeyPressed &&
+          compute_supported) {
+        compute_terrain = !compute_terrain;
+        printf("Terrain on the %s\n", compute_terrain ? "GPU" : "CPU");
+      }
+
+      if (key_state(&user_input, GLFW_KEY_P) == KeyState::KeyPressed) {
+        gpu_picking = !gpu_picking;
+        picked_id = 0;
+        printf("Picking on the %s\n", gpu_picking ? "GPU" : "CPU");
+      }
+
+      if (key_state(&user_input, GLFW_KEY_F) == KeyState::KeyPressed) {
+        auto_route = !auto_route;
+      }
+
+      if (key_state(&user_input, GLFW_KEY_E) == KeyState::KeyPressed) {
+        erode_heights(base_vals, terrain_width, erosion_params,
+                      ++erosion_seed, &jobs, print_erosion_progress);
+        base_changed = true;
+        base_reached_dirty = true;
+      }
+
+      if (key_state(&user_input, GLFW_KEY_N) == KeyState::KeyPressed) {
+        ++noise_params.seed;
+        generate_base_terrain(base_vals, terrain_width, 0.4F, noise_params,
+                              &jobs);
+        base_changed = true;
+        base_reached_dirty = true;
+      }
+
       if (key_state(&user_input, GLFW_KEY_R) == KeyState::KeyPressed) {
         n_waves = 0;
         for (int i = 0; i < n_pts; ++i) {
+          if (collected[i]) {
+            insert_entity(&star_hash, i,
+                          vec2f{star_positions[i].x, star_positions[i].z});
+          }
           collected[i] = false;
         }
       }
@@ -633,6 +1302,23 @@ render(GLFWwindow *window) {
         }
       }
 
+      // Pan
+      {
+        vec3f forward{-sinf(rot_f), 0, -cosf(rot_f)};
+        vec3f right{-forward.z, 0, forward.x};
+        float step = 0.02F * scale_f;
+        if (glfwGetKey(window, GLFW_KEY_I)) {
+          cam_target = cam_target + step * forward;
+        } else if (glfwGetKey(window, GLFW_KEY_K)) {
+          cam_target = cam_target - step * forward;
+        }
+        if (glfwGetKey(window, GLFW_KEY_L)) {
+          cam_target = cam_target + step * right;
+        } else if (glfwGetKey(window, GLFW_KEY_J)) {
+          cam_target = cam_target - step * right;
+        }
+      }
+
       if (glfwGetKey(window, GLFW_KEY_Q)) {
         printf("Exit\n");
         exit(0);
@@ -651,21 +1337,22 @@ render(GLFWwindow *window) {
       //--------------------------------------------------
       mat4f view;
       mat4f proj;
-      vec3f cam_pos{scale_f * sinf(rot_f), 0.7F * scale_f,
-                    scale_f * cosf(rot_f)};
+      float fov = 45.0F * deg2rad;
+      float aspect = float(screen_width) / screen_height;
+      vec3f cam_pos = cam_target + vec3f{scale_f * sinf(rot_f), 0.7F * scale_f,
+                                         scale_f * cosf(rot_f)};
       //      cam_pos = vec3f{0, 1, 10};
       {
 
         // clang-format off
         view =  look_at(
         		cam_pos,
-        		vec3f{0.0F, 0.0F, 0.0F},
+        		cam_target,
         		vec3f{0.0F, 1.0F, 0.0F});
         // clang-format on
         glUniformMatrix4fv(uniView, 1, GL_FALSE, view.elements);
 
-        proj = perspective(45.0F * deg2rad, float(screen_width) / screen_height,
-                           0.5f, 100.F);
+        proj = perspective(fov, aspect, 0.5f, 100.F);
 
         glUniformMatrix4fv(uniProj, 1, GL_FALSE, proj.elements);
       };
@@ -674,212 +1361,513 @@ render(GLFWwindow *window) {
       vec3f dir;
       vec3f ray_normal;
       {
-        mat4f view2 = copy(&view);
-        view2.elements[12] = 0;
-        view2.elements[13] = 0;
-        view2.elements[14] = 0;
-        mat4f invVP = inverse(proj * view2);
-        vec3f screen_pos{(float)mouse_x, -(float)mouse_y, 1.0F};
-        dir = invVP * screen_pos;
-        dir = normalized(dir);
-
-        vec3f cam_x = {view2.elements[4 * 0 + 0], view2.elements[4 * 1 + 0],
-                       view2.elements[4 * 2 + 0]};
-
+        affine3f cam = to_affine(view);
+        dir = camera_ray(cam, fov, aspect,
+                         vec2f{(float)mouse_x, -(float)mouse_y});
+        vec3f cam_x{view.elements[4 * 0 + 0], view.elements[4 * 1 + 0],
+                    view.elements[4 * 2 + 0]};
         ray_normal = normalized(cross(dir, cam_x));
       }
 
-      init_debug_draw(&debug_context, view, proj);
-
       glClearColor(0.0F, 0.0F, 0.0F, 1.0F);
       glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-      float scale = 6.0F;
       mat4f scale_mat = diagonal(scale, 1.0F, scale, 1);
 
-      float w_pix = 1.0F / terrain_width;
-
       // Define terrain
-      for (int i = 0; i < terrain_width * terrain_width; ++i) {
-        terrain_vals[i] = 0;
-      }
-      int mirror_row = (int)(0.90 * terrain_width);
-
-      int hero_row = 10;
-      int hero_col = 20;
-      // mirror_row = terrain_width;
-      for (int row = 0; row < mirror_row; ++row) {
-        for (int col = 0; col < terrain_width; ++col) {
-          float acc_val = 0;
-          for (int step = 0; step < 2; ++step) {
-
-            float row_norm = (float)row / terrain_width;
-            float col_norm = (float)col / terrain_width;
-
-            if (step == 1) {
-              row_norm = (float)(mirror_row + mirror_row - row) / terrain_width;
-              col_norm = (float)col / terrain_width;
-            }
-
-            for (int i = 0; i < n_waves; ++i) {
-              auto wave = waves[i];
-              float r = sqrtf(powf(col_norm - wave.x, 2) +
-                              powf(row_norm - wave.y, 2));
-              float tt = wave.time * wave.speed;
-
-              float repititions = 4;
+      int waves_scope = begin_scope(&frame_timers, "waves");
+      if (compute_terrain) {
+        if (base_changed) {
+          glActiveTexture(GL_TEXTURE2);
+          glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, terrain_width, terrain_width,
+                          GL_RED, GL_FLOAT, base_vals);
+          glActiveTexture(GL_TEXTURE0);
+          base_changed = false;
+        }
+        glUseProgram(terrain_compute_program);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, waves_ssbo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(waves), nullptr,
+                     GL_STREAM_DRAW);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Wave) * n_waves,
+                        waves);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, waves_ssbo);
+        glBindImageTexture(0, heights_texture, 0, GL_FALSE, 0, GL_WRITE_ONLY,
+                           GL_R32F);
+        glBindImageTexture(1, base_texture, 0, GL_FALSE, 0, GL_READ_ONLY,
+                           GL_R32F);
+
+        GLuint prog = terrain_compute_program;
+        glUniform1i(glGetUniformLocation(prog, "n_waves"), n_waves);
+        glUniform1i(glGetUniformLocation(prog, "width"), terrain_width);
+        glUniform1i(glGetUniformLocation(prog, "mirror_row"), mirror_row);
+        GLuint groups = (terrain_width + 7) / 8;
+        glDispatchCompute(groups, groups, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+                        GL_TEXTURE_UPDATE_BARRIER_BIT |
+                        GL_PIXEL_BUFFER_BARRIER_BIT);
+
+        int slot = begin_readback(&terrain_readback);
+        glActiveTexture(GL_TEXTURE1);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, nullptr);
+        glActiveTexture(GL_TEXTURE0);
+        end_readback(&terrain_readback);
+        if (check_vals != nullptr) {
+          float *ref = &check_vals[slot * terrain_width * terrain_width];
+          eval_waves(ref, terrain_width, mirror_row, waves, n_waves);
+          add_base(ref, base_vals, terrain_width * terrain_width);
+        }
 
-              float wave_place = r * pi * repititions - tt;
-	      
+        // Picking and the stars use the newest copy that made it back
+        slot = fetch_readback(&terrain_readback, terrain_vals);
+        if (slot >= 0 && check_vals != nullptr) {
+          float *ref = &check_vals[slot * terrain_width * terrain_width];
+          float max_err = 0;
+          for (int i = 0; i < terrain_width * terrain_width; ++i) {
+            max_err = fmaxf(max_err, fabsf(terrain_vals[i] - ref[i]));
+          }
+          printf("compute terrain max error %g\n", max_err);
+        }
+      } else {
+        eval_waves(terrain_vals, terrain_width, mirror_row, waves, n_waves);
+        add_base(terrain_vals, base_vals, terrain_width * terrain_width);
+        glActiveTexture(GL_TEXTURE1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, terrain_width, terrain_width,
+                        GL_RED, GL_FLOAT, terrain_vals);
+        glActiveTexture(GL_TEXTURE0);
+      }
 
-              if (-0.5 * pi <= wave_place && wave_place <= 1.5 * pi) {
+      for (int i = 0; i < n_waves; ++i) {
+        waves[i].time += time_delta;
+      }
 
-                float cos_w = cosf(wave_place);
+      Heightfield terrain{
+          .vals = terrain_vals, .width = terrain_width, .scale = scale};
+      // Only the blocks over cells that changed since the last frame, all of
+      // them the first time
+      {
+        int row0 = 0;
+        int col0 = 0;
+        int row1 = terrain_width;
+        int col1 = terrain_width;
+        if (!pyramid_built ||
+            changed_cells(terrain_vals, prev_terrain_vals, terrain_width,
+                          &row0, &col0, &row1, &col1)) {
+          update_height_pyramid(&terrain_pyramid, &terrain, row0, col0, row1,
+                                col1);
+          pyramid_built = true;
+        }
+      }
+      end_scope(&frame_timers, waves_scope);
+
+      // Terrain cell under a world position
+      auto cell_at = [&](vec3f p) {
+        int row = (int)floorf((p.x / scale + 0.5F) * terrain_width + 0.5F);
+        int col = (int)floorf((p.z / scale + 0.5F) * terrain_width + 0.5F);
+        return std::clamp(row, 0, terrain_width - 1) * terrain_width +
+               std::clamp(col, 0, terrain_width - 1);
+      };
 
-                if (wave_place > pi || wave_place < 0) {
-                  cos_w = powf(cos_w, 3);
-                }
-                if (cos_w < 0) {
-                  cos_w /= 6;
-                }
+      // Only the tiles the waves changed are revisited
+      int paths_scope = begin_scope(&frame_timers, "paths");
+      update_pass_grid(&pass_grid, &terrain);
+      for (int i = 0; i < n_pts; ++i) {
+        set_goal(&star_field, cell_at(star_positions[i]), !collected[i]);
+      }
+      repair_distance_field(&star_field, &pass_grid);
+      n_route = follow_field(&star_field, cell_at(hero.pos), route,
+                             std::size(route));
+      end_scope(&frame_timers, paths_scope);
+
+      int crowd_scope = begin_scope(&frame_timers, "crowd");
+      if (crowd.n > 0) {
+        Heightfield prev_terrain{
+            .vals = prev_terrain_vals, .width = terrain_width, .scale = scale};
+        update_flow_field(&crowd_flow, &jobs, &star_field, &prev_terrain,
+                          &terrain, crowd.params);
+        update_crowd(&crowd, &jobs, &crowd_flow, &pass_grid, &terrain,
+                     time_delta);
+      }
+      end_scope(&frame_timers, crowd_scope);
 
-                float val_f = wave.size * (cos_w);
-                acc_val += val_f;
-              }
-            }
-          }
-          if ((pow(hero_row - row, 2) + pow(hero_col - col, 2)) >= 25) {
-            terrain_vals[row * terrain_width + col] = acc_val;
-          } else {
-            terrain_vals[row * terrain_width + col] = 1;
+      // Hero, the arrow keys move it relative to the camera
+      int hero_scope = begin_scope(&frame_timers, "hero");
+      {
+        vec3f forward = normalized(vec3f{cam_target.x - cam_pos.x, 0,
+                                         cam_target.z - cam_pos.z});
+        vec3f right = cross(forward, vec3f{0, 1, 0});
+        vec3f move{0, 0, 0};
+        if (glfwGetKey(window, GLFW_KEY_UP)) {
+          move = move + forward;
+        } else if (glfwGetKey(window, GLFW_KEY_DOWN)) {
+          move = move - forward;
+        }
+        if (glfwGetKey(window, GLFW_KEY_RIGHT)) {
+          move = move + right;
+        } else if (glfwGetKey(window, GLFW_KEY_LEFT)) {
+          move = move - right;
+        }
+        if (auto_route && len(move) == 0 && n_route > 1) {
+          // Towards a cell a few steps down the route
+          int target = route[std::min(3, n_route - 1)];
+          vec3f to{((float)(target / terrain_width) / terrain_width - 0.5F) *
+                           scale -
+                       hero.pos.x,
+                   0,
+                   ((float)(target % terrain_width) / terrain_width - 0.5F) *
+                           scale -
+                       hero.pos.z};
+          if (len(to) > 1e-3F) {
+            move = normalized(to);
           }
         }
-      }
+        move = 1.5F * move;
 
-      for (int i = 0; i < n_waves; ++i) {
-        waves[i].time += time_delta;
+        Heightfield prev_terrain{
+            .vals = prev_terrain_vals, .width = terrain_width, .scale = scale};
+        update_hero(&hero, &prev_terrain, &terrain, vec2f{move.x, move.z},
+                    glfwGetKey(window, GLFW_KEY_SPACE), time_delta);
+        memcpy(prev_terrain_vals, terrain_vals, terrain_size);
       }
+      end_scope(&frame_timers, hero_scope);
 
-      glEnable(GL_DEPTH_TEST);
+      init_debug_draw(&debug_context, view, proj);
 
-      // Find chosen terrain box
+      glEnable(GL_DEPTH_TEST);
 
-      // Mouse choose box
+      // Mouse choose box, the first column the mouse ray hits
+      int picking_scope = begin_scope(&frame_timers, "picking");
+      RayHit pick{};
+      if (gpu_picking) {
+        // The newest id that made it back from the ID pass
+        uint32_t id;
+        if (fetch_readback(&pick_readback, &id) >= 0) {
+          picked_id = id;
+        }
+      } else {
+        pick =
+            raycast_heightfield(&terrain, &terrain_pyramid, cam_pos, dir, 100);
+        picked_id = pick.hit ? pick_id(PickKind::Terrain,
+                                       pick.row * terrain_width + pick.col)
+                             : 0;
+      }
       int chosen_row = -1;
       int chosen_col = -1;
-      float max_score = -1;
-      for (int row = 0; row < terrain_width; ++row) {
-        for (int col = 0; col < terrain_width; ++col) {
-          float row_norm = (float)row / terrain_width;
-          float col_norm = (float)col / terrain_width;
-          float acc_val = terrain_vals[row * terrain_width + col];
-          vec3f pppos{row_norm - 0.5F, acc_val, col_norm - 0.5F};
-          pppos = scale_mat * pppos;
-          vec3f cam2pos = normalized(pppos - cam_pos);
-          float score = dot(cam2pos, dir);
-          if (score > max_score) {
-            max_score = score;
-            chosen_row = row;
-            chosen_col = col;
-          }
-          score = powf(score, 500);
+      if (pick_kind(picked_id) == PickKind::Terrain) {
+        chosen_row = pick_index(picked_id) / terrain_width;
+        chosen_col = pick_index(picked_id) % terrain_width;
+      }
 
-          if (debug_overlay) {
-            draw_line(&debug_context, pppos, pppos + vec3f{0, score, 0},
-                      vec3f{0.8, 0.9, 0.6});
-          }
-        }
+      if (debug_overlay && pick.hit) {
+        vec3f hit_pos = cam_pos + pick.t * dir;
+        draw_line(&debug_context, hit_pos, hit_pos + 0.3 * pick.normal,
+                  vec3f{0.8, 0.9, 0.6});
       }
 
+      end_scope(&frame_timers, picking_scope);
+
+      // Only the hero moved since the last frame, its spokes follow
+      int debug_scope = begin_scope(&frame_timers, "debug");
+      set_translation(&transforms, hero_node, hero.pos);
+      update_transforms(&transforms);
+
       // Draw mirror wall
-      {
-        float row_norm = (float)mirror_row / terrain_width;
-        for (int col = 0; col < terrain_width; ++col) {
-          float col_norm = (float)col / terrain_width;
-          vec3f pppos{row_norm - 0.5F, 0, col_norm - 0.5F};
-          pppos = scale_mat * pppos;
-          vec3f addy{0, 2, 0};
-          draw_line(&debug_context, pppos, pppos + addy, vec3f{1, 0, 0});
-        }
-      }
+      draw_nodes(&debug_context, &transforms, first_wall_line, terrain_width,
+                 vec3f{1, 0, 0});
 
       // Draw hero
+      vec3f hero_pos = hero.pos;
       {
-        float row_norm = (float)hero_row / terrain_width;
-        float col_norm = (float)hero_col / terrain_width;
-        vec3f pppos{row_norm - 0.5F, 0.3, col_norm - 0.5F};
-        pppos = scale_mat * pppos;
-        draw_star(&debug_context, pppos, 0.1, vec3f{1, 0.5, 0.5});
-        draw_star(&debug_context, pppos + vec3f{0, -0.3, 0}, 0.1,
-                  vec3f{1, 0.5, 0.5});
+        vec3f hero_color = pick_kind(picked_id) == PickKind::Hero
+                               ? vec3f{1, 0.9, 0.9}
+                               : vec3f{1, 0.5, 0.5};
+        draw_star(&debug_context, &transforms, hero_node, hero_color);
+      }
+
+      // Routes, to the nearest star and with jump point search to the
+      // chosen cell
+      if (debug_overlay) {
+        auto cell_pos = [&](int cell) {
+          int row = cell / terrain_width;
+          int col = cell % terrain_width;
+          return vec3f{((float)row / terrain_width - 0.5F) * scale,
+                       terrain_vals[cell] + 0.05F,
+                       ((float)col / terrain_width - 0.5F) * scale};
+        };
+        for (int k = 1; k < n_route; ++k) {
+          draw_line(&debug_context, cell_pos(route[k - 1]), cell_pos(route[k]),
+                    vec3f{0, 0.8, 0.8});
+        }
+        if (chosen_row >= 0) {
+          int jump_points[64];
+          int n = find_path(&pass_grid, &path_search, cell_at(hero.pos),
+                            chosen_row * terrain_width + chosen_col,
+                            jump_points, std::size(jump_points));
+          for (int k = 1; k < n; ++k) {
+            draw_line(&debug_context, cell_pos(jump_points[k - 1]),
+                      cell_pos(jump_points[k]), vec3f{0.8, 0, 0.8});
+          }
+        }
       }
       // Draw lines for demo
       {
-        vec3f p0{0, 0.5, 0};
-        vec3f addy{0, 0.3, 0};
-        float radius = 2;
-        for (int i = 0; i < n_pts; ++i) {
-          float t = 2 * pi * (float)i / (float)n_pts;
-          vec3f c_dir = vec3f{cosf(t), 0, sinf(t)};
-          draw_line(&debug_context, p0, p0 + radius * c_dir, vec3f{1, 1, 1});
-          draw_line(&debug_context, vec3f{0, 0, 0}, radius * c_dir,
-                    vec3f{0, 0, 0});
+        auto collect = [&](int i) {
+          collected[i] = true;
+          remove_entity(&star_hash, i);
+          emit_particles(&particles, star_positions[i], vec3f{0, 1, 0}, 1.0F,
+                         1.5F, 5000);
+        };
+
+        // Away from the wave rings the terrain is the base, only the stars
+        // in tiles the rings touch or that the base reaches can have been
+        // collected
+        if (base_reached_dirty) {
+          Heightfield base{
+              .vals = base_vals, .width = terrain_width, .scale = scale};
+          vec2f star_xz[n_pts];
+          float base_heights[n_pts];
+          for (int i = 0; i < n_pts; ++i) {
+            star_xz[i] = vec2f{star_positions[i].x, star_positions[i].z};
+          }
+          sample_heights(&base, star_xz, base_heights, n_pts,
+                         SampleMode::Nearest);
+          n_base_reached = 0;
+          for (int i = 0; i < n_pts; ++i) {
+            if (base_heights[i] > star_positions[i].y) {
+              base_reached[n_base_reached++] = i;
+            }
+          }
+          base_reached_dirty = false;
+        }
+        int candidates[n_pts];
+        int n_candidates = 0;
+        bool is_candidate[n_pts] = {};
+        for (int k = 0; k < n_base_reached; ++k) {
+          int i = base_reached[k];
+          if (!collected[i]) {
+            is_candidate[i] = true;
+            candidates[n_candidates++] = i;
+          }
+        }
+        auto add_candidates = [&](float row_norm, float col_norm, float r0,
+                                  float r1) {
+          // Stars are checked against the column they are over
+          float margin = scale / terrain_width;
+          vec2f center{(row_norm - 0.5F) * scale, (col_norm - 0.5F) * scale};
+          int found[n_pts];
+          int n = query_ring(&star_hash, center, r0 * scale - margin,
+                             r1 * scale + margin, found, n_pts);
+          for (int k = 0; k < std::min(n, n_pts); ++k) {
+            if (!is_candidate[found[k]]) {
+              is_candidate[found[k]] = true;
+              candidates[n_candidates++] = found[k];
+            }
+          }
+        };
+        for (int i = 0; i < n_waves; ++i) {
+          // Where wave_place is in [-pi / 2, 3 pi / 2], widened by this
+          // frame's step since the terrain was evaluated before it
+          float tt = waves[i].time * waves[i].speed;
+          float slack = fabsf(waves[i].speed * time_delta);
+          float r0 = (tt - slack - 0.5F * pi) / (4 * pi);
+          float r1 = (tt + slack + 1.5F * pi) / (4 * pi);
+          add_candidates(waves[i].y, waves[i].x, r0, r1);
+          add_candidates((float)(2 * mirror_row) / terrain_width - waves[i].y,
+                         waves[i].x, r0, r1);
+        }
 
-          vec3f star_pos = p0 + addy + 0.7 * radius * c_dir;
+        vec2f candidate_xz[n_pts];
+        float candidate_heights[n_pts];
+        for (int k = 0; k < n_candidates; ++k) {
+          vec3f star_pos = star_positions[candidates[k]];
+          candidate_xz[k] = vec2f{star_pos.x, star_pos.z};
+        }
+        sample_heights(&terrain, candidate_xz, candidate_heights, n_candidates,
+                       SampleMode::Nearest);
+        for (int k = 0; k < n_candidates; ++k) {
+          int i = candidates[k];
+          if (candidate_heights[k] > star_positions[i].y) {
+            collect(i);
+          }
+        }
 
-          float x = star_pos.x;
-          float z = star_pos.z;
+        // The hero picks up the stars it touches, the ring only finds the
+        // ones it is under
+        constexpr float reach = 0.15F;
+        int near_hero[n_pts];
+        int n_near = query_ring(&star_hash, vec2f{hero.pos.x, hero.pos.z}, 0,
+                                reach, near_hero, n_pts);
+        for (int k = 0; k < std::min(n_near, n_pts); ++k) {
+          if (len(star_positions[near_hero[k]] - hero.pos) <= reach) {
+            collect(near_hero[k]);
+          }
+        }
 
-          int row = (int)((x / scale + 0.5) * terrain_width);
-          int col = (int)((z / scale + 0.5) * terrain_width);
-          float acc_val = terrain_vals[row * terrain_width + col];
+        for (int i = 0; i < n_pts; ++i) {
+          draw_nodes(&debug_context, &transforms, first_demo_line + 2 * i, 1,
+                     vec3f{1, 1, 1});
+          draw_nodes(&debug_context, &transforms, first_demo_line + 2 * i + 1,
+                     1, vec3f{0, 0, 0});
 
-          if (acc_val > star_pos.y) {
-            collected[i] = true;
+          vec3f star_pos = star_positions[i];
+          if (!collected[i]) {
+            // Stars behind the terrain are drawn dimmed
+            vec3f to_star = star_pos - cam_pos;
+            float star_dist = len(to_star);
+            RayHit blocker =
+                raycast_heightfield(&terrain, &terrain_pyramid, cam_pos,
+                                    (1 / star_dist) * to_star, star_dist);
+            vec3f star_color =
+                blocker.hit ? vec3f{0.3, 0.3, 0.0} : vec3f{0.8, 0.8, 0.0};
+            if (picked_id == pick_id(PickKind::Star, i)) {
+              star_color = vec3f{1, 1, 1};
+            }
+            draw_star(&debug_context, &transforms, star_nodes[i], star_color);
+
+            // Hero line of sight, from the top of the sphere
+            vec3f hero_eye = hero_pos + vec3f{0, hero.radius, 0};
+            vec3f to_hero = star_pos - hero_eye;
+            float hero_dist = len(to_hero);
+            RayHit hero_blocker =
+                raycast_heightfield(&terrain, &terrain_pyramid, hero_eye,
+                                    (1 / hero_dist) * to_hero, hero_dist);
+            if (debug_overlay && !hero_blocker.hit) {
+              draw_line(&debug_context, hero_eye, star_pos,
+                        vec3f{1, 0.5, 0.5});
+            }
+
+            draw_star(&debug_context, &transforms, shadow_nodes[i],
+                      vec3f{0, 0, 0});
           }
+        }
+      }
 
+      end_scope(&frame_timers, debug_scope);
+
+      // ID pass, the same terrain, hero and stars as above
+      if (gpu_picking) {
+        int id_scope = begin_scope(&frame_timers, "id pass");
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindFramebuffer(GL_FRAMEBUFFER, id_fbo);
+        glViewport(0, 0, screen_width, screen_height);
+        GLuint background[4] = {0, 0, 0, 0};
+        glClearBufferuiv(GL_COLOR, 0, background);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        switch_to_context(&cube_id_context);
+        GLuint prog = cube_id_context.shader_program;
+        glUniformMatrix4fv(glGetUniformLocation(prog, "terrain"), 1, GL_FALSE,
+                           scale_mat.elements);
+        glUniformMatrix4fv(glGetUniformLocation(prog, "view"), 1, GL_FALSE,
+                           view.elements);
+        glUniformMatrix4fv(glGetUniformLocation(prog, "proj"), 1, GL_FALSE,
+                           proj.elements);
+        glDrawElementsInstanced(GL_TRIANGLES, el_size, GL_UNSIGNED_INT, 0,
+                                terrain_width * terrain_width);
+
+        init_debug_draw(&debug_id_context, view, proj);
+        GLint uniId =
+            glGetUniformLocation(debug_id_context.shader_program, "id");
+        glUniform1ui(uniId, pick_id(PickKind::Hero, 0));
+        draw_star(&debug_id_context, &transforms, hero_node, vec3f{});
+        for (int i = 0; i < n_pts; ++i) {
           if (!collected[i]) {
-            vec3f star_color =
-                collected[i] ? vec3f{0.7, 0.7, 0.7} : vec3f{0.8, 0.8, 0.0};
-            draw_star(&debug_context, star_pos, 0.03, star_color);
-            star_pos.y = 0;
-            draw_star(&debug_context, star_pos, 0.1, vec3f{0, 0, 0});
+            glUniform1ui(uniId, pick_id(PickKind::Star, i));
+            draw_star(&debug_id_context, &transforms, star_nodes[i], vec3f{});
           }
         }
+
+        int px = (int)((mouse_x + 1) * 0.5 * screen_width);
+        int py = screen_height - 1 - (int)((mouse_y + 1) * 0.5 * screen_height);
+        if (0 <= px && px < screen_width && 0 <= py && py < screen_height) {
+          begin_readback(&pick_readback);
+          glReadPixels(px, py, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+          end_readback(&pick_readback);
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        end_scope(&frame_timers, id_scope);
       }
 
       // Draw terrain
+      int terrain_scope = begin_scope(&frame_timers, "terrain");
       switch_to_context(&cube_context);
-      for (int row = 0; row < terrain_width; ++row) {
-        for (int col = 0; col < terrain_width; ++col) {
-          float row_norm = (float)row / terrain_width;
-          float col_norm = (float)col / terrain_width;
-          float acc_val = terrain_vals[row * terrain_width + col];
-          mat4f trans = diagonal(w_pix, 2, w_pix, 1);
-          trans.elements[12] = row_norm - 0.5;
-          trans.elements[13] = acc_val - 1;
-          trans.elements[14] = col_norm - 0.5;
-
-          trans = scale_mat * trans;
-          glUniformMatrix4fv(uniTrans, 1, GL_FALSE, trans.elements);
-          glUniform1i(uniDebug, debug_overlay);
-
-          if (row == chosen_row && col == chosen_col) {
-            if (wave_state == WaveState::Add) {
-              waves[n_waves++] = Wave{.x = col_norm,
-                                      .y = row_norm,
-                                      .speed = 0,
-                                      .size = 0,
-                                      .time = 0};
-              wave_row = row;
-              wave_col = col;
-              wave_base_height = acc_val;
-            }
+      glUniformMatrix4fv(uniTerrain, 1, GL_FALSE, scale_mat.elements);
+      glUniform1i(uniDebug, debug_overlay);
+      glDrawElementsInstanced(GL_TRIANGLES, el_size, GL_UNSIGNED_INT, 0,
+                              terrain_width * terrain_width);
+
+      // The chunks in view, coarse until the workers are done with them
+      if (world_views != nullptr) {
+        float radius = fminf(3 * scale_f + 2 * scale, 60);
+        int n_views = update_chunks(&world, vec2f{cam_pos.x, cam_pos.z},
+                                    radius, world_views, world.n_slots);
+        glActiveTexture(GL_TEXTURE3);
+        glUniform1i(uniHeights, 3);
+        for (int i = 0; i < n_views; ++i) {
+          const ChunkView &chunk = world_views[i];
+          if (chunk.slot < 0) {
+            continue;
           }
-
-          glDrawElements(GL_TRIANGLES, el_size, GL_UNSIGNED_INT, 0);
+          int width = chunk.ready ? world.params.cells : chunk_coarse_cells;
+          GLuint *texture = &world_textures[chunk.slot];
+          if (*texture == 0) {
+            glGenTextures(1, texture);
+            glBindTexture(GL_TEXTURE_2D, *texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+                            GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+                            GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            world_versions[chunk.slot] = chunk.version - 1;
+          }
+          glBindTexture(GL_TEXTURE_2D, *texture);
+          if (world_versions[chunk.slot] != chunk.version) {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, width, 0, GL_RED,
+                         GL_FLOAT, chunk_heights(&world, chunk));
+            world_versions[chunk.slot] = chunk.version;
+          }
+          mat4f chunk_mat = diagonal(scale, 1.0F, scale, 1);
+          chunk_mat.elements[12] = chunk.cx * scale;
+          chunk_mat.elements[14] = chunk.cz * scale;
+          glUniformMatrix4fv(uniTerrain, 1, GL_FALSE, chunk_mat.elements);
+          glUniform1i(uniWidth, width);
+          glDrawElementsInstanced(GL_TRIANGLES, el_size, GL_UNSIGNED_INT, 0,
+                                  width * width);
         }
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(uniHeights, 1);
+        glUniform1i(uniWidth, terrain_width);
+      }
+
+      if (crowd.n > 0) {
+        switch_to_context(&crowd_context);
+        GLuint prog = crowd_context.shader_program;
+        glUniformMatrix4fv(glGetUniformLocation(prog, "view"), 1, GL_FALSE,
+                           view.elements);
+        glUniformMatrix4fv(glGetUniformLocation(prog, "proj"), 1, GL_FALSE,
+                           proj.elements);
+        glUniform1f(glGetUniformLocation(prog, "size"), crowd.params.radius);
+        glBindBuffer(GL_ARRAY_BUFFER, agents_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * crowd.capacity,
+                     crowd.positions, GL_STREAM_DRAW);
+        glDrawElementsInstanced(GL_TRIANGLES, el_size, GL_UNSIGNED_INT, 0,
+                                crowd.n);
+      }
+
+      if (wave_state == WaveState::Add && chosen_row >= 0) {
+        float row_norm = (float)chosen_row / terrain_width;
+        float col_norm = (float)chosen_col / terrain_width;
+        waves[n_waves++] = Wave{
+            .x = col_norm, .y = row_norm, .speed = 0, .size = 0, .time = 0};
+        wave_row = chosen_row;
+        wave_col = chosen_col;
+        wave_base_height =
+            terrain_vals[chosen_row * terrain_width + chosen_col];
       }
+
       if (wave_state == WaveState::Adding) {
         Wave *last = &waves[n_waves - 1];
         float row_norm = (float)wave_row / terrain_width;
@@ -897,32 +1885,105 @@ render(GLFWwindow *window) {
 
       if (wave_state == WaveState::DoneAdding) {
         float s = waves[n_waves - 1].size;
-        float speed = 5 * powf(fabs(s), 1.5);
+        float speed = 5 * math_pow(fabs(s), 1.5);
         if (s < 0) {
           speed *= -1;
         }
         waves[n_waves - 1].speed = speed;
         waves[n_waves - 1].time = 0;
+
+        // Splash, bigger for bigger waves
+        vec3f splash{((float)wave_row / terrain_width - 0.5F) * scale,
+                     wave_base_height,
+                     ((float)wave_col / terrain_width - 0.5F) * scale};
+        emit_particles(&particles, splash, vec3f{0, 1 + 3 * fabsf(s), 0},
+                       1.5F * fabsf(s) + 0.2F, 2.0F,
+                       (int)(200000 * fabsf(s)));
       }
 
+      end_scope(&frame_timers, terrain_scope);
+
+      int particles_scope = begin_scope(&frame_timers, "particles");
+      update_particles(&particles, &jobs, &terrain, time_delta);
+      if (particles.n_alive > 0) {
+        switch_to_context(&particle_context);
+        GLuint prog = particle_context.shader_program;
+        glUniformMatrix4fv(glGetUniformLocation(prog, "view"), 1, GL_FALSE,
+                           view.elements);
+        glUniformMatrix4fv(glGetUniformLocation(prog, "proj"), 1, GL_FALSE,
+                           proj.elements);
+        // Particles are about 1.5 cm across
+        glUniform1f(glGetUniformLocation(prog, "point_scale"),
+                    0.015F * 0.5F * screen_height * proj.elements[5]);
+
+        glBindBuffer(GL_ARRAY_BUFFER, particles_vbo);
+        float *instances = (float *)glMapBufferRange(
+            GL_ARRAY_BUFFER, 0, sizeof(float) * 4 * particles.capacity,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (instances == nullptr) {
+          fprintf(stderr, "Can't map the particle buffer\n");
+        } else {
+          int n = write_particle_instances(&particles, &jobs, instances);
+          glUnmapBuffer(GL_ARRAY_BUFFER);
+          glDrawArraysInstanced(GL_POINTS, 0, 1, n);
+        }
+      }
+      end_scope(&frame_timers, particles_scope);
+
       // Draw overlay texture
+      int overlay_scope = begin_scope(&frame_timers, "overlay");
       if (overlay_texture) {
         for (int i = 0; i < terrain_width * terrain_width; ++i) {
-          terrain_vals[i] += 0.5;
-          terrain_vals[i] /= 3;
+          overlay_vals[i] = (terrain_vals[i] + 0.5F) / 3;
         }
 
         glDisable(GL_DEPTH_TEST);
         switch_to_context(&overlay_context);
         glBindTexture(GL_TEXTURE_2D, overlay_texture);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, terrain_width, terrain_width, 0,
-                     GL_RED, GL_FLOAT, terrain_vals);
+                     GL_RED, GL_FLOAT, overlay_vals);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
       }
+      end_scope(&frame_timers, overlay_scope);
+
+      if (end_frame(&frame_timers, &frame_stats) && print_stats &&
+          frame_stats.frame % 60 == 0) {
+        frame_stats.input_latency_ms = frame_latency.latency_ms;
+        print(&frame_stats);
+      }
 
       glfwSwapBuffers(window);
-      glfwPollEvents();
+      fence_frame(&frame_latency);
     }
+
+    if (world_views != nullptr) {
+      free_chunk_cache(&world);
+      for (int i = 0; i < world.n_slots; ++i) {
+        if (world_textures[i] != 0) {
+          glDeleteTextures(1, &world_textures[i]);
+        }
+      }
+      free(world_views);
+      free(world_textures);
+      free(world_versions);
+    }
+
+    // The workers of the pool have to be joined before it goes out of scope
+    free_job_pool(&jobs);
+    free_transform_tree(&transforms);
+    free_spatial_hash(&star_hash);
+    free_height_pyramid(&terrain_pyramid);
+    free_particles(&particles);
+    free_crowd(&crowd);
+    free_flow_field(&crowd_flow);
+    free_distance_field(&star_field);
+    free_path_search(&path_search);
+    free_pass_grid(&pass_grid);
+    free(check_vals);
+    free(base_vals);
+    free(prev_terrain_vals);
+    free(overlay_vals);
+    free(terrain_vals);
   };
 }
 
@@ -959,11 +2020,51 @@ open_window(int width, int height) {
   return ptr;
 }
 
+Options
+parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-frames-in-flight") == 0 && i + 1 < argc) {
+      options.frames_in_flight = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-shader-cache") == 0 && i + 1 < argc) {
+      options.shader_cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "-compute") == 0) {
+      options.compute_terrain = true;
+    } else if (strcmp(argv[i], "-check-compute") == 0) {
+      options.compute_terrain = true;
+      options.check_compute = true;
+    } else if (strcmp(argv[i], "-agents") == 0 && i + 1 < argc) {
+      options.n_agents = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-particles") == 0 && i + 1 < argc) {
+      options.n_particles = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-base") == 0 && i + 1 < argc) {
+      options.base_path = argv[++i];
+    } else if (strcmp(argv[i], "-noise") == 0 && i + 1 < argc) {
+      options.noise_seed = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-erode") == 0 && i + 1 < argc) {
+      options.erode_seed = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-world") == 0 && i + 1 < argc) {
+      options.world_seed = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-world-budget") == 0 && i + 1 < argc) {
+      options.world_budget_mb = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      fprintf(stderr, "Usage: game [-frames-in-flight N] [-shader-cache DIR] "
+                      "[-compute] [-check-compute] [-agents N] "
+                      "[-particles N] [-base FILE] [-noise SEED] "
+                      "[-erode SEED] [-world SEED] [-world-budget MB]\n");
+      exit(1);
+    }
+  }
+  return options;
+}
+
 int
-main() {
+main(int argc, char **argv) {
 
+  Options options = parse_options(argc, argv);
   GLFWwindow *window = open_window(screen_width, screen_height);
-  render(window);
+  render(window, &options);
 
   glfwDestroyWindow(window);
   glfwTerminate();
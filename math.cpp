@@ -3,42 +3,64 @@
 #include <cmath>
 #include <cstdint>
 
-/*
-   To conform with OpenGL conventions, matrices are saved column first
-*/
-mat4f
-identity() {
-  mat4f res;
-  for (int8_t col = 0; col < 4; ++col) {
-    for (uint8_t row = 0; row < 4; ++row) {
-      if (col != row) {
-        res.elements[col * 4 + row] = 0;
-      } else {
-        res.elements[col * 4 + row] = 1;
-      }
-    }
-  }
-  return res;
+// SSE2 is part of x86-64, AVX is used when the compiler targets it.
+// MATH_SCALAR builds the plain loops everywhere.
+#if !defined(MATH_SCALAR) && (defined(__SSE2__) || defined(_M_X64))
+#define MATH_SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef MATH_SIMD
+// Lanes x, y, z, w of the result are these lanes of v
+template <int x, int y, int z, int w>
+static inline __m128
+swizzle(__m128 v) {
+  return _mm_shuffle_ps(v, v, _MM_SHUFFLE(w, z, y, x));
 }
 
-mat4f
-diagonal(float a, float b, float c, float d) {
-  const float diag[4] = {a, b, c, d};
-  mat4f res;
-  uint8_t diag_idx = 0;
-  for (uint8_t col = 0; col < 4; ++col) {
-    for (uint8_t row = 0; row < 4; ++row) {
-      if (col != row) {
-        res.elements[col * 4 + row] = 0;
-      } else {
-        res.elements[col * 4 + row] = diag[diag_idx++];
-      }
-    }
-  }
+// Lanes x, y of the result from a, z, w from b
+template <int x, int y, int z, int w>
+static inline __m128
+shuffle(__m128 a, __m128 b) {
+  return _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x));
+}
 
-  return res;
+// The columns of m weighted by the lanes of v
+static inline __m128
+combine_cols(const mat4f &m, __m128 v) {
+  const float *me = m.elements;
+  __m128 r0 = _mm_mul_ps(_mm_load_ps(me), swizzle<0, 0, 0, 0>(v));
+  __m128 r1 = _mm_mul_ps(_mm_load_ps(me + 4), swizzle<1, 1, 1, 1>(v));
+  __m128 r2 = _mm_mul_ps(_mm_load_ps(me + 8), swizzle<2, 2, 2, 2>(v));
+  __m128 r3 = _mm_mul_ps(_mm_load_ps(me + 12), swizzle<3, 3, 3, 3>(v));
+  return _mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3));
+}
+
+// 2x2 matrices as one register each, for the block inverse
+static inline __m128
+mul2(__m128 a, __m128 b) {
+  return _mm_add_ps(
+      _mm_mul_ps(a, swizzle<0, 3, 0, 3>(b)),
+      _mm_mul_ps(swizzle<1, 0, 3, 2>(a), swizzle<2, 1, 2, 1>(b)));
 }
 
+// adj(a) * b
+static inline __m128
+adj_mul2(__m128 a, __m128 b) {
+  return _mm_sub_ps(
+      _mm_mul_ps(swizzle<3, 3, 0, 0>(a), b),
+      _mm_mul_ps(swizzle<1, 1, 2, 2>(a), swizzle<2, 3, 0, 1>(b)));
+}
+
+// a * adj(b)
+static inline __m128
+mul_adj2(__m128 a, __m128 b) {
+  return _mm_sub_ps(
+      _mm_mul_ps(a, swizzle<3, 0, 3, 0>(b)),
+      _mm_mul_ps(swizzle<1, 0, 3, 2>(a), swizzle<2, 1, 2, 1>(b)));
+}
+#endif
+
 void
 print(mat4f m) {
   for (uint8_t row = 0; row < 4; ++row) {
@@ -50,17 +72,6 @@ print(mat4f m) {
   }
 }
 
-float
-len(vec3f v) {
-  return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
-}
-
-vec3f
-normalized(vec3f v) {
-  float v_len = len(v);
-  return vec3f{v.x / v_len, v.y / v_len, v.z / v_len};
-}
-
 mat4f
 rotation(vec3f u, float theta) {
   u = normalized(u);
@@ -80,42 +91,30 @@ rotation(vec3f u, float theta) {
   // clang-format on
 }
 
-vec3f
-operator-(vec3f v1, vec3f v2) {
-  return vec3f{v1.x - v2.x, v1.y - v2.y, v1.z - v2.z};
-}
-
-vec3f
-operator+(vec3f v1, vec3f v2) {
-  return vec3f{v1.x + v2.x, v1.y + v2.y, v1.z + v2.z};
-}
-
-vec3f
-operator-(vec3f v) {
-  return vec3f{-v.x, -v.y, -v.z};
-}
-
-vec3f
-operator*(float scalar, vec3f v) {
-  return vec3f{scalar * v.x, scalar * v.y, scalar * v.z};
-}
-
-float
-dot(vec3f u, vec3f v) {
-  return u.x * v.x + u.y * v.y + u.z * v.z;
-}
-
-// vx vy vz
-// ux uy uz
-vec3f
-cross(vec3f v, vec3f u) {
-  return vec3f{v.y * u.z - v.z * u.y, v.z * u.x - v.x * u.z,
-               v.x * u.y - v.y * u.x};
-}
-
 mat4f
 operator*(const mat4f &m1, const mat4f &m2) {
   mat4f res;
+#if defined(MATH_SIMD) && defined(__AVX__)
+  // Two columns of the result at a time, the columns of m1 in both halves
+  const float *a = m1.elements;
+  __m256 a0 = _mm256_broadcast_ps((const __m128 *)a);
+  __m256 a1 = _mm256_broadcast_ps((const __m128 *)(a + 4));
+  __m256 a2 = _mm256_broadcast_ps((const __m128 *)(a + 8));
+  __m256 a3 = _mm256_broadcast_ps((const __m128 *)(a + 12));
+  for (int col = 0; col < 4; col += 2) {
+    __m256 b = _mm256_loadu_ps(m2.elements + col * 4);
+    __m256 r = _mm256_mul_ps(a0, _mm256_permute_ps(b, 0x00));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_permute_ps(b, 0x55)));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_permute_ps(b, 0xaa)));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_permute_ps(b, 0xff)));
+    _mm256_storeu_ps(res.elements + col * 4, r);
+  }
+#elif defined(MATH_SIMD)
+  for (int col = 0; col < 4; ++col) {
+    _mm_store_ps(res.elements + col * 4,
+                 combine_cols(m1, _mm_load_ps(m2.elements + col * 4)));
+  }
+#else
   for (uint8_t res_col = 0; res_col < 4; ++res_col) {
     for (uint8_t res_row = 0; res_row < 4; ++res_row) {
       float *pos = &res.elements[res_col * 4 + res_row];
@@ -125,6 +124,7 @@ operator*(const mat4f &m1, const mat4f &m2) {
       }
     }
   }
+#endif
   return res;
 }
 
@@ -163,57 +163,181 @@ perspective(float fov, float aspect, float near, float far) {
   // clang-format on
 }
 
-mat4f
-streach_from_to(vec3f p1, vec3f p2, float thikness) {
-  vec3f new_y = p2 - p1;
-  float new_len = len(new_y);
-  vec3f new_x = cross(normalized(new_y), vec3f{0, 1, 0});
-  vec3f new_z = cross(new_x, new_y);
-  new_y = cross(new_z, new_x);
-
-  if (len(new_x) < 0.001) {
-    new_x = vec3f{1, 0, 0};
-    new_y = vec3f{0, 1, 0};
-    new_z = vec3f{0, 0, 1};
-  } else {
-    new_y = normalized(new_y);
-    new_x = normalized(new_x);
-    new_z = normalized(new_z);
-  }
+// Row row of m times (x, y, z, 1)
+static inline float
+row_dot(const float *me, int row, float x, float y, float z) {
+  return me[0 * 4 + row] * x + me[1 * 4 + row] * y + me[2 * 4 + row] * z +
+         me[3 * 4 + row];
+}
 
-  // clang-format off
-  mat4f rot = mat4f{{
-	  new_x.x, new_x.y, new_x.z, 0.0,
-	  new_y.x, new_y.y, new_y.z, 0.0,
-	  new_z.x, new_z.y, new_z.z, 0.0,
-	  0.0    , 0.0    , 0.0    , 1.0
-  }};
-  // clang-format on
+#ifdef MATH_SIMD
+#ifdef __AVX__
+static inline __m256
+row_dot8(const float *me, int row, __m256 x, __m256 y, __m256 z) {
+  __m256 r = _mm256_mul_ps(_mm256_set1_ps(me[0 * 4 + row]), x);
+  r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(me[1 * 4 + row]), y));
+  r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(me[2 * 4 + row]), z));
+  return _mm256_add_ps(r, _mm256_set1_ps(me[3 * 4 + row]));
+}
+#endif
+
+static inline __m128
+row_dot4(const float *me, int row, __m128 x, __m128 y, __m128 z) {
+  __m128 r = _mm_mul_ps(_mm_set1_ps(me[0 * 4 + row]), x);
+  r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(me[1 * 4 + row]), y));
+  r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(me[2 * 4 + row]), z));
+  return _mm_add_ps(r, _mm_set1_ps(me[3 * 4 + row]));
+}
+#endif
 
-  vec3f middle = p1 + 0.5 * (p2 - p1);
-  mat4f trans = diagonal(1.0, 1.0, 1.0, 1.0);
-  trans.elements[12] = middle.x;
-  trans.elements[13] = middle.y;
-  trans.elements[14] = middle.z;
+// 8 points at a time with AVX, 4 with SSE2. All lanes are loaded before
+// any is stored so the outputs may be the inputs.
+void
+transform_points(const mat4f &m, const float *xs, const float *ys,
+                 const float *zs, float *out_xs, float *out_ys, float *out_zs,
+                 size_t n) {
+  const float *me = m.elements;
+  size_t i = 0;
+#if defined(MATH_SIMD) && defined(__AVX__)
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(xs + i);
+    __m256 y = _mm256_loadu_ps(ys + i);
+    __m256 z = _mm256_loadu_ps(zs + i);
+    __m256 w = row_dot8(me, 3, x, y, z);
+    _mm256_storeu_ps(out_xs + i, _mm256_div_ps(row_dot8(me, 0, x, y, z), w));
+    _mm256_storeu_ps(out_ys + i, _mm256_div_ps(row_dot8(me, 1, x, y, z), w));
+    _mm256_storeu_ps(out_zs + i, _mm256_div_ps(row_dot8(me, 2, x, y, z), w));
+  }
+#elif defined(MATH_SIMD)
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(xs + i);
+    __m128 y = _mm_loadu_ps(ys + i);
+    __m128 z = _mm_loadu_ps(zs + i);
+    __m128 w = row_dot4(me, 3, x, y, z);
+    _mm_storeu_ps(out_xs + i, _mm_div_ps(row_dot4(me, 0, x, y, z), w));
+    _mm_storeu_ps(out_ys + i, _mm_div_ps(row_dot4(me, 1, x, y, z), w));
+    _mm_storeu_ps(out_zs + i, _mm_div_ps(row_dot4(me, 2, x, y, z), w));
+  }
+#endif
+  for (; i < n; ++i) {
+    float x = xs[i];
+    float y = ys[i];
+    float z = zs[i];
+    float w = row_dot(me, 3, x, y, z);
+    out_xs[i] = row_dot(me, 0, x, y, z) / w;
+    out_ys[i] = row_dot(me, 1, x, y, z) / w;
+    out_zs[i] = row_dot(me, 2, x, y, z) / w;
+  }
+}
 
-  return trans * rot * diagonal(thikness, new_len, thikness, 1.0);
+void
+transform_points_affine(const mat4f &m, const float *xs, const float *ys,
+                        const float *zs, float *out_xs, float *out_ys,
+                        float *out_zs, size_t n) {
+  const float *me = m.elements;
+  size_t i = 0;
+#if defined(MATH_SIMD) && defined(__AVX__)
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(xs + i);
+    __m256 y = _mm256_loadu_ps(ys + i);
+    __m256 z = _mm256_loadu_ps(zs + i);
+    _mm256_storeu_ps(out_xs + i, row_dot8(me, 0, x, y, z));
+    _mm256_storeu_ps(out_ys + i, row_dot8(me, 1, x, y, z));
+    _mm256_storeu_ps(out_zs + i, row_dot8(me, 2, x, y, z));
+  }
+#elif defined(MATH_SIMD)
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(xs + i);
+    __m128 y = _mm_loadu_ps(ys + i);
+    __m128 z = _mm_loadu_ps(zs + i);
+    _mm_storeu_ps(out_xs + i, row_dot4(me, 0, x, y, z));
+    _mm_storeu_ps(out_ys + i, row_dot4(me, 1, x, y, z));
+    _mm_storeu_ps(out_zs + i, row_dot4(me, 2, x, y, z));
+  }
+#endif
+  for (; i < n; ++i) {
+    float x = xs[i];
+    float y = ys[i];
+    float z = zs[i];
+    out_xs[i] = row_dot(me, 0, x, y, z);
+    out_ys[i] = row_dot(me, 1, x, y, z);
+    out_zs[i] = row_dot(me, 2, x, y, z);
+  }
 }
 
-vec3f
-operator*(const mat4f &m, const vec3f &v) {
+vec4f
+operator*(const mat4f &m, const vec4f &v) {
+  vec4f res;
+#ifdef MATH_SIMD
+  _mm_store_ps(&res.x, combine_cols(m, _mm_load_ps(&v.x)));
+#else
   const float *me = m.elements;
-  float div = me[0 * 4 + 3] + me[1 * 4 + 3] + me[2 * 4 + 3] + me[3 * 4 + 3];
-
-  vec3f res{me[0 * 4 + 0] * v.x + me[1 * 4 + 0] * v.y + me[2 * 4 + 0] * v.z +
-                me[3 * 4 + 0],
-            me[0 * 4 + 1] * v.x + me[1 * 4 + 1] * v.y + me[2 * 4 + 1] * v.z +
-                me[3 * 4 + 1],
-            me[0 * 4 + 2] * v.x + me[1 * 4 + 2] * v.y + me[2 * 4 + 2] * v.z +
-                me[3 * 4 + 2]};
-  res = (1.0F / div) * res;
+  float in[4] = {v.x, v.y, v.z, v.w};
+  float out[4];
+  for (int row = 0; row < 4; ++row) {
+    out[row] = me[0 * 4 + row] * in[0] + me[1 * 4 + row] * in[1] +
+               me[2 * 4 + row] * in[2] + me[3 * 4 + row] * in[3];
+  }
+  res = vec4f{out[0], out[1], out[2], out[3]};
+#endif
   return res;
 }
 
+#ifdef MATH_SIMD
+// Inverse by 2x2 blocks, the columns pair up as [A B; C D]. Inverting the
+// transpose gives the transposed inverse, so the layout doesn't matter.
+mat4f
+inverse(mat4f mat) {
+  const float *m = mat.elements;
+  __m128 c0 = _mm_load_ps(m);
+  __m128 c1 = _mm_load_ps(m + 4);
+  __m128 c2 = _mm_load_ps(m + 8);
+  __m128 c3 = _mm_load_ps(m + 12);
+
+  __m128 a = _mm_movelh_ps(c0, c1);
+  __m128 b = _mm_movehl_ps(c1, c0);
+  __m128 c = _mm_movelh_ps(c2, c3);
+  __m128 d = _mm_movehl_ps(c3, c2);
+
+  // |A| |B| |C| |D|
+  __m128 det_sub = _mm_sub_ps(
+      _mm_mul_ps(shuffle<0, 2, 0, 2>(c0, c2), shuffle<1, 3, 1, 3>(c1, c3)),
+      _mm_mul_ps(shuffle<1, 3, 1, 3>(c0, c2), shuffle<0, 2, 0, 2>(c1, c3)));
+  __m128 det_a = swizzle<0, 0, 0, 0>(det_sub);
+  __m128 det_b = swizzle<1, 1, 1, 1>(det_sub);
+  __m128 det_c = swizzle<2, 2, 2, 2>(det_sub);
+  __m128 det_d = swizzle<3, 3, 3, 3>(det_sub);
+
+  // The inverse is [X Y; Z W] / |M|, computed as adjugates
+  __m128 d_c = adj_mul2(d, c);
+  __m128 a_b = adj_mul2(a, b);
+  __m128 x = _mm_sub_ps(_mm_mul_ps(det_d, a), mul2(b, d_c));
+  __m128 w = _mm_sub_ps(_mm_mul_ps(det_a, d), mul2(c, a_b));
+  __m128 y = _mm_sub_ps(_mm_mul_ps(det_b, c), mul_adj2(d, a_b));
+  __m128 z = _mm_sub_ps(_mm_mul_ps(det_c, b), mul_adj2(a, d_c));
+
+  // |M| = |A||D| + |B||C| - tr(adj(A) B adj(D) C)
+  __m128 tr = _mm_mul_ps(a_b, swizzle<0, 2, 1, 3>(d_c));
+  tr = _mm_add_ps(tr, swizzle<2, 3, 0, 1>(tr));
+  tr = _mm_add_ps(tr, swizzle<1, 0, 3, 2>(tr));
+  __m128 det = _mm_add_ps(_mm_mul_ps(det_a, det_d), _mm_mul_ps(det_b, det_c));
+  det = _mm_sub_ps(det, tr);
+
+  // The signs of the adjugates
+  __m128 inv_det = _mm_div_ps(_mm_setr_ps(1, -1, -1, 1), det);
+  x = _mm_mul_ps(x, inv_det);
+  y = _mm_mul_ps(y, inv_det);
+  z = _mm_mul_ps(z, inv_det);
+  w = _mm_mul_ps(w, inv_det);
+
+  mat4f inv;
+  _mm_store_ps(inv.elements, shuffle<3, 1, 3, 1>(x, y));
+  _mm_store_ps(inv.elements + 4, shuffle<2, 0, 2, 0>(x, y));
+  _mm_store_ps(inv.elements + 8, shuffle<3, 1, 3, 1>(z, w));
+  _mm_store_ps(inv.elements + 12, shuffle<2, 0, 2, 0>(z, w));
+  return inv;
+}
+#else
 mat4f
 inverse(mat4f mat) {
   mat4f inv;
@@ -299,10 +423,22 @@ inverse(mat4f mat) {
 
   return inv;
 }
+#endif
 
 void
 transpose(mat4f *mat) {
   float *m = mat->elements;
+#ifdef MATH_SIMD
+  __m128 c0 = _mm_load_ps(m);
+  __m128 c1 = _mm_load_ps(m + 4);
+  __m128 c2 = _mm_load_ps(m + 8);
+  __m128 c3 = _mm_load_ps(m + 12);
+  _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+  _mm_store_ps(m, c0);
+  _mm_store_ps(m + 4, c1);
+  _mm_store_ps(m + 8, c2);
+  _mm_store_ps(m + 12, c3);
+#else
   for (int col = 0; col < 4; ++col) {
     for (int row = 0; row < col; ++row) {
       float tmp = m[col * 4 + row];
@@ -310,27 +446,126 @@ transpose(mat4f *mat) {
       m[row * 4 + col] = tmp;
     }
   }
+#endif
 }
 
-mat4f
-copy(mat4f *m) {
-  mat4f res;
-  for (int i = 0; i < 16; ++i) {
-    res.elements[i] = m->elements[i];
-  }
+affine3f
+inverse_orthogonal(const affine3f &a) {
+#ifdef MATH_SIMD
+  // The columns go in as rows, the 4th lane of the first two is the next
+  // column's x and the last load stops at t
+  const float *f = &a.cols[0].x;
+  __m128 x = _mm_loadu_ps(f);
+  __m128 y = _mm_loadu_ps(f + 3);
+  __m128 z = _mm_loadu_ps(f + 6);
+  __m128 w = _mm_setzero_ps();
+  _MM_TRANSPOSE4_PS(x, y, z, w);
+  // The three squared lengths with one division
+  __m128 sq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                         _mm_mul_ps(z, z));
+  __m128 inv = _mm_div_ps(_mm_set1_ps(1), sq);
+  x = _mm_mul_ps(x, inv);
+  y = _mm_mul_ps(y, inv);
+  z = _mm_mul_ps(z, inv);
+  __m128 t = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(a.t.x)),
+                 _mm_mul_ps(y, _mm_set1_ps(a.t.y))),
+      _mm_mul_ps(z, _mm_set1_ps(a.t.z)));
+  alignas(16) float out[16];
+  _mm_store_ps(out, x);
+  _mm_store_ps(out + 4, y);
+  _mm_store_ps(out + 8, z);
+  _mm_store_ps(out + 12, _mm_sub_ps(_mm_setzero_ps(), t));
+  return affine3f{{vec3f{out[0], out[1], out[2]},
+                   vec3f{out[4], out[5], out[6]},
+                   vec3f{out[8], out[9], out[10]}},
+                  vec3f{out[12], out[13], out[14]}};
+#else
+  const vec3f *c = a.cols;
+  vec3f r0 = (1.0F / dot(c[0], c[0])) * c[0];
+  vec3f r1 = (1.0F / dot(c[1], c[1])) * c[1];
+  vec3f r2 = (1.0F / dot(c[2], c[2])) * c[2];
+  return affine3f{{vec3f{r0.x, r1.x, r2.x}, vec3f{r0.y, r1.y, r2.y},
+                   vec3f{r0.z, r1.z, r2.z}},
+                  vec3f{-dot(r0, a.t), -dot(r1, a.t), -dot(r2, a.t)}};
+#endif
+}
 
-  return res;
+// The camera axes are the rows of the rotation, the steps in world per unit
+// of ndc on the plane one unit in front of the camera
+static void
+camera_steps(const affine3f &view, float fov, float aspect, vec3f *step_x,
+             vec3f *step_y, vec3f *forward) {
+  const vec3f *c = view.cols;
+  float tan_half = tanf(fov / 2.0F);
+  *step_x = (aspect * tan_half) * vec3f{c[0].x, c[1].x, c[2].x};
+  *step_y = tan_half * vec3f{c[0].y, c[1].y, c[2].y};
+  *forward = -vec3f{c[0].z, c[1].z, c[2].z};
 }
 
-float
-clamp(float x, float min_v, float max_v) {
-  if (x > max_v) {
-    return max_v;
-  }
+vec3f
+camera_ray(const affine3f &view, float fov, float aspect, vec2f ndc) {
+  vec3f step_x;
+  vec3f step_y;
+  vec3f forward;
+  camera_steps(view, fov, aspect, &step_x, &step_y, &forward);
+  return normalized(ndc.x * step_x + ndc.y * step_y + forward);
+}
 
-  if (x < min_v) {
-    return min_v;
+void
+camera_rays(const affine3f &view, float fov, float aspect,
+            const float *ndc_xs, const float *ndc_ys, float *dir_xs,
+            float *dir_ys, float *dir_zs, size_t n) {
+  vec3f step_x;
+  vec3f step_y;
+  vec3f forward;
+  camera_steps(view, fov, aspect, &step_x, &step_y, &forward);
+  // Two multiply-adds per component
+  for (size_t i = 0; i < n; ++i) {
+    float x = ndc_xs[i];
+    float y = ndc_ys[i];
+    dir_xs[i] = x * step_x.x + y * step_y.x + forward.x;
+    dir_ys[i] = x * step_x.y + y * step_y.y + forward.y;
+    dir_zs[i] = x * step_x.z + y * step_y.z + forward.z;
   }
+}
 
-  return x;
+// Compile-time checks of the functions in math.hpp
+static constexpr bool
+same(vec3f u, vec3f v) {
+  return u.x == v.x && u.y == v.y && u.z == v.z;
 }
+
+static_assert(same(vec3f{1, 2, 3} + vec3f{4, 5, 6}, vec3f{5, 7, 9}));
+static_assert(same(vec3f{1, 2, 3} - vec3f{4, 5, 6}, vec3f{-3, -3, -3}));
+static_assert(same(-vec3f{1, -2, 3}, vec3f{-1, 2, -3}));
+static_assert(same(2.0F * vec3f{1, 2, 3}, vec3f{2, 4, 6}));
+static_assert(dot(vec3f{1, 2, 3}, vec3f{4, 5, 6}) == 32);
+static_assert(same(cross(vec3f{1, 0, 0}, vec3f{0, 1, 0}), vec3f{0, 0, 1}));
+static_assert(dot(cross(vec3f{1, 2, 3}, vec3f{-2, 1, 5}), vec3f{1, 2, 3}) ==
+              0);
+static_assert(clamp(2, 0, 1) == 1 && clamp(-1, 0, 1) == 0 &&
+              clamp(0.5F, 0, 1) == 0.5F);
+
+static_assert(identity().elements[0] == 1 && identity().elements[1] == 0 &&
+              identity().elements[4] == 0 && identity().elements[15] == 1);
+static_assert(same(diagonal(2, 3, 4, 1) * vec3f{1, 1, 1}, vec3f{2, 3, 4}));
+// w is the last row dotted with (x, y, z, 1)
+static_assert(same(diagonal(1, 1, 1, 2) * vec3f{2, 4, 6}, vec3f{1, 2, 3}));
+static_assert(same(to_mat4(affine3f{{vec3f{1, 0, 0}, vec3f{0, 1, 0},
+                                     vec3f{0, 0, 1}},
+                                    vec3f{1, 2, 3}}) *
+                       vec3f{1, 1, 1},
+                   vec3f{2, 3, 4}));
+
+// A quarter turn about y, doubled along z, then moved
+constexpr affine3f turn{{vec3f{0, 0, -1}, vec3f{0, 1, 0}, vec3f{2, 0, 0}},
+                        vec3f{1, 2, 3}};
+constexpr affine3f shift{{vec3f{1, 0, 0}, vec3f{0, 1, 0}, vec3f{0, 0, 1}},
+                         vec3f{-4, 0, 0.5F}};
+constexpr vec3f point{0.5F, -1, 2};
+static_assert(same(turn * point, vec3f{5, 1, 2.5F}));
+static_assert(same(inverse(turn) * (turn * point), point));
+static_assert(same((turn * shift) * point, turn * (shift * point)));
+static_assert(same(to_mat4(turn) * point, turn * point));
+static_assert(same(to_affine(to_mat4(turn)) * point, turn * point));
@@ -1,10 +1,14 @@
 #pragma once
 
-struct mat4f {
+#include <cmath>
+#include <cstddef>
+
+// Columns are loaded as whole SIMD registers
+struct alignas(16) mat4f {
   float elements[16];
 };
 
-struct vec4f {
+struct alignas(16) vec4f {
   float x;
   float y;
   float z;
@@ -22,12 +26,174 @@ struct vec2f {
   float y;
 };
 
+// A linear map by columns then a translation, a mat4f whose last row is
+// 0 0 0 1
+struct affine3f {
+  vec3f cols[3];
+  vec3f t;
+};
 
-mat4f
-identity();
 
-mat4f
-diagonal(float a, float b, float c, float d);
+/*
+   The small functions are defined here so they inline into the loops that
+   use them, the rest are in math.cpp. To conform with OpenGL conventions,
+   matrices are saved column first.
+*/
+
+constexpr float pi = 3.14159265358979323846F;
+constexpr float deg2rad = pi / 180.0F;
+constexpr float rad2deg = 180.0F / pi;
+
+constexpr mat4f
+diagonal(float a, float b, float c, float d) {
+  // clang-format off
+  return mat4f{{
+    a   , 0.0F, 0.0F, 0.0F,
+    0.0F, b   , 0.0F, 0.0F,
+    0.0F, 0.0F, c   , 0.0F,
+    0.0F, 0.0F, 0.0F, d
+  }};
+  // clang-format on
+}
+
+constexpr mat4f
+identity() {
+  return diagonal(1.0F, 1.0F, 1.0F, 1.0F);
+}
+
+constexpr mat4f
+copy(mat4f *m) {
+  return *m;
+}
+
+constexpr vec3f
+operator-(vec3f v1, vec3f v2) {
+  return vec3f{v1.x - v2.x, v1.y - v2.y, v1.z - v2.z};
+}
+
+constexpr vec3f
+operator+(vec3f v1, vec3f v2) {
+  return vec3f{v1.x + v2.x, v1.y + v2.y, v1.z + v2.z};
+}
+
+constexpr vec3f
+operator-(vec3f v) {
+  return vec3f{-v.x, -v.y, -v.z};
+}
+
+constexpr vec3f
+operator*(float scalar, vec3f v) {
+  return vec3f{scalar * v.x, scalar * v.y, scalar * v.z};
+}
+
+constexpr float
+dot(vec3f u, vec3f v) {
+  return u.x * v.x + u.y * v.y + u.z * v.z;
+}
+
+// vx vy vz
+// ux uy uz
+constexpr vec3f
+cross(vec3f v, vec3f u) {
+  return vec3f{v.y * u.z - v.z * u.y, v.z * u.x - v.x * u.z,
+               v.x * u.y - v.y * u.x};
+}
+
+inline float
+len(vec3f v) {
+  return sqrtf(dot(v, v));
+}
+
+inline vec3f
+normalized(vec3f v) {
+  float v_len = len(v);
+  return vec3f{v.x / v_len, v.y / v_len, v.z / v_len};
+}
+
+constexpr float
+clamp(float x, float min_v, float max_v) {
+  if (x > max_v) {
+    return max_v;
+  }
+
+  if (x < min_v) {
+    return min_v;
+  }
+
+  return x;
+}
+
+// m times (v, 1), divided by w
+constexpr vec3f
+operator*(const mat4f &m, const vec3f &v) {
+  const float *me = m.elements;
+  float x = me[0 * 4 + 0] * v.x + me[1 * 4 + 0] * v.y + me[2 * 4 + 0] * v.z +
+            me[3 * 4 + 0];
+  float y = me[0 * 4 + 1] * v.x + me[1 * 4 + 1] * v.y + me[2 * 4 + 1] * v.z +
+            me[3 * 4 + 1];
+  float z = me[0 * 4 + 2] * v.x + me[1 * 4 + 2] * v.y + me[2 * 4 + 2] * v.z +
+            me[3 * 4 + 2];
+  float w = me[0 * 4 + 3] * v.x + me[1 * 4 + 3] * v.y + me[2 * 4 + 3] * v.z +
+            me[3 * 4 + 3];
+  return vec3f{x / w, y / w, z / w};
+}
+
+// Drops the last row of m
+constexpr affine3f
+to_affine(const mat4f &m) {
+  const float *me = m.elements;
+  return affine3f{{vec3f{me[0], me[1], me[2]}, vec3f{me[4], me[5], me[6]},
+                   vec3f{me[8], me[9], me[10]}},
+                  vec3f{me[12], me[13], me[14]}};
+}
+
+constexpr mat4f
+to_mat4(const affine3f &a) {
+  const vec3f *c = a.cols;
+  // clang-format off
+  return mat4f{{
+    c[0].x, c[0].y, c[0].z, 0.0F,
+    c[1].x, c[1].y, c[1].z, 0.0F,
+    c[2].x, c[2].y, c[2].z, 0.0F,
+    a.t.x , a.t.y , a.t.z , 1.0F
+  }};
+  // clang-format on
+}
+
+// The linear part of a times v
+constexpr vec3f
+apply_linear(const affine3f &a, vec3f v) {
+  return v.x * a.cols[0] + v.y * a.cols[1] + v.z * a.cols[2];
+}
+
+// a after b
+constexpr affine3f
+operator*(const affine3f &a, const affine3f &b) {
+  return affine3f{{apply_linear(a, b.cols[0]), apply_linear(a, b.cols[1]),
+                   apply_linear(a, b.cols[2])},
+                  apply_linear(a, b.t) + a.t};
+}
+
+constexpr vec3f
+operator*(const affine3f &a, vec3f p) {
+  return apply_linear(a, p) + a.t;
+}
+
+constexpr affine3f
+inverse(const affine3f &a) {
+  const vec3f *c = a.cols;
+  // The rows of the inverse of the linear part
+  vec3f r0 = cross(c[1], c[2]);
+  vec3f r1 = cross(c[2], c[0]);
+  vec3f r2 = cross(c[0], c[1]);
+  float inv_det = 1.0F / dot(c[0], r0);
+  r0 = inv_det * r0;
+  r1 = inv_det * r1;
+  r2 = inv_det * r2;
+  return affine3f{{vec3f{r0.x, r1.x, r2.x}, vec3f{r0.y, r1.y, r2.y},
+                   vec3f{r0.z, r1.z, r2.z}},
+                  vec3f{-dot(r0, a.t), -dot(r1, a.t), -dot(r2, a.t)}};
+}
 
 void
 print(mat4f m);
@@ -38,12 +204,21 @@ rotation(vec3f u, float theta);
 mat4f
 operator*(const mat4f &m1, const mat4f &m2);
 
-vec3f
-operator*(const mat4f &m, const vec3f &v);
+vec4f
+operator*(const mat4f &m, const vec4f &v);
 
-constexpr float pi = 3.14159265358979323846F;
-constexpr float deg2rad = pi / 180.0F;
-constexpr float rad2deg = 180.0F / pi;
+// Transforms the n points (xs[i], ys[i], zs[i], 1) by m and divides by w.
+// The outputs may be the inputs.
+void
+transform_points(const mat4f &m, const float *xs, const float *ys,
+                 const float *zs, float *out_xs, float *out_ys, float *out_zs,
+                 size_t n);
+
+// The same for m whose last row is 0 0 0 1, without the division
+void
+transform_points_affine(const mat4f &m, const float *xs, const float *ys,
+                        const float *zs, float *out_xs, float *out_ys,
+                        float *out_zs, size_t n);
 
 mat4f
 look_at(vec3f eye, vec3f center, vec3f up);
@@ -51,40 +226,25 @@ look_at(vec3f eye, vec3f center, vec3f up);
 mat4f
 perspective(float fov, float aspect, float near, float far);
 
-mat4f
-streach_from_to(vec3f p1, vec3f p2, float thikness);
-
 mat4f
 inverse(mat4f mat);
 
-vec3f
-operator-(vec3f v1, vec3f v2);
-
-vec3f
-operator+(vec3f v1, vec3f v2);
-
-vec3f
-operator*(float scalar, vec3f v);
-
-vec3f
-normalized(vec3f v);
+// The inverse of an a whose columns are orthogonal, a rotation with a scale
+// along each axis like a camera or a Transform. The linear part inverts to
+// its transpose with each row over its squared length, no determinant.
+affine3f
+inverse_orthogonal(const affine3f &a);
 
 void transpose(mat4f *mat);
 
-mat4f
-copy(mat4f *m);
-
-vec3f
-cross(vec3f v, vec3f u);
-
-float
-len(vec3f v);
-
-float
-dot(vec3f u, vec3f v);
-
+// World direction through ndc for a view made of a rotation and a
+// translation, as look_at makes, and a perspective of vertical fov
 vec3f
-operator-(vec3f v);
+camera_ray(const affine3f &view, float fov, float aspect, vec2f ndc);
 
-float
-clamp(float x, float min_v, float max_v);
+// Directions through n ndc positions, not normalized: each reaches the
+// plane one unit in front of the camera
+void
+camera_rays(const affine3f &view, float fov, float aspect,
+            const float *ndc_xs, const float *ndc_ys, float *dir_xs,
+            float *dir_ys, float *dir_zs, size_t n);
@@ -0,0 +1,563 @@
+#include "bench.hpp"
+#include "fast_math.hpp"
+#include "math.hpp"
+#include "transforms.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+/*
+   Times the functions of math.hpp and fast_math.hpp per operation, then
+   checks the SIMD matrix functions against scalar references and the errors
+   of the approximations against the bounds documented in fast_math.hpp.
+   Exits with 1 when a check fails. Usage:
+
+     math_bench [-json FILE] [-commit LABEL] [-samples N] [-cpu N]
+*/
+
+#if defined(MATH_SCALAR)
+constexpr const char *simd_variant = "scalar";
+#elif defined(__AVX__)
+constexpr const char *simd_variant = "avx";
+#elif defined(__SSE2__) || defined(_M_X64)
+constexpr const char *simd_variant = "sse2";
+#else
+constexpr const char *simd_variant = "scalar";
+#endif
+
+// Inputs per call, small enough to stay in the L1 cache
+constexpr int n_mats = 64;
+constexpr int n_points = 1024;
+
+float
+rand_float(float min_v, float max_v) {
+  return min_v + (max_v - min_v) * ((float)rand() / (float)RAND_MAX);
+}
+
+vec3f
+rand_vec(float min_v, float max_v) {
+  return vec3f{rand_float(min_v, max_v), rand_float(min_v, max_v),
+               rand_float(min_v, max_v)};
+}
+
+// Out of line copies of the math.hpp functions, every vector operation in
+// render was a call like these when they were defined in math.cpp
+[[gnu::noinline]] static vec3f
+called_add(vec3f v1, vec3f v2) {
+  return v1 + v2;
+}
+
+[[gnu::noinline]] static vec3f
+called_sub(vec3f v1, vec3f v2) {
+  return v1 - v2;
+}
+
+[[gnu::noinline]] static vec3f
+called_scale(float scalar, vec3f v) {
+  return scalar * v;
+}
+
+[[gnu::noinline]] static float
+called_len(vec3f v) {
+  return len(v);
+}
+
+// The vector math of the per star loop in render: the directions to the
+// camera and the hero, and the 26 spokes of each star
+template <bool called>
+static vec3f
+star_loop(const vec3f *stars, int n_stars, vec3f cam_pos, vec3f hero_eye) {
+  auto add = [](vec3f v1, vec3f v2) {
+    return called ? called_add(v1, v2) : v1 + v2;
+  };
+  auto sub = [](vec3f v1, vec3f v2) {
+    return called ? called_sub(v1, v2) : v1 - v2;
+  };
+  auto mul = [](float scalar, vec3f v) {
+    return called ? called_scale(scalar, v) : scalar * v;
+  };
+  auto length = [](vec3f v) { return called ? called_len(v) : len(v); };
+
+  vec3f sum{0, 0, 0};
+  for (int i = 0; i < n_stars; ++i) {
+    vec3f star_pos = stars[i];
+    vec3f to_star = sub(star_pos, cam_pos);
+    vec3f to_hero = sub(star_pos, hero_eye);
+    sum = add(sum, mul(1 / length(to_star), to_star));
+    sum = add(sum, mul(1 / length(to_hero), to_hero));
+    for (int x = -1; x <= 1; ++x) {
+      for (int y = -1; y <= 1; ++y) {
+        for (int z = -1; z <= 1; ++z) {
+          vec3f spoke{(float)x, (float)y, (float)z};
+          sum = add(sum, add(star_pos, mul(0.03F, spoke)));
+        }
+      }
+    }
+  }
+  return sum;
+}
+
+void
+bench_math(const BenchOptions &options, std::vector<BenchResult> *results) {
+  auto add = [&](BenchResult r) {
+    print_bench_result(r);
+    results->push_back(r);
+  };
+
+  // Rigid transforms with some scale, well conditioned for the inverses
+  srand(1);
+  mat4f mats[n_mats];
+  mat4f others[n_mats];
+  affine3f affines[n_mats];
+  vec4f vec4s[n_mats];
+  vec3f vec3s[n_mats];
+  for (int i = 0; i < n_mats; ++i) {
+    mats[i] = rotation(rand_vec(-1, 1), rand_float(0, 2 * pi)) *
+              diagonal(rand_float(0.5, 2), rand_float(0.5, 2),
+                       rand_float(0.5, 2), 1);
+    mats[i].elements[12] = rand_float(-5, 5);
+    mats[i].elements[13] = rand_float(-5, 5);
+    mats[i].elements[14] = rand_float(-5, 5);
+    others[i] = rotation(rand_vec(-1, 1), rand_float(0, 2 * pi));
+    affines[i] = to_affine(mats[i]);
+    vec3s[i] = rand_vec(-5, 5);
+    vec4s[i] = vec4f{vec3s[i].x, vec3s[i].y, vec3s[i].z, 1};
+  }
+  mat4f out_mats[n_mats];
+  affine3f out_affines[n_mats];
+  vec4f out_vec4s[n_mats];
+  vec3f out_vec3s[n_mats];
+
+  add(run_bench("mat4f * mat4f", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_mats[i] = mats[i] * others[i];
+    }
+    do_not_optimize(out_mats);
+  }));
+  add(run_bench("mat4f * vec4f", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_vec4s[i] = mats[i] * vec4s[i];
+    }
+    do_not_optimize(out_vec4s);
+  }));
+  add(run_bench("mat4f * vec3f", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_vec3s[i] = mats[i] * vec3s[i];
+    }
+    do_not_optimize(out_vec3s);
+  }));
+  add(run_bench("inverse(mat4f)", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_mats[i] = inverse(mats[i]);
+    }
+    do_not_optimize(out_mats);
+  }));
+  add(run_bench("transpose", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_mats[i] = mats[i];
+      transpose(&out_mats[i]);
+    }
+    do_not_optimize(out_mats);
+  }));
+  add(run_bench("inverse(affine3f)", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_affines[i] = inverse(affines[i]);
+    }
+    do_not_optimize(out_affines);
+  }));
+  add(run_bench("inverse_orthogonal", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_affines[i] = inverse_orthogonal(affines[i]);
+    }
+    do_not_optimize(out_affines);
+  }));
+  add(run_bench("affine3f * affine3f", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_affines[i] = affines[i] * affines[n_mats - 1 - i];
+    }
+    do_not_optimize(out_affines);
+  }));
+  add(run_bench("look_at", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_mats[i] = look_at(vec3s[i], vec3f{0, 0, 0}, vec3f{0, 1, 0});
+    }
+    do_not_optimize(out_mats);
+  }));
+  add(run_bench("perspective", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_mats[i] = perspective(0.5F + 0.01F * i, 1.0F, 0.5F, 100.0F);
+    }
+    do_not_optimize(out_mats);
+  }));
+  add(run_bench("rotation", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_mats[i] = rotation(vec3s[i], 0.1F * i);
+    }
+    do_not_optimize(out_mats);
+  }));
+  add(run_bench("line_transform", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_mats[i] = to_mat4(
+          to_affine(line_transform(vec3s[i], vec3s[n_mats - 1 - i], 0.01F)));
+    }
+    do_not_optimize(out_mats);
+  }));
+  add(run_bench("normalized", options, n_mats, [&] {
+    for (int i = 0; i < n_mats; ++i) {
+      out_vec3s[i] = normalized(vec3s[i]);
+    }
+    do_not_optimize(out_vec3s);
+  }));
+
+  // Batches, per point
+  std::vector<float> xs(n_points);
+  std::vector<float> ys(n_points);
+  std::vector<float> zs(n_points);
+  std::vector<float> out_xs(n_points);
+  std::vector<float> out_ys(n_points);
+  std::vector<float> out_zs(n_points);
+  for (int i = 0; i < n_points; ++i) {
+    xs[i] = rand_float(-1, 1);
+    ys[i] = rand_float(-1, 1);
+    zs[i] = rand_float(-1, 1);
+  }
+  mat4f view_proj =
+      perspective(0.8F, 1.0F, 0.5F, 100.0F) *
+      look_at(vec3f{3, 4, 5}, vec3f{0, 0, 0}, vec3f{0, 1, 0});
+  affine3f cam = to_affine(look_at(vec3f{3, 4, 5}, vec3f{0, 0, 0},
+                                   vec3f{0, 1, 0}));
+
+  add(run_bench("transform_points", options, n_points, [&] {
+    transform_points(view_proj, xs.data(), ys.data(), zs.data(),
+                     out_xs.data(), out_ys.data(), out_zs.data(), n_points);
+  }));
+  add(run_bench("transform_points_affine", options, n_points, [&] {
+    transform_points_affine(mats[0], xs.data(), ys.data(), zs.data(),
+                            out_xs.data(), out_ys.data(), out_zs.data(),
+                            n_points);
+  }));
+  add(run_bench("camera_rays", options, n_points, [&] {
+    camera_rays(cam, 0.8F, 1.0F, xs.data(), ys.data(), out_xs.data(),
+                out_ys.data(), out_zs.data(), n_points);
+  }));
+
+  // The approximations against libm, positive inputs for pow and rsqrt
+  std::vector<float> angles(n_points);
+  std::vector<float> positives(n_points);
+  for (int i = 0; i < n_points; ++i) {
+    angles[i] = rand_float(-100, 100);
+    positives[i] = exp2f(rand_float(-20, 20));
+  }
+  add(run_bench("fast_sincos_n", options, n_points, [&] {
+    fast_sincos_n(angles.data(), out_xs.data(), out_ys.data(), n_points);
+  }));
+  add(run_bench("sinf + cosf", options, n_points, [&] {
+    for (int i = 0; i < n_points; ++i) {
+      out_xs[i] = sinf(angles[i]);
+      out_ys[i] = cosf(angles[i]);
+    }
+  }));
+  add(run_bench("fast_pow_n", options, n_points, [&] {
+    fast_pow_n(positives.data(), 1.5F, out_xs.data(), n_points);
+  }));
+  add(run_bench("powf", options, n_points, [&] {
+    for (int i = 0; i < n_points; ++i) {
+      out_xs[i] = powf(positives[i], 1.5F);
+    }
+  }));
+  add(run_bench("fast_rsqrt_n", options, n_points, [&] {
+    fast_rsqrt_n(positives.data(), out_xs.data(), n_points);
+  }));
+  add(run_bench("1 / sqrtf", options, n_points, [&] {
+    for (int i = 0; i < n_points; ++i) {
+      out_xs[i] = 1 / sqrtf(positives[i]);
+    }
+  }));
+
+  // Inlined header functions against calls, per star
+  int n_stars = 64;
+  std::vector<vec3f> stars(n_stars);
+  for (int i = 0; i < n_stars; ++i) {
+    stars[i] = vec3f{rand_float(-3, 3), rand_float(0, 1), rand_float(-3, 3)};
+  }
+  vec3f cam_pos{0.5F, 3.5F, 5.0F};
+  vec3f hero_eye{0.0F, 0.3F, 0.0F};
+  add(run_bench("star loop, inlined", options, n_stars, [&] {
+    do_not_optimize(
+        star_loop<false>(stars.data(), n_stars, cam_pos, hero_eye));
+  }));
+  add(run_bench("star loop, called", options, n_stars, [&] {
+    do_not_optimize(star_loop<true>(stars.data(), n_stars, cam_pos, hero_eye));
+  }));
+}
+
+// Prints the largest error, returns whether it is within bound
+static bool
+report_error(const char *name, double error, double bound) {
+  printf("%-12s max error %.3g, bound %.3g%s\n", name, error, bound,
+         error <= bound ? "" : " EXCEEDED");
+  return error <= bound;
+}
+
+// The approximations in fast_math.hpp against double precision libm at n
+// random points, with the bounds documented there
+bool
+check_fast_math(int n) {
+  float *xs = (float *)malloc(sizeof(float) * n);
+  float *a = (float *)malloc(sizeof(float) * n);
+  float *b = (float *)malloc(sizeof(float) * n);
+  srand(n);
+  // In units of the last place of v
+  auto ulp = [](double v) { return ldexp(1.0, ilogb(v) - 23); };
+  bool ok = true;
+
+  for (int i = 0; i < n; ++i) {
+    xs[i] = rand_float(-8192, 8192) / (i % 2 == 0 ? 1 : 2048);
+  }
+  fast_sincos_n(xs, a, b, n);
+  double error = 0;
+  for (int i = 0; i < n; ++i) {
+    error = fmax(error, fabs(a[i] - sin((double)xs[i])));
+    error = fmax(error, fabs(b[i] - cos((double)xs[i])));
+  }
+  ok &= report_error("sincos", error, 1e-7);
+
+  for (int i = 0; i < n; ++i) {
+    xs[i] = rand_float(-126, 127);
+  }
+  error = 0;
+  for (int i = 0; i < n; ++i) {
+    double v = exp2((double)xs[i]);
+    error = fmax(error, fabs(fast_exp2(xs[i]) - v) / ulp(v));
+  }
+  ok &= report_error("exp2 (ulp)", error, 3);
+
+  for (int i = 0; i < n; ++i) {
+    xs[i] = exp2f(rand_float(-120, 120) / (i % 2 == 0 ? 1 : 120));
+  }
+  error = 0;
+  double error_ulp = 0;
+  for (int i = 0; i < n; ++i) {
+    double v = log2((double)xs[i]);
+    double e = fabs(fast_log2(xs[i]) - v);
+    if (fabs(v) < 1) {
+      error = fmax(error, e);
+    } else {
+      error_ulp = fmax(error_ulp, e / ulp(v));
+    }
+  }
+  ok &= report_error("log2 near 1", error, 1.2e-7);
+  ok &= report_error("log2 (ulp)", error_ulp, 1.2);
+
+  float y = 1.5F;
+  for (int i = 0; i < n; ++i) {
+    xs[i] = exp2f(rand_float(-20, 20));
+  }
+  fast_pow_n(xs, y, a, n);
+  error = 0;
+  for (int i = 0; i < n; ++i) {
+    double v = pow((double)xs[i], (double)y);
+    error = fmax(error, fabs(a[i] - v) / v /
+                            (1 + fabs(y * log2((double)xs[i]))));
+  }
+  ok &= report_error("pow", error, 2.5e-7);
+
+  fast_rsqrt_n(xs, a, n);
+  error = 0;
+  for (int i = 0; i < n; ++i) {
+    double v = 1 / sqrt((double)xs[i]);
+    error = fmax(error, fabs(a[i] - v) / v);
+  }
+#if !defined(MATH_SCALAR) && (defined(__SSE2__) || defined(_M_X64))
+  ok &= report_error("rsqrt", error, 3e-7);
+#else
+  ok &= report_error("rsqrt", error, 5e-6);
+#endif
+
+  free(xs);
+  free(a);
+  free(b);
+  return ok;
+}
+
+// The matrix functions of math.cpp as they were before the SIMD versions,
+// the product in the same order and the inverse in double precision
+static mat4f
+reference_mul(const mat4f &m1, const mat4f &m2) {
+  mat4f res;
+  for (int col = 0; col < 4; ++col) {
+    for (int row = 0; row < 4; ++row) {
+      float sum = 0;
+      for (int a = 0; a < 4; ++a) {
+        sum += m1.elements[a * 4 + row] * m2.elements[col * 4 + a];
+      }
+      res.elements[col * 4 + row] = sum;
+    }
+  }
+  return res;
+}
+
+static void
+reference_inverse(const mat4f &mat, double *inv) {
+  // Gauss-Jordan with partial pivoting on [m | I]
+  double m[4][8];
+  for (int row = 0; row < 4; ++row) {
+    for (int col = 0; col < 4; ++col) {
+      m[row][col] = mat.elements[col * 4 + row];
+      m[row][col + 4] = row == col ? 1 : 0;
+    }
+  }
+  for (int col = 0; col < 4; ++col) {
+    int pivot = col;
+    for (int row = col + 1; row < 4; ++row) {
+      if (fabs(m[row][col]) > fabs(m[pivot][col])) {
+        pivot = row;
+      }
+    }
+    for (int k = 0; k < 8; ++k) {
+      std::swap(m[col][k], m[pivot][k]);
+    }
+    for (int row = 0; row < 4; ++row) {
+      double f = m[row][col] / m[col][col];
+      for (int k = 0; k < 8; ++k) {
+        m[row][k] = row == col ? m[row][k] : m[row][k] - f * m[col][k];
+      }
+    }
+  }
+  for (int row = 0; row < 4; ++row) {
+    for (int col = 0; col < 4; ++col) {
+      inv[col * 4 + row] = m[row][col + 4] / m[row][row];
+    }
+  }
+}
+
+// operator*, inverse and transpose of this build against the references on
+// n random matrices, kept well conditioned by a heavy diagonal, and
+// inverse_orthogonal on rotations with a scale. The product error is
+// relative to the sum of the magnitudes of its terms, the inverse errors to
+// the largest element of the inverse.
+bool
+check_matrices(int n) {
+  srand(n);
+  auto rand_mat = [] {
+    mat4f m;
+    for (int i = 0; i < 16; ++i) {
+      m.elements[i] = rand_float(-1, 1) + (i % 5 == 0 ? 3.0F : 0.0F);
+    }
+    return m;
+  };
+  double mul_error = 0;
+  double inverse_error = 0;
+  double orthogonal_error = 0;
+  double transpose_error = 0;
+  for (int i = 0; i < n; ++i) {
+    mat4f a = rand_mat();
+    mat4f b = rand_mat();
+
+    mat4f res = a * b;
+    mat4f ref = reference_mul(a, b);
+    for (int col = 0; col < 4; ++col) {
+      for (int row = 0; row < 4; ++row) {
+        double mag = 0;
+        for (int k = 0; k < 4; ++k) {
+          mag += fabs(a.elements[k * 4 + row] * b.elements[col * 4 + k]);
+        }
+        int e = col * 4 + row;
+        mul_error = fmax(mul_error,
+                         fabs(res.elements[e] - ref.elements[e]) / mag);
+      }
+    }
+
+    auto inverse_diff = [](const mat4f &m, const mat4f &inv) {
+      double inv_ref[16];
+      reference_inverse(m, inv_ref);
+      double max_ref = 0;
+      double diff = 0;
+      for (int e = 0; e < 16; ++e) {
+        max_ref = fmax(max_ref, fabs(inv_ref[e]));
+        diff = fmax(diff, fabs(inv.elements[e] - inv_ref[e]));
+      }
+      return diff / max_ref;
+    };
+    inverse_error = fmax(inverse_error, inverse_diff(a, inverse(a)));
+
+    mat4f r = rotation(rand_vec(-1, 1), rand_float(0, 2 * pi)) *
+              diagonal(rand_float(0.5, 2), rand_float(0.5, 2),
+                       rand_float(0.5, 2), 1);
+    affine3f o = to_affine(r);
+    o.t = rand_vec(-5, 5);
+    orthogonal_error = fmax(orthogonal_error,
+                            inverse_diff(to_mat4(o),
+                                         to_mat4(inverse_orthogonal(o))));
+
+    mat4f t = a;
+    transpose(&t);
+    for (int col = 0; col < 4; ++col) {
+      for (int row = 0; row < 4; ++row) {
+        transpose_error =
+            fmax(transpose_error, fabs(t.elements[col * 4 + row] -
+                                       a.elements[row * 4 + col]));
+      }
+    }
+  }
+  bool ok = report_error("mat mul", mul_error, 2.5e-7);
+  ok &= report_error("inverse", inverse_error, 1e-6);
+  // The rotations are only orthogonal to float precision
+  ok &= report_error("inverse_orth", orthogonal_error, 2e-6);
+  ok &= report_error("transpose", transpose_error, 0);
+  return ok;
+}
+
+int
+main(int argc, char **argv) {
+  const char *json_path = nullptr;
+  const char *commit = nullptr;
+  int cpu = 0;
+  BenchOptions options;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (strcmp(argv[i], "-commit") == 0 && i + 1 < argc) {
+      commit = argv[++i];
+    } else if (strcmp(argv[i], "-samples") == 0 && i + 1 < argc) {
+      options.samples = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-cpu") == 0 && i + 1 < argc) {
+      cpu = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      fprintf(stderr, "Usage: math_bench [-json FILE] [-commit LABEL] "
+                      "[-samples N] [-cpu N]\n");
+      exit(1);
+    }
+  }
+  if (options.samples < 1) {
+    fprintf(stderr, "-samples must be at least 1\n");
+    exit(1);
+  }
+  if (!pin_to_cpu(cpu)) {
+    fprintf(stderr, "Can't pin to cpu %d, timings may be noisier\n", cpu);
+  }
+
+  char variant[32];
+  snprintf(variant, sizeof(variant), "%s%s", simd_variant,
+           use_fast_math ? " fast" : "");
+  printf("math_bench, %s\n", variant);
+  std::vector<BenchResult> results;
+  bench_math(options, &results);
+
+  if (json_path != nullptr &&
+      !write_bench_json(json_path, commit, variant, results)) {
+    fprintf(stderr, "Can't write %s\n", json_path);
+    exit(1);
+  }
+
+  printf("\nmath.cpp matrix errors\n");
+  bool ok = check_matrices(1 << 16);
+  printf("\nfast_math.hpp errors\n");
+  ok &= check_fast_math(1 << 20);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,648 @@
+#include "noise.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// The lanes do the same operations in the same order as the scalar
+// functions, so both give the same values
+#if !defined(MATH_SCALAR) && (defined(__SSE2__) || defined(_M_X64))
+#define NOISE_SIMD
+#include <immintrin.h>
+#endif
+
+// Rows per job
+constexpr int noise_band_rows = 16;
+
+// The lattice hash is seed ^ ix * hash_x ^ iz * hash_z, mixed
+constexpr uint32_t hash_x = 0x9e3779b1U;
+constexpr uint32_t hash_z = 0x85ebca77U;
+// Seeds of the two warp offsets, apart from the octave seeds
+constexpr uint32_t warp_x_salt = 0x68bc21ebU;
+constexpr uint32_t warp_z_salt = 0x02e5be93U;
+
+// Simplex noise works on a lattice of triangles, skew turns them into the
+// square cells and unskew back
+constexpr float skew = 0.36602540378F;
+constexpr float unskew = 0.21132486540F;
+
+static inline uint32_t
+mix(uint32_t h) {
+  h ^= h >> 15;
+  h *= 0x2c1b3c6dU;
+  h ^= h >> 12;
+  h *= 0x297a2d39U;
+  h ^= h >> 15;
+  return h;
+}
+
+static inline uint32_t
+hash_cell(int ix, int iz, uint32_t seed) {
+  return mix(seed ^ (uint32_t)ix * hash_x ^ (uint32_t)iz * hash_z);
+}
+
+// In [-1, 1)
+static inline float
+to_unit(uint32_t h) {
+  return (float)(int32_t)(h >> 8) * (2.0F / 16777216) - 1;
+}
+
+// The gradient of the corner with hash h, both parts in [-1, 1), dotted
+// with the offset from the corner
+static inline float
+grad(uint32_t h, float dx, float dz) {
+  float gx = (float)(int32_t)(h & 0xffff) * (1.0F / 32768) - 1;
+  float gz = (float)(int32_t)(h >> 16) * (1.0F / 32768) - 1;
+  return gx * dx + gz * dz;
+}
+
+// 6t^5 - 15t^4 + 10t^3, flat at both ends up to the second derivative
+static inline float
+fade(float t) {
+  return t * t * t * (t * (t * 6 - 15) + 10);
+}
+
+static inline float
+lerp(float a, float b, float t) {
+  return a + t * (b - a);
+}
+
+static float
+value_noise(float x, float z, uint32_t seed) {
+  float fl_x = floorf(x);
+  float fl_z = floorf(z);
+  int ix = (int)fl_x;
+  int iz = (int)fl_z;
+  float u = fade(x - fl_x);
+  float w = fade(z - fl_z);
+  float top = lerp(to_unit(hash_cell(ix, iz, seed)),
+                   to_unit(hash_cell(ix, iz + 1, seed)), w);
+  float bottom = lerp(to_unit(hash_cell(ix + 1, iz, seed)),
+                      to_unit(hash_cell(ix + 1, iz + 1, seed)), w);
+  return lerp(top, bottom, u);
+}
+
+static float
+perlin_noise(float x, float z, uint32_t seed) {
+  float fl_x = floorf(x);
+  float fl_z = floorf(z);
+  int ix = (int)fl_x;
+  int iz = (int)fl_z;
+  float fx = x - fl_x;
+  float fz = z - fl_z;
+  float u = fade(fx);
+  float w = fade(fz);
+  float top = lerp(grad(hash_cell(ix, iz, seed), fx, fz),
+                   grad(hash_cell(ix, iz + 1, seed), fx, fz - 1), w);
+  float bottom =
+      lerp(grad(hash_cell(ix + 1, iz, seed), fx - 1, fz),
+           grad(hash_cell(ix + 1, iz + 1, seed), fx - 1, fz - 1), w);
+  return lerp(top, bottom, u);
+}
+
+static inline float
+simplex_corner(uint32_t h, float dx, float dz) {
+  float t = fmaxf(0.5F - dx * dx - dz * dz, 0);
+  float t2 = t * t;
+  return t2 * t2 * grad(h, dx, dz);
+}
+
+static float
+simplex_noise(float x, float z, uint32_t seed) {
+  float s = (x + z) * skew;
+  float fi = floorf(x + s);
+  float fj = floorf(z + s);
+  int i = (int)fi;
+  int j = (int)fj;
+  float t = (fi + fj) * unskew;
+  float x0 = x - (fi - t);
+  float z0 = z - (fj - t);
+  // The middle corner is along x in the lower triangle
+  float di = x0 > z0 ? 1 : 0;
+  float dj = 1 - di;
+  float x1 = x0 - di + unskew;
+  float z1 = z0 - dj + unskew;
+  float x2 = x0 - 1 + 2 * unskew;
+  float z2 = z0 - 1 + 2 * unskew;
+  float c0 = simplex_corner(hash_cell(i, j, seed), x0, z0);
+  float c1 = simplex_corner(hash_cell(i + (int)di, j + (int)dj, seed), x1, z1);
+  float c2 = simplex_corner(hash_cell(i + 1, j + 1, seed), x2, z2);
+  return 70 * (c0 + c1 + c2);
+}
+
+static inline float
+lattice_noise(NoiseKind kind, float x, float z, uint32_t seed) {
+  switch (kind) {
+  case NoiseKind::Value:
+    return value_noise(x, z, seed);
+  case NoiseKind::Perlin:
+    return perlin_noise(x, z, seed);
+  case NoiseKind::Simplex:
+    return simplex_noise(x, z, seed);
+  }
+  return 0;
+}
+
+float
+noise_at(const NoiseParams &params, float x, float z) {
+  float px = x * params.frequency;
+  float pz = z * params.frequency;
+  if (params.warp != 0) {
+    float wx = lattice_noise(params.kind, px, pz, params.seed ^ warp_x_salt);
+    float wz = lattice_noise(params.kind, px, pz, params.seed ^ warp_z_salt);
+    px = px + params.warp * wx;
+    pz = pz + params.warp * wz;
+  }
+  float sum = 0;
+  float amplitude = 1;
+  for (int octave = 0; octave < params.octaves; ++octave) {
+    float n = lattice_noise(params.kind, px, pz, params.seed + octave);
+    if (params.fractal == NoiseFractal::Ridged) {
+      n = 1 - fabsf(n);
+      n = n * n;
+    }
+    sum = sum + amplitude * n;
+    px = px * params.lacunarity;
+    pz = pz * params.lacunarity;
+    amplitude = amplitude * params.gain;
+  }
+  return sum;
+}
+
+#ifdef NOISE_SIMD
+// The lanes of a batch, 8 with AVX2 and 4 with SSE2. The kernels below are
+// written once against these.
+#ifdef __AVX2__
+constexpr int noise_lanes = 8;
+using vfloat = __m256;
+using vint = __m256i;
+
+static inline vfloat
+vset(float v) {
+  return _mm256_set1_ps(v);
+}
+
+static inline vint
+vset_int(uint32_t v) {
+  return _mm256_set1_epi32((int)v);
+}
+
+static inline vint
+vlane_indices() {
+  return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+}
+
+static inline vfloat
+vadd(vfloat a, vfloat b) {
+  return _mm256_add_ps(a, b);
+}
+
+static inline vfloat
+vsub(vfloat a, vfloat b) {
+  return _mm256_sub_ps(a, b);
+}
+
+static inline vfloat
+vmul(vfloat a, vfloat b) {
+  return _mm256_mul_ps(a, b);
+}
+
+static inline vfloat
+vdiv(vfloat a, vfloat b) {
+  return _mm256_div_ps(a, b);
+}
+
+static inline vfloat
+vmax(vfloat a, vfloat b) {
+  return _mm256_max_ps(a, b);
+}
+
+// All ones where a > b
+static inline vfloat
+vgreater(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+}
+
+static inline vfloat
+vand(vfloat a, vfloat b) {
+  return _mm256_and_ps(a, b);
+}
+
+// ~a & b
+static inline vfloat
+vandnot(vfloat a, vfloat b) {
+  return _mm256_andnot_ps(a, b);
+}
+
+static inline vfloat
+vto_float(vint a) {
+  return _mm256_cvtepi32_ps(a);
+}
+
+static inline vint
+vtruncate(vfloat a) {
+  return _mm256_cvttps_epi32(a);
+}
+
+static inline vint
+vmask_int(vfloat mask) {
+  return _mm256_castps_si256(mask);
+}
+
+static inline vint
+vadd_int(vint a, vint b) {
+  return _mm256_add_epi32(a, b);
+}
+
+static inline vint
+vmul_int(vint a, vint b) {
+  return _mm256_mullo_epi32(a, b);
+}
+
+static inline vint
+vxor_int(vint a, vint b) {
+  return _mm256_xor_si256(a, b);
+}
+
+static inline vint
+vand_int(vint a, vint b) {
+  return _mm256_and_si256(a, b);
+}
+
+static inline vint
+vshift_right(vint a, int n) {
+  return _mm256_srli_epi32(a, n);
+}
+
+// a where mask, else b
+static inline vint
+vselect_int(vint mask, vint a, vint b) {
+  return _mm256_blendv_epi8(b, a, mask);
+}
+
+static inline void
+vstore(float *out, vfloat a) {
+  _mm256_storeu_ps(out, a);
+}
+#else
+constexpr int noise_lanes = 4;
+using vfloat = __m128;
+using vint = __m128i;
+
+static inline vfloat
+vset(float v) {
+  return _mm_set1_ps(v);
+}
+
+static inline vint
+vset_int(uint32_t v) {
+  return _mm_set1_epi32((int)v);
+}
+
+static inline vint
+vlane_indices() {
+  return _mm_setr_epi32(0, 1, 2, 3);
+}
+
+static inline vfloat
+vadd(vfloat a, vfloat b) {
+  return _mm_add_ps(a, b);
+}
+
+static inline vfloat
+vsub(vfloat a, vfloat b) {
+  return _mm_sub_ps(a, b);
+}
+
+static inline vfloat
+vmul(vfloat a, vfloat b) {
+  return _mm_mul_ps(a, b);
+}
+
+static inline vfloat
+vdiv(vfloat a, vfloat b) {
+  return _mm_div_ps(a, b);
+}
+
+static inline vfloat
+vmax(vfloat a, vfloat b) {
+  return _mm_max_ps(a, b);
+}
+
+static inline vfloat
+vgreater(vfloat a, vfloat b) {
+  return _mm_cmpgt_ps(a, b);
+}
+
+static inline vfloat
+vand(vfloat a, vfloat b) {
+  return _mm_and_ps(a, b);
+}
+
+static inline vfloat
+vandnot(vfloat a, vfloat b) {
+  return _mm_andnot_ps(a, b);
+}
+
+static inline vfloat
+vto_float(vint a) {
+  return _mm_cvtepi32_ps(a);
+}
+
+static inline vint
+vtruncate(vfloat a) {
+  return _mm_cvttps_epi32(a);
+}
+
+static inline vint
+vmask_int(vfloat mask) {
+  return _mm_castps_si128(mask);
+}
+
+static inline vint
+vadd_int(vint a, vint b) {
+  return _mm_add_epi32(a, b);
+}
+
+// _mm_mullo_epi32 needs SSE4.1
+static inline vint
+vmul_int(vint a, vint b) {
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline vint
+vxor_int(vint a, vint b) {
+  return _mm_xor_si128(a, b);
+}
+
+static inline vint
+vand_int(vint a, vint b) {
+  return _mm_and_si128(a, b);
+}
+
+static inline vint
+vshift_right(vint a, int n) {
+  return _mm_srli_epi32(a, n);
+}
+
+static inline vint
+vselect_int(vint mask, vint a, vint b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline void
+vstore(float *out, vfloat a) {
+  _mm_storeu_ps(out, a);
+}
+#endif
+
+static inline vint
+vmix(vint h) {
+  h = vxor_int(h, vshift_right(h, 15));
+  h = vmul_int(h, vset_int(0x2c1b3c6dU));
+  h = vxor_int(h, vshift_right(h, 12));
+  h = vmul_int(h, vset_int(0x297a2d39U));
+  h = vxor_int(h, vshift_right(h, 15));
+  return h;
+}
+
+// hx and hz are ix * hash_x and iz * hash_z
+static inline vint
+vhash_cell(vint hx, vint hz, vint seed) {
+  return vmix(vxor_int(vxor_int(seed, hx), hz));
+}
+
+static inline vfloat
+vto_unit(vint h) {
+  return vsub(vmul(vto_float(vshift_right(h, 8)), vset(2.0F / 16777216)),
+              vset(1));
+}
+
+static inline vfloat
+vgrad(vint h, vfloat dx, vfloat dz) {
+  vfloat gx = vto_float(vand_int(h, vset_int(0xffff)));
+  vfloat gz = vto_float(vshift_right(h, 16));
+  gx = vsub(vmul(gx, vset(1.0F / 32768)), vset(1));
+  gz = vsub(vmul(gz, vset(1.0F / 32768)), vset(1));
+  return vadd(vmul(gx, dx), vmul(gz, dz));
+}
+
+static inline vfloat
+vfade(vfloat t) {
+  vfloat t3 = vmul(vmul(t, t), t);
+  vfloat p = vsub(vmul(t, vset(6)), vset(15));
+  return vmul(t3, vadd(vmul(t, p), vset(10)));
+}
+
+static inline vfloat
+vlerp(vfloat a, vfloat b, vfloat t) {
+  return vadd(a, vmul(t, vsub(b, a)));
+}
+
+// floorf for |x| < 2^31, without SSE4.1
+static inline vfloat
+vfloor(vfloat x, vint *i) {
+  vint t = vtruncate(x);
+  vfloat above = vgreater(vto_float(t), x);
+  *i = vadd_int(t, vmask_int(above));
+  return vto_float(*i);
+}
+
+static inline vfloat
+vvalue_noise(vfloat x, vfloat z, vint seed) {
+  vint ix;
+  vint iz;
+  vfloat fl_x = vfloor(x, &ix);
+  vfloat fl_z = vfloor(z, &iz);
+  vfloat u = vfade(vsub(x, fl_x));
+  vfloat w = vfade(vsub(z, fl_z));
+  vint hx0 = vmul_int(ix, vset_int(hash_x));
+  vint hx1 = vadd_int(hx0, vset_int(hash_x));
+  vint hz0 = vmul_int(iz, vset_int(hash_z));
+  vint hz1 = vadd_int(hz0, vset_int(hash_z));
+  vfloat top = vlerp(vto_unit(vhash_cell(hx0, hz0, seed)),
+                     vto_unit(vhash_cell(hx0, hz1, seed)), w);
+  vfloat bottom = vlerp(vto_unit(vhash_cell(hx1, hz0, seed)),
+                        vto_unit(vhash_cell(hx1, hz1, seed)), w);
+  return vlerp(top, bottom, u);
+}
+
+static inline vfloat
+vperlin_noise(vfloat x, vfloat z, vint seed) {
+  vint ix;
+  vint iz;
+  vfloat fl_x = vfloor(x, &ix);
+  vfloat fl_z = vfloor(z, &iz);
+  vfloat fx = vsub(x, fl_x);
+  vfloat fz = vsub(z, fl_z);
+  vfloat fx1 = vsub(fx, vset(1));
+  vfloat fz1 = vsub(fz, vset(1));
+  vfloat u = vfade(fx);
+  vfloat w = vfade(fz);
+  vint hx0 = vmul_int(ix, vset_int(hash_x));
+  vint hx1 = vadd_int(hx0, vset_int(hash_x));
+  vint hz0 = vmul_int(iz, vset_int(hash_z));
+  vint hz1 = vadd_int(hz0, vset_int(hash_z));
+  vfloat top = vlerp(vgrad(vhash_cell(hx0, hz0, seed), fx, fz),
+                     vgrad(vhash_cell(hx0, hz1, seed), fx, fz1), w);
+  vfloat bottom = vlerp(vgrad(vhash_cell(hx1, hz0, seed), fx1, fz),
+                        vgrad(vhash_cell(hx1, hz1, seed), fx1, fz1), w);
+  return vlerp(top, bottom, u);
+}
+
+static inline vfloat
+vsimplex_corner(vint h, vfloat dx, vfloat dz) {
+  vfloat t = vsub(vsub(vset(0.5F), vmul(dx, dx)), vmul(dz, dz));
+  t = vmax(t, vset(0));
+  vfloat t2 = vmul(t, t);
+  return vmul(vmul(t2, t2), vgrad(h, dx, dz));
+}
+
+static inline vfloat
+vsimplex_noise(vfloat x, vfloat z, vint seed) {
+  vfloat s = vmul(vadd(x, z), vset(skew));
+  vint i;
+  vint j;
+  vfloat fi = vfloor(vadd(x, s), &i);
+  vfloat fj = vfloor(vadd(z, s), &j);
+  vfloat t = vmul(vadd(fi, fj), vset(unskew));
+  vfloat x0 = vsub(x, vsub(fi, t));
+  vfloat z0 = vsub(z, vsub(fj, t));
+  vfloat lower = vgreater(x0, z0);
+  vfloat di = vand(lower, vset(1));
+  vfloat dj = vsub(vset(1), di);
+  vfloat x1 = vadd(vsub(x0, di), vset(unskew));
+  vfloat z1 = vadd(vsub(z0, dj), vset(unskew));
+  vfloat x2 = vadd(vsub(x0, vset(1)), vset(2 * unskew));
+  vfloat z2 = vadd(vsub(z0, vset(1)), vset(2 * unskew));
+
+  vint hx0 = vmul_int(i, vset_int(hash_x));
+  vint hx1 = vadd_int(hx0, vset_int(hash_x));
+  vint hz0 = vmul_int(j, vset_int(hash_z));
+  vint hz1 = vadd_int(hz0, vset_int(hash_z));
+  vint lower_int = vmask_int(lower);
+  vint hx_mid = vselect_int(lower_int, hx1, hx0);
+  vint hz_mid = vselect_int(lower_int, hz0, hz1);
+  vfloat c0 = vsimplex_corner(vhash_cell(hx0, hz0, seed), x0, z0);
+  vfloat c1 = vsimplex_corner(vhash_cell(hx_mid, hz_mid, seed), x1, z1);
+  vfloat c2 = vsimplex_corner(vhash_cell(hx1, hz1, seed), x2, z2);
+  return vmul(vset(70), vadd(vadd(c0, c1), c2));
+}
+
+static inline vfloat
+vlattice_noise(NoiseKind kind, vfloat x, vfloat z, uint32_t seed) {
+  switch (kind) {
+  case NoiseKind::Value:
+    return vvalue_noise(x, z, vset_int(seed));
+  case NoiseKind::Perlin:
+    return vperlin_noise(x, z, vset_int(seed));
+  case NoiseKind::Simplex:
+    return vsimplex_noise(x, z, vset_int(seed));
+  }
+  return vset(0);
+}
+
+static vfloat
+vnoise_at(const NoiseParams &params, vfloat x, vfloat z) {
+  vfloat px = vmul(x, vset(params.frequency));
+  vfloat pz = vmul(z, vset(params.frequency));
+  if (params.warp != 0) {
+    vfloat wx = vlattice_noise(params.kind, px, pz, params.seed ^ warp_x_salt);
+    vfloat wz = vlattice_noise(params.kind, px, pz, params.seed ^ warp_z_salt);
+    px = vadd(px, vmul(vset(params.warp), wx));
+    pz = vadd(pz, vmul(vset(params.warp), wz));
+  }
+  vfloat sum = vset(0);
+  float amplitude = 1;
+  for (int octave = 0; octave < params.octaves; ++octave) {
+    vfloat n = vlattice_noise(params.kind, px, pz, params.seed + octave);
+    if (params.fractal == NoiseFractal::Ridged) {
+      n = vsub(vset(1), vandnot(vset(-0.0F), n));
+      n = vmul(n, n);
+    }
+    sum = vadd(sum, vmul(vset(amplitude), n));
+    px = vmul(px, vset(params.lacunarity));
+    pz = vmul(pz, vset(params.lacunarity));
+    amplitude = amplitude * params.gain;
+  }
+  return sum;
+}
+#endif
+
+// Column col at (x, z0 + col * step)
+static void
+noise_row(float *out, int width, float x, float z0, float step,
+          const NoiseParams &params) {
+  int col = 0;
+#ifdef NOISE_SIMD
+  vfloat xs = vset(x);
+  for (; col + noise_lanes <= width; col += noise_lanes) {
+    vint cols = vadd_int(vset_int(col), vlane_indices());
+    vfloat zs = vadd(vset(z0), vmul(vto_float(cols), vset(step)));
+    vstore(out + col, vnoise_at(params, xs, zs));
+  }
+#endif
+  for (; col < width; ++col) {
+    out[col] = noise_at(params, x, z0 + (float)col * step);
+  }
+}
+
+void
+generate_noise_region(float *vals, int width, float x0, float z0, float step,
+                      const NoiseParams &params) {
+  for (int row = 0; row < width; ++row) {
+    noise_row(vals + (size_t)row * width, width, x0 + (float)row * step, z0,
+              step, params);
+  }
+}
+
+void
+generate_noise(float *vals, int width, const NoiseParams &params,
+               JobPool *pool) {
+  int n_bands = (width + noise_band_rows - 1) / noise_band_rows;
+  run_jobs(pool, n_bands, [&](int band) {
+    int end = std::min((band + 1) * noise_band_rows, width);
+    for (int row = band * noise_band_rows; row < end; ++row) {
+      noise_row(vals + (size_t)row * width, width, (float)row / width, 0,
+                1.0F / width, params);
+    }
+  });
+}
+
+void
+generate_base_terrain(float *vals, int width, float max_height,
+                      const NoiseParams &params, JobPool *pool) {
+  int n_bands = (width + noise_band_rows - 1) / noise_band_rows;
+  std::vector<float> band_lo(n_bands);
+  std::vector<float> band_hi(n_bands);
+  run_jobs(pool, n_bands, [&](int band) {
+    float lo = INFINITY;
+    float hi = -INFINITY;
+    int end = std::min((band + 1) * noise_band_rows, width);
+    for (int row = band * noise_band_rows; row < end; ++row) {
+      float *out = vals + (size_t)row * width;
+      noise_row(out, width, (float)row / width, 0, 1.0F / width, params);
+      for (int col = 0; col < width; ++col) {
+        lo = fminf(lo, out[col]);
+        hi = fmaxf(hi, out[col]);
+      }
+    }
+    band_lo[band] = lo;
+    band_hi[band] = hi;
+  });
+
+  float lo = *std::min_element(band_lo.begin(), band_lo.end());
+  float hi = *std::max_element(band_hi.begin(), band_hi.end());
+  float to_height = max_height / fmaxf(hi - lo, 1e-6F);
+  run_jobs(pool, n_bands, [&](int band) {
+    size_t begin = (size_t)band * noise_band_rows * width;
+    size_t end =
+        (size_t)std::min((band + 1) * noise_band_rows, width) * width;
+    for (size_t i = begin; i < end; ++i) {
+      vals[i] = (vals[i] - lo) * to_height;
+    }
+  });
+}
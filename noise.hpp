@@ -0,0 +1,57 @@
+#pragma once
+
+#include "jobs.hpp"
+
+#include <cstdint>
+
+enum class NoiseKind {
+  Value,
+  Perlin,
+  Simplex,
+};
+
+enum class NoiseFractal {
+  // Sum of the octaves, rolling hills
+  Fbm,
+  // Sum of (1 - |octave|)^2, sharp crests where the noise crosses 0
+  Ridged,
+};
+
+/*
+   Fractal lattice noise over the unit square. The values depend only on the
+   params and the point, not on the threads or on whether the build uses
+   SSE2.
+*/
+struct NoiseParams {
+  NoiseKind kind = NoiseKind::Perlin;
+  NoiseFractal fractal = NoiseFractal::Fbm;
+  int octaves = 6;
+  // Lattice cells across the unit square at the lowest octave
+  float frequency = 4.0F;
+  float lacunarity = 2.0F;
+  float gain = 0.5F;
+  // Domain warp, points move by up to this many lowest octave cells
+  float warp = 0.0F;
+  uint32_t seed = 1;
+};
+
+// Noise at (x, z) of the unit square, roughly in [-1, 1] per octave
+float
+noise_at(const NoiseParams &params, float x, float z);
+
+// width x width values, row by row, row r and column c at
+// (r / width, c / width)
+void
+generate_noise(float *vals, int width, const NoiseParams &params,
+               JobPool *pool);
+
+// width x width values at (x0 + row * step, z0 + col * step), on the
+// calling thread
+void
+generate_noise_region(float *vals, int width, float x0, float z0, float step,
+                      const NoiseParams &params);
+
+// Noise scaled to heights in [0, max_height], a base terrain for the waves
+void
+generate_base_terrain(float *vals, int width, float max_height,
+                      const NoiseParams &params, JobPool *pool);
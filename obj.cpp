@@ -0,0 +1,418 @@
+#include "obj.hpp"
+
+#include <charconv>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct MappedFile {
+  const char *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+};
+
+// An empty file maps to null data
+static bool
+map_file(MappedFile *file, const char *path) {
+  file->data = nullptr;
+#ifdef _WIN32
+  file->mapping = nullptr;
+  HANDLE handle =
+      CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                  FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  bool ok = GetFileSizeEx(handle, &size);
+  file->size = ok ? (size_t)size.QuadPart : 0;
+  if (ok && file->size > 0) {
+    file->mapping =
+        CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (file->mapping != nullptr) {
+      file->data =
+          (const char *)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    ok = file->data != nullptr;
+  }
+  CloseHandle(handle);
+  return ok;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  file->size = ok ? (size_t)st.st_size : 0;
+  if (ok && file->size > 0) {
+    void *data = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      // Each job reads its chunk front to back
+      madvise(data, file->size, MADV_SEQUENTIAL);
+      file->data = (const char *)data;
+    }
+    ok = file->data != nullptr;
+  }
+  close(fd);
+  return ok;
+#endif
+}
+
+static void
+unmap_file(MappedFile *file) {
+#ifdef _WIN32
+  if (file->data != nullptr) {
+    UnmapViewOfFile(file->data);
+  }
+  if (file->mapping != nullptr) {
+    CloseHandle(file->mapping);
+  }
+#else
+  if (file->data != nullptr) {
+    munmap((void *)file->data, file->size);
+  }
+#endif
+}
+
+struct ObjCounts {
+  size_t positions;
+  size_t texcoords;
+  size_t normals;
+  size_t triangles;
+};
+
+// Whole lines of the file. The first pass counts what each chunk defines,
+// the second parses it into the mesh from the counts of the chunks before.
+struct ObjChunk {
+  const char *begin;
+  const char *end;
+  ObjCounts counts;
+  ObjCounts offsets;
+  // Start of the first line that doesn't parse
+  const char *error;
+};
+
+enum class ObjLine {
+  Position,
+  Texcoord,
+  Normal,
+  Face,
+  Other,
+};
+
+static bool
+is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *
+skip_blanks(const char *p, const char *end) {
+  while (p < end && is_blank(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+static const char *
+line_end(const char *p, const char *end) {
+  const char *nl = (const char *)memchr(p, '\n', end - p);
+  return nl != nullptr ? nl : end;
+}
+
+// Reads the keyword at p and moves past it
+static ObjLine
+line_kind(const char **p, const char *end) {
+  const char *s = *p;
+  size_t n = end - s;
+  ObjLine kind = ObjLine::Other;
+  size_t len = 0;
+  if (n >= 2 && s[0] == 'v' && is_blank(s[1])) {
+    kind = ObjLine::Position;
+    len = 1;
+  } else if (n >= 3 && s[0] == 'v' && s[1] == 't' && is_blank(s[2])) {
+    kind = ObjLine::Texcoord;
+    len = 2;
+  } else if (n >= 3 && s[0] == 'v' && s[1] == 'n' && is_blank(s[2])) {
+    kind = ObjLine::Normal;
+    len = 2;
+  } else if (n >= 2 && s[0] == 'f' && is_blank(s[1])) {
+    kind = ObjLine::Face;
+    len = 1;
+  }
+  *p = s + len;
+  return kind;
+}
+
+// Corners of a face line, up to the end or a comment
+static int
+count_corners(const char *p, const char *end) {
+  int n = 0;
+  while (true) {
+    p = skip_blanks(p, end);
+    if (p == end || *p == '#') {
+      return n;
+    }
+    ++n;
+    while (p < end && !is_blank(*p) && *p != '#') {
+      ++p;
+    }
+  }
+}
+
+static void
+count_chunk(ObjChunk *chunk) {
+  ObjCounts counts{};
+  for (const char *line = chunk->begin; line < chunk->end;) {
+    const char *eol = line_end(line, chunk->end);
+    const char *p = skip_blanks(line, eol);
+    switch (line_kind(&p, eol)) {
+    case ObjLine::Position:
+      ++counts.positions;
+      break;
+    case ObjLine::Texcoord:
+      ++counts.texcoords;
+      break;
+    case ObjLine::Normal:
+      ++counts.normals;
+      break;
+    case ObjLine::Face: {
+      int n = count_corners(p, eol);
+      if (n >= 3) {
+        counts.triangles += n - 2;
+      }
+      break;
+    }
+    case ObjLine::Other:
+      break;
+    }
+    line = eol + 1;
+  }
+  chunk->counts = counts;
+}
+
+// n numbers, null when one is missing. More numbers after them are skipped.
+static const char *
+parse_floats(const char *p, const char *end, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    p = skip_blanks(p, end);
+    if (p < end && *p == '+') {
+      ++p;
+    }
+    auto [next, ec] = std::from_chars(p, end, out[i]);
+    if (ec != std::errc()) {
+      return nullptr;
+    }
+    p = next;
+  }
+  return p;
+}
+
+// 1 based in the file, negative ones count back from the seen ones
+static const char *
+parse_index(const char *p, const char *end, size_t seen, int *out) {
+  int i;
+  auto [next, ec] = std::from_chars(p, end, i);
+  if (ec != std::errc() || i == 0) {
+    return nullptr;
+  }
+  *out = i > 0 ? i - 1 : (int)((long long)seen + i);
+  return next;
+}
+
+// v, v/vt, v//vn or v/vt/vn
+static const char *
+parse_corner(const char *p, const char *end, const ObjCounts &seen,
+             ObjIndex *out) {
+  *out = ObjIndex{-1, -1, -1};
+  p = parse_index(p, end, seen.positions, &out->position);
+  if (p != nullptr && p < end && *p == '/') {
+    ++p;
+    if (p < end && *p != '/') {
+      p = parse_index(p, end, seen.texcoords, &out->texcoord);
+    }
+    if (p != nullptr && p < end && *p == '/') {
+      p = parse_index(p + 1, end, seen.normals, &out->normal);
+    }
+  }
+  return p;
+}
+
+static bool
+in_range(int index, size_t n, bool optional) {
+  return (optional && index == -1) || (0 <= index && (size_t)index < n);
+}
+
+static bool
+valid_corner(const ObjIndex &corner, const ObjCounts &totals) {
+  return in_range(corner.position, totals.positions, false) &&
+         in_range(corner.texcoord, totals.texcoords, true) &&
+         in_range(corner.normal, totals.normals, true);
+}
+
+static void
+parse_chunk(ObjChunk *chunk, const ObjCounts &totals, ObjMesh *mesh) {
+  // Defined before the current line, in the whole file
+  ObjCounts seen = chunk->offsets;
+  ObjIndex *corners = mesh->corners + 3 * seen.triangles;
+  for (const char *line = chunk->begin; line < chunk->end;) {
+    const char *eol = line_end(line, chunk->end);
+    const char *p = skip_blanks(line, eol);
+    switch (line_kind(&p, eol)) {
+    case ObjLine::Position: {
+      float v[3];
+      p = parse_floats(p, eol, v, 3);
+      mesh->positions[seen.positions++] = vec3f{v[0], v[1], v[2]};
+      break;
+    }
+    case ObjLine::Texcoord: {
+      // v is optional
+      float uv[2] = {0, 0};
+      p = parse_floats(p, eol, uv, 1);
+      const char *v = p != nullptr ? skip_blanks(p, eol) : nullptr;
+      if (v != nullptr && v < eol && *v != '#') {
+        p = parse_floats(v, eol, uv + 1, 1);
+      }
+      mesh->texcoords[seen.texcoords++] = vec2f{uv[0], uv[1]};
+      break;
+    }
+    case ObjLine::Normal: {
+      float n[3];
+      p = parse_floats(p, eol, n, 3);
+      mesh->normals[seen.normals++] = vec3f{n[0], n[1], n[2]};
+      break;
+    }
+    case ObjLine::Face: {
+      ObjIndex first{};
+      ObjIndex prev{};
+      int n = 0;
+      for (p = skip_blanks(p, eol); p < eol && *p != '#'; ++n) {
+        ObjIndex corner;
+        p = parse_corner(p, eol, seen, &corner);
+        if (p == nullptr || !valid_corner(corner, totals) ||
+            (p < eol && !is_blank(*p) && *p != '#')) {
+          p = nullptr;
+          break;
+        }
+        // Fan around the first corner
+        if (n >= 2) {
+          *corners++ = first;
+          *corners++ = prev;
+          *corners++ = corner;
+        }
+        if (n == 0) {
+          first = corner;
+        }
+        prev = corner;
+        p = skip_blanks(p, eol);
+      }
+      break;
+    }
+    case ObjLine::Other:
+      break;
+    }
+    if (p == nullptr) {
+      chunk->error = line;
+      return;
+    }
+    line = eol + 1;
+  }
+}
+
+bool
+load_obj_mesh(ObjMesh *mesh, const char *path, JobPool *pool) {
+  *mesh = ObjMesh{};
+  MappedFile file;
+  if (!map_file(&file, path)) {
+    fprintf(stderr, "Can't read %s\n", path);
+    return false;
+  }
+
+  // Chunks end after a newline, or at the end of the file
+  int n_chunks = (int)((file.size + obj_chunk_size - 1) / obj_chunk_size);
+  ObjChunk *chunks = (ObjChunk *)calloc(n_chunks, sizeof(ObjChunk));
+  const char *file_end = file.data + file.size;
+  for (int i = 0; i < n_chunks; ++i) {
+    chunks[i].begin = i == 0 ? file.data : chunks[i - 1].end;
+    const char *end = file_end;
+    if (i < n_chunks - 1) {
+      // Empty when the line before the cut is in a chunk before
+      const char *cut = file.data + (i + 1) * obj_chunk_size - 1;
+      end = cut < chunks[i].begin ? chunks[i].begin : line_end(cut, file_end);
+      end += end < file_end;
+    }
+    chunks[i].end = end;
+  }
+
+  run_jobs(pool, n_chunks, [&](int i) { count_chunk(&chunks[i]); });
+
+  ObjCounts totals{};
+  for (int i = 0; i < n_chunks; ++i) {
+    chunks[i].offsets = totals;
+    totals.positions += chunks[i].counts.positions;
+    totals.texcoords += chunks[i].counts.texcoords;
+    totals.normals += chunks[i].counts.normals;
+    totals.triangles += chunks[i].counts.triangles;
+  }
+  bool ok = totals.positions <= INT_MAX && totals.texcoords <= INT_MAX &&
+            totals.normals <= INT_MAX;
+  if (!ok) {
+    fprintf(stderr, "%s has more than %d vertices\n", path, INT_MAX);
+  } else {
+    mesh->n_positions = (int)totals.positions;
+    mesh->positions = (vec3f *)malloc(sizeof(vec3f) * totals.positions);
+    mesh->n_texcoords = (int)totals.texcoords;
+    mesh->texcoords = (vec2f *)malloc(sizeof(vec2f) * totals.texcoords);
+    mesh->n_normals = (int)totals.normals;
+    mesh->normals = (vec3f *)malloc(sizeof(vec3f) * totals.normals);
+    mesh->n_triangles = totals.triangles;
+    mesh->corners =
+        (ObjIndex *)malloc(sizeof(ObjIndex) * 3 * totals.triangles);
+
+    run_jobs(pool, n_chunks,
+             [&](int i) { parse_chunk(&chunks[i], totals, mesh); });
+
+    for (int i = 0; i < n_chunks && ok; ++i) {
+      if (chunks[i].error != nullptr) {
+        const char *line = chunks[i].error;
+        int line_number = 1;
+        for (const char *p = file.data; p < line; ++p) {
+          line_number += *p == '\n';
+        }
+        int len = (int)(line_end(line, file_end) - line);
+        fprintf(stderr, "%s:%d: can't parse \"%.*s\"\n", path, line_number,
+                len < 80 ? len : 80, line);
+        ok = false;
+      }
+    }
+    if (!ok) {
+      free_obj_mesh(mesh);
+    }
+  }
+
+  free(chunks);
+  unmap_file(&file);
+  return ok;
+}
+
+void
+free_obj_mesh(ObjMesh *mesh) {
+  free(mesh->positions);
+  free(mesh->texcoords);
+  free(mesh->normals);
+  free(mesh->corners);
+  *mesh = ObjMesh{};
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "jobs.hpp"
+#include "math.hpp"
+
+#include <cstddef>
+
+// Bytes of the file per parse job, cut at the next newline
+constexpr size_t obj_chunk_size = 4 << 20;
+
+// One corner of a triangle, -1 where the face gives no texcoord or normal
+struct ObjIndex {
+  int position;
+  int texcoord;
+  int normal;
+};
+
+/*
+   Wavefront OBJ positions, texcoords, normals and faces, everything else is
+   skipped. Faces with more than 3 corners become fans around their first
+   corner. Indices are 0 based, negative ones in the file are resolved.
+*/
+struct ObjMesh {
+  int n_positions;
+  vec3f *positions;
+  int n_texcoords;
+  vec2f *texcoords;
+  int n_normals;
+  vec3f *normals;
+  // 3 corners per triangle
+  size_t n_triangles;
+  ObjIndex *corners;
+};
+
+// Maps the file and parses it on the pool, a chunk per job. Returns false
+// and prints where when the file can't be read or doesn't parse.
+bool
+load_obj_mesh(ObjMesh *mesh, const char *path, JobPool *pool);
+
+void
+free_obj_mesh(ObjMesh *mesh);
@@ -0,0 +1,211 @@
+#include "particles.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// A stalled frame is simulated as this long
+constexpr float max_tick = 0.1F;
+// Particles this far below the terrain fell off it
+constexpr float kill_depth = -2.0F;
+
+void
+init_particles(Particles *ps, int capacity, ParticleParams params) {
+  capacity = (capacity + particle_block - 1) / particle_block * particle_block;
+  int n_jobs = (capacity + particle_job_size - 1) / particle_job_size;
+  ps->params = params;
+  ps->capacity = capacity;
+  ps->high_water = 0;
+  ps->n_alive = 0;
+  ps->x = (float *)calloc(capacity, sizeof(float));
+  ps->y = (float *)calloc(capacity, sizeof(float));
+  ps->z = (float *)calloc(capacity, sizeof(float));
+  ps->vx = (float *)calloc(capacity, sizeof(float));
+  ps->vy = (float *)calloc(capacity, sizeof(float));
+  ps->vz = (float *)calloc(capacity, sizeof(float));
+  ps->life = (float *)calloc(capacity, sizeof(float));
+  ps->free_slots = (int *)malloc(sizeof(int) * capacity);
+  ps->n_free = 0;
+  ps->died = (int *)malloc(sizeof(int) * capacity);
+  ps->job_died = (int *)malloc(sizeof(int) * n_jobs);
+  ps->job_alive = (int *)malloc(sizeof(int) * n_jobs);
+  ps->seed = 1;
+}
+
+void
+free_particles(Particles *ps) {
+  free(ps->x);
+  free(ps->y);
+  free(ps->z);
+  free(ps->vx);
+  free(ps->vy);
+  free(ps->vz);
+  free(ps->life);
+  free(ps->free_slots);
+  free(ps->died);
+  free(ps->job_died);
+  free(ps->job_alive);
+}
+
+int
+emit_particles(Particles *ps, vec3f pos, vec3f vel, float spread, float life,
+               int n) {
+  // xorshift, in [-1, 1)
+  uint32_t state = ps->seed;
+  auto next = [&] {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (float)(state >> 8) / (float)(1 << 23) - 1;
+  };
+
+  int emitted = 0;
+  for (; emitted < n; ++emitted) {
+    int i;
+    if (ps->n_free > 0) {
+      i = ps->free_slots[--ps->n_free];
+    } else if (ps->high_water < ps->capacity) {
+      i = ps->high_water++;
+    } else {
+      break;
+    }
+    ps->x[i] = pos.x;
+    ps->y[i] = pos.y;
+    ps->z[i] = pos.z;
+    ps->vx[i] = vel.x + spread * next();
+    ps->vy[i] = vel.y + spread * next();
+    ps->vz[i] = vel.z + spread * next();
+    ps->life[i] = life * (0.75F + 0.25F * next());
+  }
+  ps->seed = state;
+  ps->n_alive += emitted;
+  return emitted;
+}
+
+static void
+update_job(Particles *ps, const Heightfield *hf, float dt, int job) {
+  const ParticleParams &params = ps->params;
+  int begin = job * particle_job_size;
+  int end = std::min(begin + particle_job_size, ps->high_water);
+  float keep = fmaxf(1 - params.drag * dt, 0);
+  float half = 0.5F * hf->scale;
+  int n_died = 0;
+  int *died = ps->died + begin;
+
+  for (int i0 = begin; i0 < end; i0 += particle_block) {
+    float *__restrict x = ps->x + i0;
+    float *__restrict y = ps->y + i0;
+    float *__restrict z = ps->z + i0;
+    float *__restrict vx = ps->vx + i0;
+    float *__restrict vy = ps->vy + i0;
+    float *__restrict vz = ps->vz + i0;
+    float *__restrict life = ps->life + i0;
+
+    // Integration, the same operations on all lanes. Dead lanes are left as
+    // they are.
+    alignas(32) vec2f xz[particle_block];
+    alignas(32) float was_alive[particle_block];
+    for (int l = 0; l < particle_block; ++l) {
+      float alive = life[l] > 0 ? 1.0F : 0.0F;
+      float t = alive * dt;
+      vy[l] = keep * vy[l] - t * params.gravity;
+      vx[l] = keep * vx[l];
+      vz[l] = keep * vz[l];
+      x[l] += t * vx[l];
+      y[l] += t * vy[l];
+      z[l] += t * vz[l];
+      life[l] -= t;
+      was_alive[l] = alive;
+      xz[l] = vec2f{x[l], z[l]};
+    }
+
+    // Bounce off the top of the column under each lane, off the terrain
+    // there is nothing to land on
+    alignas(32) float ground[particle_block];
+    sample_heights(hf, xz, ground, particle_block, SampleMode::Nearest);
+    for (int l = 0; l < particle_block; ++l) {
+      bool over = fabsf(x[l]) < half && fabsf(z[l]) < half;
+      float h = over ? ground[l] : kill_depth;
+      bool hit = y[l] < h && vy[l] < 0;
+      y[l] = hit ? h : y[l];
+      vy[l] = hit ? -params.restitution * vy[l] : vy[l];
+      vx[l] = hit ? params.friction * vx[l] : vx[l];
+      vz[l] = hit ? params.friction * vz[l] : vz[l];
+      life[l] = y[l] <= kill_depth ? 0 : life[l];
+    }
+
+    for (int l = 0; l < particle_block; ++l) {
+      if (was_alive[l] > 0 && life[l] <= 0 && i0 + l < end) {
+        died[n_died++] = i0 + l;
+      }
+    }
+  }
+  ps->job_died[job] = n_died;
+}
+
+void
+update_particles(Particles *ps, JobPool *pool, const Heightfield *hf,
+                 float dt) {
+  dt = fminf(dt, max_tick);
+  int n_jobs = (ps->high_water + particle_job_size - 1) / particle_job_size;
+  run_jobs(pool, n_jobs, [&](int job) { update_job(ps, hf, dt, job); });
+
+  // Free the dead slots in slot order, emits reuse them the same way for
+  // any number of threads
+  for (int job = 0; job < n_jobs; ++job) {
+    const int *died = ps->died + job * particle_job_size;
+    for (int k = 0; k < ps->job_died[job]; ++k) {
+      ps->free_slots[ps->n_free++] = died[k];
+    }
+    ps->n_alive -= ps->job_died[job];
+  }
+  if (ps->n_alive == 0) {
+    ps->high_water = 0;
+    ps->n_free = 0;
+  }
+}
+
+int
+write_particle_instances(Particles *ps, JobPool *pool, float *out) {
+  int n_jobs = (ps->high_water + particle_job_size - 1) / particle_job_size;
+  auto job_range = [&](int job, int *begin, int *end) {
+    *begin = job * particle_job_size;
+    *end = std::min(*begin + particle_job_size, ps->high_water);
+  };
+
+  run_jobs(pool, n_jobs, [&](int job) {
+    int begin;
+    int end;
+    job_range(job, &begin, &end);
+    int n = 0;
+    for (int i = begin; i < end; ++i) {
+      n += ps->life[i] > 0;
+    }
+    ps->job_alive[job] = n;
+  });
+
+  int total = 0;
+  for (int job = 0; job < n_jobs; ++job) {
+    int n = ps->job_alive[job];
+    ps->job_alive[job] = total;
+    total += n;
+  }
+
+  run_jobs(pool, n_jobs, [&](int job) {
+    int begin;
+    int end;
+    job_range(job, &begin, &end);
+    float *dst = out + 4 * ps->job_alive[job];
+    for (int i = begin; i < end; ++i) {
+      if (ps->life[i] > 0) {
+        dst[0] = ps->x[i];
+        dst[1] = ps->y[i];
+        dst[2] = ps->z[i];
+        dst[3] = ps->life[i];
+        dst += 4;
+      }
+    }
+  });
+  return total;
+}
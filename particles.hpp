@@ -0,0 +1,75 @@
+#pragma once
+
+#include "jobs.hpp"
+#include "math.hpp"
+#include "terrain.hpp"
+
+#include <cstdint>
+
+// Particles are integrated in blocks of particle_block lanes, the arrays are
+// padded to a multiple of it
+constexpr int particle_block = 8;
+constexpr int particle_job_size = 16384;
+
+struct ParticleParams {
+  float gravity = 9.8F;
+  // Fraction of the velocity lost per second to the air
+  float drag = 0.8F;
+  // Kept of the vertical speed when bouncing off a column, and of the
+  // horizontal speed
+  float restitution = 0.3F;
+  float friction = 0.7F;
+};
+
+/*
+   Short lived particles as structure of arrays. A slot is dead when its
+   life is <= 0, dead slots are kept on a free list and reused by the next
+   emit, so nothing is allocated after init.
+*/
+struct Particles {
+  ParticleParams params;
+  int capacity;
+  // Slots at or above high_water were never used
+  int high_water;
+  int n_alive;
+  float *x;
+  float *y;
+  float *z;
+  float *vx;
+  float *vy;
+  float *vz;
+  float *life;
+  int *free_slots;
+  int n_free;
+  // Per job of particle_job_size slots: the slots that died in the update
+  // and the live ones counted when writing instances
+  int *died;
+  int *job_died;
+  int *job_alive;
+  uint32_t seed;
+};
+
+void
+init_particles(Particles *ps, int capacity, ParticleParams params);
+
+void
+free_particles(Particles *ps);
+
+// Emits up to n particles at pos with velocities vel plus up to spread in
+// each axis, living up to life seconds. Returns how many were emitted, less
+// than n when the particles are full.
+int
+emit_particles(Particles *ps, vec3f pos, vec3f vel, float spread, float life,
+               int n);
+
+// Particles bounce off the tops of the columns of hf and die when they fall
+// off the terrain
+void
+update_particles(Particles *ps, JobPool *pool, const Heightfield *hf,
+                 float dt);
+
+// Writes x, y, z and the remaining life of the live particles, 4 floats
+// each, in slot order. Returns their count. out (a mapped buffer) must have
+// room for capacity of them.
+int
+write_particle_instances(Particles *ps, JobPool *pool, float *out);
@@ -0,0 +1,664 @@
+#include "path.hpp"
+#include "terrain.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <utility>
+#include <vector>
+
+constexpr float inf = std::numeric_limits<float>::infinity();
+constexpr float sqrt2 = 1.41421356F;
+
+// In the order of dir_rows and dir_cols
+constexpr float dir_costs[8] = {1, 1, 1, 1, sqrt2, sqrt2, sqrt2, sqrt2};
+constexpr int8_t opposite[8] = {1, 0, 3, 2, 7, 6, 5, 4};
+
+static bool
+walkable(const PassGrid *grid, int row, int col) {
+  return 0 <= row && row < grid->width && 0 <= col && col < grid->width &&
+         grid->passable[row * grid->width + col];
+}
+
+// Diagonal moves need both cells beside them free, corners are not cut
+static bool
+can_move(const PassGrid *grid, int row, int col, int dir) {
+  int dr = dir_rows[dir];
+  int dc = dir_cols[dir];
+  if (!walkable(grid, row + dr, col + dc)) {
+    return false;
+  }
+  return dir < 4 ||
+         (walkable(grid, row + dr, col) && walkable(grid, row, col + dc));
+}
+
+void
+init_pass_grid(PassGrid *grid, int width, PassParams params) {
+  size_t n = (size_t)width * width;
+  int tiles = (width + pass_tile_size - 1) / pass_tile_size;
+  grid->width = width;
+  grid->params = params;
+  grid->passable = (uint8_t *)calloc(n, 1);
+  grid->words_per_line = (width + 63) / 64;
+  grid->row_bits =
+      (uint64_t *)calloc((size_t)width * grid->words_per_line, 8);
+  grid->col_bits =
+      (uint64_t *)calloc((size_t)width * grid->words_per_line, 8);
+  grid->empty_line = (uint64_t *)calloc(grid->words_per_line, 8);
+  // Every cell is blocked until the first update
+  size_t line_bytes = (size_t)width * grid->words_per_line * 8;
+  for (int k = 0; k < 2; ++k) {
+    grid->row_stops[k] = (uint64_t *)malloc(line_bytes);
+    grid->col_stops[k] = (uint64_t *)malloc(line_bytes);
+    memset(grid->row_stops[k], 0xff, line_bytes);
+    memset(grid->col_stops[k], 0xff, line_bytes);
+  }
+  grid->heights = (float *)malloc(sizeof(float) * n);
+  // Nothing compares equal to NaN, the first update visits every tile
+  for (size_t i = 0; i < n; ++i) {
+    grid->heights[i] = std::numeric_limits<float>::quiet_NaN();
+  }
+  grid->changed = (int *)malloc(sizeof(int) * n);
+  grid->n_changed = 0;
+  grid->dirty_tiles = (int *)malloc(sizeof(int) * tiles * tiles);
+  grid->n_dirty_tiles = 0;
+}
+
+void
+free_pass_grid(PassGrid *grid) {
+  free(grid->passable);
+  free(grid->row_bits);
+  free(grid->col_bits);
+  free(grid->empty_line);
+  for (int k = 0; k < 2; ++k) {
+    free(grid->row_stops[k]);
+    free(grid->col_stops[k]);
+  }
+  free(grid->heights);
+  free(grid->changed);
+  free(grid->dirty_tiles);
+  *grid = PassGrid{};
+}
+
+/*
+   Recomputes the stops of line i of bits, rows or columns. A cell is a stop
+   when it is blocked, or a side opens up that was blocked beside the
+   previous cell in the direction of the jump.
+*/
+static void
+update_stops(const PassGrid *grid, const uint64_t *bits, uint64_t *stops[2],
+             int i) {
+  int width = grid->width;
+  int words = grid->words_per_line;
+  auto line = [&](int k) {
+    return 0 <= k && k < width ? &bits[(size_t)k * words] : grid->empty_line;
+  };
+  const uint64_t *cur = line(i);
+  const uint64_t *side0 = line(i - 1);
+  const uint64_t *side1 = line(i + 1);
+  for (int w = 0; w < words; ++w) {
+    // Bit p of prev is the side cell at p - 1, of next at p + 1
+    uint64_t prev0 = side0[w] << 1 | (w > 0 ? side0[w - 1] >> 63 : 0);
+    uint64_t prev1 = side1[w] << 1 | (w > 0 ? side1[w - 1] >> 63 : 0);
+    uint64_t next0 = side0[w] >> 1 | (w + 1 < words ? side0[w + 1] << 63 : 0);
+    uint64_t next1 = side1[w] >> 1 | (w + 1 < words ? side1[w + 1] << 63 : 0);
+    stops[0][(size_t)i * words + w] =
+        ~cur[w] | (side0[w] & ~prev0) | (side1[w] & ~prev1);
+    stops[1][(size_t)i * words + w] =
+        ~cur[w] | (side0[w] & ~next0) | (side1[w] & ~next1);
+  }
+}
+
+void
+update_pass_grid(PassGrid *grid, const Heightfield *hf) {
+  int width = grid->width;
+  int tiles = (width + pass_tile_size - 1) / pass_tile_size;
+  grid->n_changed = 0;
+  grid->n_dirty_tiles = 0;
+
+  // Tiles whose heights differ from the ones the grid was built from
+  for (int tile = 0; tile < tiles * tiles; ++tile) {
+    int row0 = tile / tiles * pass_tile_size;
+    int col0 = tile % tiles * pass_tile_size;
+    int row1 = std::min(row0 + pass_tile_size, width);
+    size_t row_bytes =
+        sizeof(float) * (std::min(col0 + pass_tile_size, width) - col0);
+    bool dirty = false;
+    for (int row = row0; row < row1; ++row) {
+      size_t i = (size_t)row * width + col0;
+      if (memcmp(&grid->heights[i], &hf->vals[i], row_bytes) != 0) {
+        memcpy(&grid->heights[i], &hf->vals[i], row_bytes);
+        dirty = true;
+      }
+    }
+    if (dirty) {
+      grid->dirty_tiles[grid->n_dirty_tiles++] = tile;
+    }
+  }
+
+  // A height also changes the slope of its neighbours, so one cell around
+  // each dirty tile is revisited
+  const PassParams &params = grid->params;
+  for (int k = 0; k < grid->n_dirty_tiles; ++k) {
+    int tile = grid->dirty_tiles[k];
+    int row0 = std::max(tile / tiles * pass_tile_size - 1, 0);
+    int col0 = std::max(tile % tiles * pass_tile_size - 1, 0);
+    int row1 = std::min(tile / tiles * pass_tile_size + pass_tile_size + 1,
+                        width);
+    int col1 = std::min(tile % tiles * pass_tile_size + pass_tile_size + 1,
+                        width);
+    for (int row = row0; row < row1; ++row) {
+      for (int col = col0; col < col1; ++col) {
+        int i = row * width + col;
+        float h = grid->heights[i];
+        bool passable = h <= params.max_height;
+        for (int dir = 0; dir < 4 && passable; ++dir) {
+          int r = row + dir_rows[dir];
+          int c = col + dir_cols[dir];
+          if (0 <= r && r < width && 0 <= c && c < width) {
+            passable = fabsf(grid->heights[r * width + c] - h) <=
+                       params.max_step;
+          }
+        }
+        if (passable != (bool)grid->passable[i]) {
+          grid->passable[i] = passable;
+          grid->changed[grid->n_changed++] = i;
+          int words = grid->words_per_line;
+          grid->row_bits[row * words + col / 64] ^= 1ULL << (col % 64);
+          grid->col_bits[col * words + row / 64] ^= 1ULL << (row % 64);
+        }
+      }
+    }
+  }
+
+  // The stops of a line depend on the lines beside it
+  std::vector<uint8_t> dirty_rows(width);
+  std::vector<uint8_t> dirty_cols(width);
+  for (int k = 0; k < grid->n_changed; ++k) {
+    int row = grid->changed[k] / width;
+    int col = grid->changed[k] % width;
+    for (int d = -1; d <= 1; ++d) {
+      if (0 <= row + d && row + d < width) {
+        dirty_rows[row + d] = 1;
+      }
+      if (0 <= col + d && col + d < width) {
+        dirty_cols[col + d] = 1;
+      }
+    }
+  }
+  for (int i = 0; i < width; ++i) {
+    if (dirty_rows[i]) {
+      update_stops(grid, grid->row_bits, grid->row_stops, i);
+    }
+    if (dirty_cols[i]) {
+      update_stops(grid, grid->col_bits, grid->col_stops, i);
+    }
+  }
+}
+
+void
+init_path_search(PathSearch *search, int width) {
+  size_t n = (size_t)width * width;
+  search->width = width;
+  search->generation = 0;
+  search->visited = (uint32_t *)malloc(sizeof(uint32_t) * n);
+  search->closed = (uint32_t *)malloc(sizeof(uint32_t) * n);
+  search->g = (float *)malloc(sizeof(float) * n);
+  search->came_from = (int *)malloc(sizeof(int) * n);
+  // Every page is written now, a page faulting in the middle of a query
+  // costs more than the query. Zeroes would be turned into a calloc, ~0 is
+  // as unused a generation.
+  for (size_t i = 0; i < n; ++i) {
+    search->visited[i] = ~0U;
+    search->closed[i] = ~0U;
+    search->g[i] = inf;
+    search->came_from[i] = -1;
+  }
+}
+
+void
+free_path_search(PathSearch *search) {
+  free(search->visited);
+  free(search->closed);
+  free(search->g);
+  free(search->came_from);
+  *search = PathSearch{};
+}
+
+static float
+octile(int width, int a, int b) {
+  int dr = abs(a / width - b / width);
+  int dc = abs(a % width - b % width);
+  return (float)std::max(dr, dc) + (sqrt2 - 1) * (float)std::min(dr, dc);
+}
+
+/*
+   First jump point on a line from start in direction dir (+1 or -1), -1 when
+   a blocked cell comes first. stops are the line's stops for dir, the goal
+   is a jump point too. 64 cells are tested per step.
+*/
+static int
+scan_line(const uint64_t *line, const uint64_t *stops, int words, int start,
+          int dir, int goal) {
+  int w = start / 64;
+  int bit = start % 64;
+  if (dir > 0) {
+    uint64_t mask = ~0ULL << bit;
+    for (; w < words; ++w, mask = ~0ULL) {
+      uint64_t stop = stops[w];
+      if (goal >= 0 && goal / 64 == w) {
+        stop |= 1ULL << (goal % 64);
+      }
+      stop &= mask;
+      if (stop != 0) {
+        int p = std::countr_zero(stop);
+        return line[w] >> p & 1 ? w * 64 + p : -1;
+      }
+    }
+  } else {
+    uint64_t mask = bit == 63 ? ~0ULL : (1ULL << (bit + 1)) - 1;
+    for (; w >= 0; --w, mask = ~0ULL) {
+      uint64_t stop = stops[w];
+      if (goal >= 0 && goal / 64 == w) {
+        stop |= 1ULL << (goal % 64);
+      }
+      stop &= mask;
+      if (stop != 0) {
+        int p = 63 - std::countl_zero(stop);
+        return line[w] >> p & 1 ? w * 64 + p : -1;
+      }
+    }
+  }
+  return -1;
+}
+
+// Straight jump from (row, col) along (dr, dc), the jump point or -1
+static int
+jump_straight(const PassGrid *grid, int row, int col, int dr, int dc,
+              int goal) {
+  int width = grid->width;
+  if (row < 0 || row >= width || col < 0 || col >= width) {
+    return -1;
+  }
+  size_t at = (size_t)(dr == 0 ? row : col) * grid->words_per_line;
+  int words = grid->words_per_line;
+  if (dr == 0) {
+    int p = scan_line(&grid->row_bits[at], &grid->row_stops[dc > 0 ? 0 : 1][at],
+                      words, col, dc, goal / width == row ? goal % width : -1);
+    return p < 0 ? -1 : row * width + p;
+  }
+  int p = scan_line(&grid->col_bits[at], &grid->col_stops[dr > 0 ? 0 : 1][at],
+                    words, row, dr, goal % width == col ? goal / width : -1);
+  return p < 0 ? -1 : p * width + col;
+}
+
+static int
+jump(const PassGrid *grid, int row, int col, int dr, int dc, int goal) {
+  if (dr == 0 || dc == 0) {
+    return jump_straight(grid, row, col, dr, dc, goal);
+  }
+  // Tested in row_bits, the lines the straight jumps read anyway, rather
+  // than in passable
+  int width = grid->width;
+  int words = grid->words_per_line;
+  auto free_cell = [&](int r, int c) {
+    return 0 <= r && r < width && 0 <= c && c < width &&
+           (grid->row_bits[(size_t)r * words + c / 64] >> (c % 64) & 1);
+  };
+  while (free_cell(row, col)) {
+    int i = row * width + col;
+    if (i == goal) {
+      return i;
+    }
+    if (jump_straight(grid, row + dr, col, dr, 0, goal) >= 0 ||
+        jump_straight(grid, row, col + dc, 0, dc, goal) >= 0) {
+      return i;
+    }
+    if (!free_cell(row + dr, col) || !free_cell(row, col + dc)) {
+      return -1;
+    }
+    row += dr;
+    col += dc;
+  }
+  return -1;
+}
+
+int
+find_path(const PassGrid *grid, PathSearch *search, int start, int goal,
+          int *path, int max_len) {
+  int width = grid->width;
+  if (!grid->passable[start] || !grid->passable[goal]) {
+    return 0;
+  }
+  uint32_t gen = ++search->generation;
+
+  using Entry = std::pair<float, int>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> open;
+  search->visited[start] = gen;
+  search->g[start] = 0;
+  search->came_from[start] = -1;
+  open.push({octile(width, start, goal), start});
+
+  bool found = false;
+  while (!open.empty()) {
+    int i = open.top().second;
+    open.pop();
+    if (search->closed[i] == gen) {
+      continue;
+    }
+    search->closed[i] = gen;
+    if (i == goal) {
+      found = true;
+      break;
+    }
+
+    int row = i / width;
+    int col = i % width;
+    int from = search->came_from[i];
+    int dr = 0;
+    int dc = 0;
+    if (from >= 0) {
+      dr = (row > from / width) - (row < from / width);
+      dc = (col > from % width) - (col < from % width);
+    }
+
+    // Pruned neighbours, every direction at the start
+    int dirs[8][2];
+    int n_dirs = 0;
+    auto add = [&](int r, int c) {
+      dirs[n_dirs][0] = r;
+      dirs[n_dirs][1] = c;
+      ++n_dirs;
+    };
+    if (from < 0) {
+      for (int dir = 0; dir < 8; ++dir) {
+        if (can_move(grid, row, col, dir)) {
+          add(dir_rows[dir], dir_cols[dir]);
+        }
+      }
+    } else if (dr != 0 && dc != 0) {
+      bool next_row = walkable(grid, row + dr, col);
+      bool next_col = walkable(grid, row, col + dc);
+      if (next_row) {
+        add(dr, 0);
+      }
+      if (next_col) {
+        add(0, dc);
+      }
+      if (next_row && next_col && walkable(grid, row + dr, col + dc)) {
+        add(dr, dc);
+      }
+    } else if (dr != 0) {
+      bool next = walkable(grid, row + dr, col);
+      bool left = walkable(grid, row, col - 1);
+      bool right = walkable(grid, row, col + 1);
+      if (next) {
+        add(dr, 0);
+        if (left && walkable(grid, row + dr, col - 1)) {
+          add(dr, -1);
+        }
+        if (right && walkable(grid, row + dr, col + 1)) {
+          add(dr, 1);
+        }
+      }
+      if (left) {
+        add(0, -1);
+      }
+      if (right) {
+        add(0, 1);
+      }
+    } else {
+      bool next = walkable(grid, row, col + dc);
+      bool up = walkable(grid, row - 1, col);
+      bool down = walkable(grid, row + 1, col);
+      if (next) {
+        add(0, dc);
+        if (up && walkable(grid, row - 1, col + dc)) {
+          add(-1, dc);
+        }
+        if (down && walkable(grid, row + 1, col + dc)) {
+          add(1, dc);
+        }
+      }
+      if (up) {
+        add(-1, 0);
+      }
+      if (down) {
+        add(1, 0);
+      }
+    }
+
+    for (int k = 0; k < n_dirs; ++k) {
+      int j = jump(grid, row + dirs[k][0], col + dirs[k][1], dirs[k][0],
+                   dirs[k][1], goal);
+      if (j < 0 || search->closed[j] == gen) {
+        continue;
+      }
+      float g = search->g[i] + octile(width, i, j);
+      if (search->visited[j] != gen || g < search->g[j]) {
+        search->visited[j] = gen;
+        search->g[j] = g;
+        search->came_from[j] = i;
+        open.push({g + octile(width, j, goal), j});
+      }
+    }
+  }
+  if (!found) {
+    return 0;
+  }
+
+  int n = 0;
+  for (int i = goal; i >= 0; i = search->came_from[i]) {
+    ++n;
+  }
+  if (n > max_len) {
+    return 0;
+  }
+  int k = n;
+  for (int i = goal; i >= 0; i = search->came_from[i]) {
+    path[--k] = i;
+  }
+  return n;
+}
+
+void
+init_distance_field(DistanceField *field, const PassGrid *grid) {
+  size_t n = (size_t)grid->width * grid->width;
+  field->width = grid->width;
+  field->dist = (float *)malloc(sizeof(float) * n);
+  field->next = (int8_t *)malloc(n);
+  for (size_t i = 0; i < n; ++i) {
+    field->dist[i] = inf;
+    field->next[i] = -1;
+  }
+  field->is_goal = (uint8_t *)calloc(n, 1);
+  field->pending = (int *)malloc(sizeof(int) * n);
+  field->n_pending = 0;
+  field->is_pending = (uint8_t *)calloc(n, 1);
+  field->generation = 0;
+  field->marks = (uint32_t *)calloc(n, sizeof(uint32_t));
+}
+
+void
+free_distance_field(DistanceField *field) {
+  free(field->dist);
+  free(field->next);
+  free(field->is_goal);
+  free(field->pending);
+  free(field->is_pending);
+  free(field->marks);
+  *field = DistanceField{};
+}
+
+void
+set_goal(DistanceField *field, int cell, bool goal) {
+  if ((bool)field->is_goal[cell] == goal) {
+    return;
+  }
+  field->is_goal[cell] = goal;
+  if (!field->is_pending[cell]) {
+    field->is_pending[cell] = 1;
+    field->pending[field->n_pending++] = cell;
+  }
+}
+
+/*
+   Dynamic Dijkstra: cells whose way to a goal broke (a cell on it got
+   blocked, a corner closed or the goal went away) are reset together with
+   everything downstream of them. They are seeded from their intact
+   neighbours, and so are the cells around new passages and goals, then
+   only the decreases are propagated.
+*/
+void
+repair_distance_field(DistanceField *field, const PassGrid *grid) {
+  int width = field->width;
+  uint32_t gen = ++field->generation;
+  float *dist = field->dist;
+  int8_t *next = field->next;
+
+  auto is_goal = [&](int i) {
+    return field->is_goal[i] && grid->passable[i];
+  };
+  auto broken = [&](int i) {
+    if (dist[i] == inf || is_goal(i)) {
+      return false;
+    }
+    if (!grid->passable[i] || next[i] < 0) {
+      return true;
+    }
+    int dir = next[i];
+    int j = i + dir_rows[dir] * width + dir_cols[dir];
+    return !can_move(grid, i / width, i % width, dir) || dist[j] == inf ||
+           field->marks[j] == gen;
+  };
+
+  using Entry = std::pair<float, int>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> open;
+  std::vector<int> stack;
+  std::vector<int> reset;
+  std::vector<int> touched;
+
+  // Around every changed cell, diagonals through it may have changed too
+  auto visit_around = [&](int cell) {
+    int row = cell / width;
+    int col = cell % width;
+    for (int r = std::max(row - 1, 0); r <= std::min(row + 1, width - 1);
+         ++r) {
+      for (int c = std::max(col - 1, 0); c <= std::min(col + 1, width - 1);
+           ++c) {
+        int i = r * width + c;
+        touched.push_back(i);
+        if (field->marks[i] != gen && broken(i)) {
+          field->marks[i] = gen;
+          stack.push_back(i);
+        }
+      }
+    }
+  };
+  for (int k = 0; k < grid->n_changed; ++k) {
+    visit_around(grid->changed[k]);
+  }
+  for (int k = 0; k < field->n_pending; ++k) {
+    visit_around(field->pending[k]);
+    field->is_pending[field->pending[k]] = 0;
+  }
+  field->n_pending = 0;
+
+  // Everything downstream of a broken cell is broken too
+  while (!stack.empty()) {
+    int i = stack.back();
+    stack.pop_back();
+    reset.push_back(i);
+    dist[i] = inf;
+    next[i] = -1;
+    int row = i / width;
+    int col = i % width;
+    for (int dir = 0; dir < 8; ++dir) {
+      int r = row + dir_rows[dir];
+      int c = col + dir_cols[dir];
+      if (r < 0 || r >= width || c < 0 || c >= width) {
+        continue;
+      }
+      int j = r * width + c;
+      if (field->marks[j] != gen && next[j] == opposite[dir]) {
+        field->marks[j] = gen;
+        stack.push_back(j);
+      }
+    }
+  }
+
+  for (int i : touched) {
+    if (is_goal(i)) {
+      if (dist[i] != 0) {
+        dist[i] = 0;
+        next[i] = -1;
+      }
+      open.push({0, i});
+    } else if (dist[i] != inf) {
+      open.push({dist[i], i});
+    }
+  }
+  for (int i : reset) {
+    if (!grid->passable[i]) {
+      continue;
+    }
+    int row = i / width;
+    int col = i % width;
+    for (int dir = 0; dir < 8; ++dir) {
+      if (!can_move(grid, row, col, dir)) {
+        continue;
+      }
+      int j = i + dir_rows[dir] * width + dir_cols[dir];
+      if (dist[j] + dir_costs[dir] < dist[i]) {
+        dist[i] = dist[j] + dir_costs[dir];
+        next[i] = (int8_t)dir;
+      }
+    }
+    if (dist[i] != inf) {
+      open.push({dist[i], i});
+    }
+  }
+
+  while (!open.empty()) {
+    auto [d, i] = open.top();
+    open.pop();
+    if (d > dist[i]) {
+      continue;
+    }
+    int row = i / width;
+    int col = i % width;
+    for (int dir = 0; dir < 8; ++dir) {
+      if (!can_move(grid, row, col, dir)) {
+        continue;
+      }
+      int j = i + dir_rows[dir] * width + dir_cols[dir];
+      float nd = d + dir_costs[dir];
+      if (nd < dist[j] && !is_goal(j)) {
+        dist[j] = nd;
+        next[j] = opposite[dir];
+        open.push({nd, j});
+      }
+    }
+  }
+}
+
+int
+follow_field(const DistanceField *field, int cell, int *path, int max_len) {
+  if (field->dist[cell] == std::numeric_limits<float>::infinity()) {
+    return 0;
+  }
+  int n = 0;
+  while (n < max_len) {
+    path[n++] = cell;
+    int dir = field->next[cell];
+    if (dir < 0) {
+      break;
+    }
+    cell += dir_rows[dir] * field->width + dir_cols[dir];
+  }
+  return n;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "terrain.hpp"
+
+#include <cstdint>
+
+struct PassParams {
+  // Highest column that can be walked on
+  float max_height = 0.5F;
+  // Largest height difference to any of the 4 neighbours
+  float max_step = 0.1F;
+};
+
+/*
+   Which cells can be walked on, 8-connected without cutting corners. The
+   heights it was built from are kept so an update only revisits the tiles
+   that changed. changed lists the cells whose passability flipped in the
+   last update, the distance fields repair from it.
+*/
+struct PassGrid {
+  int width;
+  PassParams params;
+  uint8_t *passable;
+  // passable as bits, by rows and by columns (transposed), words_per_line
+  // words each
+  int words_per_line;
+  uint64_t *row_bits;
+  uint64_t *col_bits;
+  uint64_t *empty_line;
+  // The cells a straight jump stops at, blocked ones and forced neighbours,
+  // laid out like row_bits and col_bits. [0] for jumps towards higher
+  // indices, [1] for lower. Jumps scan 64 cells at a time in them.
+  uint64_t *row_stops[2];
+  uint64_t *col_stops[2];
+  float *heights;
+  int *changed;
+  int n_changed;
+  // Tiles whose heights differed in the last update
+  int *dirty_tiles;
+  int n_dirty_tiles;
+};
+
+constexpr int pass_tile_size = 16;
+
+void
+init_pass_grid(PassGrid *grid, int width, PassParams params);
+
+void
+free_pass_grid(PassGrid *grid);
+
+void
+update_pass_grid(PassGrid *grid, const Heightfield *hf);
+
+// Scratch state of jump point search, reused between queries so nothing is
+// cleared per query
+struct PathSearch {
+  int width;
+  uint32_t generation;
+  // g and came_from are valid where visited is the current generation
+  uint32_t *visited;
+  uint32_t *closed;
+  float *g;
+  int *came_from;
+};
+
+void
+init_path_search(PathSearch *search, int width);
+
+void
+free_path_search(PathSearch *search);
+
+// Jump point search from start to goal (cell indices row * width + col).
+// Writes the jump points from start to goal, consecutive ones are on a
+// straight or diagonal line. Returns their count, 0 when there is no path
+// or it has more than max_len of them.
+int
+find_path(const PassGrid *grid, PathSearch *search, int start, int goal,
+          int *path, int max_len);
+
+// Offsets of the 8 neighbours, the straight ones first
+constexpr int dir_rows[8] = {-1, 1, 0, 0, -1, -1, 1, 1};
+constexpr int dir_cols[8] = {0, 0, -1, 1, -1, 1, -1, 1};
+
+/*
+   Octile distance from every cell to the nearest goal. After
+   update_pass_grid only the cells affected by grid->changed are
+   recomputed, as are the ones affected by goals added or removed since the
+   last repair.
+*/
+struct DistanceField {
+  int width;
+  float *dist;
+  // Neighbour (index into dir_rows and dir_cols) on the way to the goal,
+  // -1 at goals and unreachable cells
+  int8_t *next;
+  uint8_t *is_goal;
+  // Goals set or cleared since the last repair
+  int *pending;
+  int n_pending;
+  uint8_t *is_pending;
+  uint32_t generation;
+  uint32_t *marks;
+};
+
+void
+init_distance_field(DistanceField *field, const PassGrid *grid);
+
+void
+free_distance_field(DistanceField *field);
+
+void
+set_goal(DistanceField *field, int cell, bool goal);
+
+// Call after every update_pass_grid, and after set_goal
+void
+repair_distance_field(DistanceField *field, const PassGrid *grid);
+
+// Follows the field from cell towards the nearest goal, writes at most
+// max_len cells (cell first) and returns how many were written. 0 when no
+// goal can be reached.
+int
+follow_field(const DistanceField *field, int cell, int *path, int max_len);
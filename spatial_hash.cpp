@@ -0,0 +1,269 @@
+#include "spatial_hash.hpp"
+#include "math.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+void
+init_spatial_hash(SpatialHash *hash, float tile_size, int n_buckets,
+                  int capacity) {
+  assert(n_buckets > 0 && (n_buckets & (n_buckets - 1)) == 0);
+  hash->tile_size = tile_size;
+  hash->n_buckets = n_buckets;
+  hash->capacity = capacity;
+  hash->heads = (int *)malloc(sizeof(int) * n_buckets);
+  for (int i = 0; i < n_buckets; ++i) {
+    hash->heads[i] = -1;
+  }
+  hash->next = (int *)malloc(sizeof(int) * capacity);
+  hash->prev = (int *)malloc(sizeof(int) * capacity);
+  hash->tile_x = (int *)malloc(sizeof(int) * capacity);
+  hash->tile_z = (int *)malloc(sizeof(int) * capacity);
+  hash->bucket = (int *)malloc(sizeof(int) * capacity);
+  hash->pos = (vec2f *)malloc(sizeof(vec2f) * capacity);
+  for (int i = 0; i < capacity; ++i) {
+    hash->bucket[i] = -1;
+  }
+}
+
+void
+free_spatial_hash(SpatialHash *hash) {
+  free(hash->heads);
+  free(hash->next);
+  free(hash->prev);
+  free(hash->tile_x);
+  free(hash->tile_z);
+  free(hash->bucket);
+  free(hash->pos);
+  *hash = SpatialHash{};
+}
+
+static int
+tile_of(const SpatialHash *hash, float v) {
+  return (int)floorf(v / hash->tile_size);
+}
+
+static int
+bucket_of(const SpatialHash *hash, int tile_x, int tile_z) {
+  uint32_t h = (uint32_t)tile_x * 73856093U ^ (uint32_t)tile_z * 19349663U;
+  return (int)(h & (uint32_t)(hash->n_buckets - 1));
+}
+
+static void
+link_entity(SpatialHash *hash, int id) {
+  int b = bucket_of(hash, hash->tile_x[id], hash->tile_z[id]);
+  hash->bucket[id] = b;
+  hash->prev[id] = -1;
+  hash->next[id] = hash->heads[b];
+  if (hash->heads[b] >= 0) {
+    hash->prev[hash->heads[b]] = id;
+  }
+  hash->heads[b] = id;
+}
+
+static void
+unlink_entity(SpatialHash *hash, int id) {
+  if (hash->prev[id] >= 0) {
+    hash->next[hash->prev[id]] = hash->next[id];
+  } else {
+    hash->heads[hash->bucket[id]] = hash->next[id];
+  }
+  if (hash->next[id] >= 0) {
+    hash->prev[hash->next[id]] = hash->prev[id];
+  }
+  hash->bucket[id] = -1;
+}
+
+void
+insert_entity(SpatialHash *hash, int id, vec2f xz) {
+  assert(0 <= id && id < hash->capacity && hash->bucket[id] < 0);
+  hash->pos[id] = xz;
+  hash->tile_x[id] = tile_of(hash, xz.x);
+  hash->tile_z[id] = tile_of(hash, xz.y);
+  link_entity(hash, id);
+}
+
+void
+remove_entity(SpatialHash *hash, int id) {
+  assert(contains_entity(hash, id));
+  unlink_entity(hash, id);
+}
+
+void
+move_entity(SpatialHash *hash, int id, vec2f xz) {
+  assert(contains_entity(hash, id));
+  hash->pos[id] = xz;
+  int tile_x = tile_of(hash, xz.x);
+  int tile_z = tile_of(hash, xz.y);
+  if (tile_x != hash->tile_x[id] || tile_z != hash->tile_z[id]) {
+    unlink_entity(hash, id);
+    hash->tile_x[id] = tile_x;
+    hash->tile_z[id] = tile_z;
+    link_entity(hash, id);
+  }
+}
+
+bool
+contains_entity(const SpatialHash *hash, int id) {
+  return 0 <= id && id < hash->capacity && hash->bucket[id] >= 0;
+}
+
+// Adds the entities of one tile that pass the test. Other tiles hashed to
+// the same bucket are skipped so no entity is reported twice.
+template <typename Test>
+static void
+collect_tile(const SpatialHash *hash, int tile_x, int tile_z, Test test,
+             int *out, int max_out, int *count) {
+  int b = bucket_of(hash, tile_x, tile_z);
+  for (int id = hash->heads[b]; id >= 0; id = hash->next[id]) {
+    if (hash->tile_x[id] == tile_x && hash->tile_z[id] == tile_z &&
+        test(id)) {
+      if (*count < max_out) {
+        out[*count] = id;
+      }
+      ++*count;
+    }
+  }
+}
+
+// Visits the tiles [x0, x1] x [z0, z1], or every bucket once when that is
+// fewer lists to walk
+template <typename Test>
+static int
+collect_tiles(const SpatialHash *hash, int x0, int z0, int x1, int z1,
+              Test test, int *out, int max_out) {
+  int count = 0;
+  if ((int64_t)(x1 - x0 + 1) * (z1 - z0 + 1) > hash->n_buckets) {
+    for (int b = 0; b < hash->n_buckets; ++b) {
+      for (int id = hash->heads[b]; id >= 0; id = hash->next[id]) {
+        if (x0 <= hash->tile_x[id] && hash->tile_x[id] <= x1 &&
+            z0 <= hash->tile_z[id] && hash->tile_z[id] <= z1 && test(id)) {
+          if (count < max_out) {
+            out[count] = id;
+          }
+          ++count;
+        }
+      }
+    }
+    return count;
+  }
+  for (int tile_x = x0; tile_x <= x1; ++tile_x) {
+    for (int tile_z = z0; tile_z <= z1; ++tile_z) {
+      collect_tile(hash, tile_x, tile_z, test, out, max_out, &count);
+    }
+  }
+  return count;
+}
+
+int
+query_region(const SpatialHash *hash, vec2f min, vec2f max, int *out,
+             int max_out) {
+  auto inside = [&](int id) {
+    vec2f p = hash->pos[id];
+    return min.x <= p.x && p.x <= max.x && min.y <= p.y && p.y <= max.y;
+  };
+  return collect_tiles(hash, tile_of(hash, min.x), tile_of(hash, min.y),
+                       tile_of(hash, max.x), tile_of(hash, max.y), inside,
+                       out, max_out);
+}
+
+int
+query_ray(const SpatialHash *hash, vec2f origin, vec2f dir, float max_t,
+          float radius, int *out, int max_out) {
+  vec2f end{origin.x + max_t * dir.x, origin.y + max_t * dir.y};
+  float dir_len2 = dir.x * dir.x + dir.y * dir.y;
+  auto t_of = [&](int id) {
+    vec2f p = hash->pos[id];
+    float t = ((p.x - origin.x) * dir.x + (p.y - origin.y) * dir.y);
+    return dir_len2 > 0 ? std::clamp(t / dir_len2, 0.0F, max_t) : 0.0F;
+  };
+  auto near_segment = [&](int id) {
+    vec2f p = hash->pos[id];
+    float t = t_of(id);
+    float dx = p.x - (origin.x + t * dir.x);
+    float dz = p.y - (origin.y + t * dir.y);
+    return dx * dx + dz * dz <= radius * radius;
+  };
+
+  // Per column of tiles, the z range the segment covers inside the column's
+  // x slab, widened by radius
+  int x0 = tile_of(hash, std::min(origin.x, end.x) - radius);
+  int x1 = tile_of(hash, std::max(origin.x, end.x) + radius);
+  int count = 0;
+  for (int tile_x = x0; tile_x <= x1; ++tile_x) {
+    float slab0 = tile_x * hash->tile_size - radius;
+    float slab1 = (tile_x + 1) * hash->tile_size + radius;
+    float t0 = 0;
+    float t1 = max_t;
+    if (dir.x != 0) {
+      float ta = (slab0 - origin.x) / dir.x;
+      float tb = (slab1 - origin.x) / dir.x;
+      t0 = std::max(t0, std::min(ta, tb));
+      t1 = std::min(t1, std::max(ta, tb));
+    }
+    if (t0 > t1) {
+      continue;
+    }
+    float za = origin.y + t0 * dir.y;
+    float zb = origin.y + t1 * dir.y;
+    int z0 = tile_of(hash, std::min(za, zb) - radius);
+    int z1 = tile_of(hash, std::max(za, zb) + radius);
+    for (int tile_z = z0; tile_z <= z1; ++tile_z) {
+      collect_tile(hash, tile_x, tile_z, near_segment, out, max_out, &count);
+    }
+  }
+
+  int n_out = std::min(count, max_out);
+  std::sort(out, out + n_out,
+            [&](int a, int b) { return t_of(a) < t_of(b); });
+  return count;
+}
+
+int
+query_ring(const SpatialHash *hash, vec2f center, float r0, float r1,
+           int *out, int max_out) {
+  r0 = std::max(r0, 0.0F);
+  if (r1 < r0) {
+    return 0;
+  }
+  auto in_ring = [&](int id) {
+    float dx = hash->pos[id].x - center.x;
+    float dz = hash->pos[id].y - center.y;
+    float d2 = dx * dx + dz * dz;
+    return r0 * r0 <= d2 && d2 <= r1 * r1;
+  };
+
+  int x0 = tile_of(hash, center.x - r1);
+  int x1 = tile_of(hash, center.x + r1);
+  int z0 = tile_of(hash, center.y - r1);
+  int z1 = tile_of(hash, center.y + r1);
+  if ((int64_t)(x1 - x0 + 1) * (z1 - z0 + 1) > hash->n_buckets) {
+    return collect_tiles(hash, x0, z0, x1, z1, in_ring, out, max_out);
+  }
+
+  // Only the tiles the ring passes through
+  int count = 0;
+  float ts = hash->tile_size;
+  for (int tile_x = x0; tile_x <= x1; ++tile_x) {
+    float ax = tile_x * ts - center.x;
+    float bx = ax + ts;
+    float near_x = ax > 0 ? ax : (bx < 0 ? bx : 0);
+    float far_x = std::max(fabsf(ax), fabsf(bx));
+    for (int tile_z = z0; tile_z <= z1; ++tile_z) {
+      float az = tile_z * ts - center.y;
+      float bz = az + ts;
+      float near_z = az > 0 ? az : (bz < 0 ? bz : 0);
+      float far_z = std::max(fabsf(az), fabsf(bz));
+      float near2 = near_x * near_x + near_z * near_z;
+      float far2 = far_x * far_x + far_z * far_z;
+      if (near2 > r1 * r1 || far2 < r0 * r0) {
+        continue;
+      }
+      collect_tile(hash, tile_x, tile_z, in_ring, out, max_out, &count);
+    }
+  }
+  return count;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "math.hpp"
+
+/*
+   Entities (collectibles, triggers) bucketed by the square tile of the
+   x/z plane they are in. Tiles are hashed into a power of two number of
+   buckets, each bucket is an intrusive list through the entity arrays so
+   insert, remove and move are O(1). Entity ids are indices in
+   [0, capacity).
+*/
+struct SpatialHash {
+  float tile_size;
+  int n_buckets;
+  int capacity;
+  int *heads;
+  // Per entity, tile is -1 when the entity is not in the hash
+  int *next;
+  int *prev;
+  int *tile_x;
+  int *tile_z;
+  int *bucket;
+  vec2f *pos;
+};
+
+void
+init_spatial_hash(SpatialHash *hash, float tile_size, int n_buckets,
+                  int capacity);
+
+void
+free_spatial_hash(SpatialHash *hash);
+
+void
+insert_entity(SpatialHash *hash, int id, vec2f xz);
+
+void
+remove_entity(SpatialHash *hash, int id);
+
+// Relinks only when the entity changes tile
+void
+move_entity(SpatialHash *hash, int id, vec2f xz);
+
+bool
+contains_entity(const SpatialHash *hash, int id);
+
+// The query functions write at most max_out ids and return how many
+// matched, which may be more than max_out
+
+// Entities with min <= xz <= max
+int
+query_region(const SpatialHash *hash, vec2f min, vec2f max, int *out,
+             int max_out);
+
+// Entities within radius of the segment origin + t * dir, t in [0, max_t],
+// the ids written are sorted nearest to the origin first. dir is in the x/z
+// plane.
+int
+query_ray(const SpatialHash *hash, vec2f origin, vec2f dir, float max_t,
+          float radius, int *out, int max_out);
+
+// Entities whose distance from center is in [r0, r1], for the rings waves
+// are active in
+int
+query_ring(const SpatialHash *hash, vec2f center, float r0, float r1,
+           int *out, int max_out);
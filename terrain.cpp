@@ -0,0 +1,490 @@
+#include "terrain.hpp"
+#include "fast_math.hpp"
+#include "math.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+void
+eval_waves(float *vals, int width, int mirror_row, const Wave *waves,
+           int n_waves) {
+  for (int i = 0; i < width * width; ++i) {
+    vals[i] = 0;
+  }
+
+  // The cosines of a chunk of a row are taken in one batch
+  constexpr int chunk = 64;
+  float places[chunk];
+  float cosines[chunk];
+  for (int row = 0; row < mirror_row; ++row) {
+    for (int col0 = 0; col0 < width; col0 += chunk) {
+      int n = std::min(chunk, width - col0);
+      float *acc = vals + row * width + col0;
+      for (int step = 0; step < 2; ++step) {
+
+        float row_norm = (float)row / width;
+        if (step == 1) {
+          row_norm = (float)(mirror_row + mirror_row - row) / width;
+        }
+
+        for (int i = 0; i < n_waves; ++i) {
+          auto wave = waves[i];
+          float tt = wave.time * wave.speed;
+          float repititions = 4;
+          float dy = row_norm - wave.y;
+          for (int k = 0; k < n; ++k) {
+            float dx = (float)(col0 + k) / width - wave.x;
+            float r = sqrtf(dx * dx + dy * dy);
+            places[k] = r * pi * repititions - tt;
+          }
+          math_sincos_n(places, nullptr, cosines, n);
+
+          for (int k = 0; k < n; ++k) {
+            float wave_place = places[k];
+            float cos_w = cosines[k];
+            if (wave_place > pi || wave_place < 0) {
+              cos_w = cos_w * cos_w * cos_w;
+            }
+            if (cos_w < 0) {
+              cos_w /= 6;
+            }
+            bool inside = -0.5 * pi <= wave_place && wave_place <= 1.5 * pi;
+            acc[k] += inside ? wave.size * cos_w : 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+RayHit
+raycast_heightfield(const Heightfield *hf, vec3f origin, vec3f dir,
+                    float max_t) {
+  RayHit res{};
+  int width = hf->width;
+
+  // Grid space, cell (row, col) covers [row, row + 1) x [col, col + 1). The
+  // map is linear so t is the same in both spaces.
+  float to_grid = width / hf->scale;
+  float o[2] = {(origin.x / hf->scale + 0.5F) * width + 0.5F,
+                (origin.z / hf->scale + 0.5F) * width + 0.5F};
+  float d[2] = {dir.x * to_grid, dir.z * to_grid};
+
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  float t_enter = 0;
+  float t_exit = max_t;
+  for (int axis = 0; axis < 2; ++axis) {
+    if (d[axis] == 0) {
+      if (o[axis] < 0 || o[axis] >= width) {
+        return res;
+      }
+      continue;
+    }
+    float t0 = (0 - o[axis]) / d[axis];
+    float t1 = (width - o[axis]) / d[axis];
+    t_enter = fmaxf(t_enter, fminf(t0, t1));
+    t_exit = fminf(t_exit, fmaxf(t0, t1));
+  }
+  if (t_enter > t_exit) {
+    return res;
+  }
+
+  // The time of each cell boundary is computed from its integer position
+  // rather than accumulated, the pyramid walk gets the same times
+  int cell[2];
+  int step[2];
+  float inv_d[2];
+  float t_next[2];
+  for (int axis = 0; axis < 2; ++axis) {
+    float p = o[axis] + d[axis] * t_enter;
+    cell[axis] = (int)clamp(floorf(p), 0, width - 1);
+    inv_d[axis] = 1 / d[axis];
+    if (d[axis] > 0) {
+      step[axis] = 1;
+      t_next[axis] = (cell[axis] + 1 - o[axis]) * inv_d[axis];
+    } else if (d[axis] < 0) {
+      step[axis] = -1;
+      t_next[axis] = (cell[axis] - o[axis]) * inv_d[axis];
+    } else {
+      step[axis] = 0;
+      t_next[axis] = inf;
+    }
+  }
+
+  float t = t_enter;
+  int last_axis = -1;
+  while (t <= t_exit) {
+    float t_leave = fminf(fminf(t_next[0], t_next[1]), t_exit);
+    float h = hf->vals[cell[0] * width + cell[1]];
+    float y_in = origin.y + dir.y * t;
+    float y_out = origin.y + dir.y * t_leave;
+
+    if (y_in <= h || y_out <= h) {
+      res.hit = true;
+      res.row = cell[0];
+      res.col = cell[1];
+      if (y_in <= h) {
+        // Entered through the side of the column
+        res.t = t;
+        res.normal = vec3f{0, 1, 0};
+        if (last_axis == 0) {
+          res.normal = vec3f{(float)-step[0], 0, 0};
+        } else if (last_axis == 1) {
+          res.normal = vec3f{0, 0, (float)-step[1]};
+        }
+      } else {
+        res.t = t + (h - y_in) / dir.y;
+        res.normal = vec3f{0, 1, 0};
+      }
+      return res;
+    }
+
+    // On a tie the col boundary is crossed first
+    int axis = t_next[0] < t_next[1] ? 0 : 1;
+    if (t_next[axis] > t_exit) {
+      break;
+    }
+    t = t_next[axis];
+    cell[axis] += step[axis];
+    last_axis = axis;
+    if (cell[axis] < 0 || cell[axis] >= width) {
+      break;
+    }
+    int bound = step[axis] > 0 ? cell[axis] + 1 : cell[axis];
+    t_next[axis] = (bound - o[axis]) * inv_d[axis];
+  }
+  return res;
+}
+
+constexpr int sample_block = 8;
+
+void
+sample_heights(const Heightfield *hf, const vec2f *xz, float *out, size_t n,
+               SampleMode mode, vec2f *grads) {
+  int width = hf->width;
+  float to_grid = width / hf->scale;
+  float max_g = (float)(width - 1);
+
+  // Fixed size blocks so the loops below vectorize, the last block repeats
+  // its last query
+  for (size_t start = 0; start < n; start += sample_block) {
+    size_t count = std::min((size_t)sample_block, n - start);
+    float gx[sample_block];
+    float gz[sample_block];
+    for (int k = 0; k < sample_block; ++k) {
+      vec2f p = xz[start + std::min((size_t)k, count - 1)];
+      // Column centers are at whole grid coordinates
+      gx[k] = (p.x / hf->scale + 0.5F) * width;
+      gz[k] = (p.y / hf->scale + 0.5F) * width;
+    }
+
+    float vals[sample_block];
+    float dx[sample_block];
+    float dz[sample_block];
+    if (mode == SampleMode::Nearest) {
+      int idx[sample_block];
+      for (int k = 0; k < sample_block; ++k) {
+        int row = (int)std::clamp(gx[k] + 0.5F, 0.0F, max_g);
+        int col = (int)std::clamp(gz[k] + 0.5F, 0.0F, max_g);
+        idx[k] = row * width + col;
+      }
+      for (int k = 0; k < sample_block; ++k) {
+        vals[k] = hf->vals[idx[k]];
+        dx[k] = 0;
+        dz[k] = 0;
+      }
+    } else {
+      int idx[sample_block];
+      float fx[sample_block];
+      float fz[sample_block];
+      float in_x[sample_block];
+      float in_z[sample_block];
+      for (int k = 0; k < sample_block; ++k) {
+        float cx = std::clamp(gx[k], 0.0F, max_g);
+        float cz = std::clamp(gz[k], 0.0F, max_g);
+        in_x[k] = cx == gx[k] ? 1.0F : 0.0F;
+        in_z[k] = cz == gz[k] ? 1.0F : 0.0F;
+        int row = std::min((int)cx, std::max(width - 2, 0));
+        int col = std::min((int)cz, std::max(width - 2, 0));
+        fx[k] = cx - row;
+        fz[k] = cz - col;
+        idx[k] = row * width + col;
+      }
+      // A one cell wide terrain has no neighbours to interpolate with
+      int row_step = width > 1 ? width : 0;
+      int col_step = width > 1 ? 1 : 0;
+      for (int k = 0; k < sample_block; ++k) {
+        const float *v = &hf->vals[idx[k]];
+        float h00 = v[0];
+        float h01 = v[col_step];
+        float h10 = v[row_step];
+        float h11 = v[row_step + col_step];
+        float h0 = h00 + fz[k] * (h01 - h00);
+        float h1 = h10 + fz[k] * (h11 - h10);
+        vals[k] = h0 + fx[k] * (h1 - h0);
+        dx[k] = in_x[k] * (h1 - h0) * to_grid;
+        dz[k] = in_z[k] *
+                (h01 - h00 + fx[k] * (h11 - h10 - h01 + h00)) * to_grid;
+      }
+    }
+
+    for (size_t k = 0; k < count; ++k) {
+      out[start + k] = vals[k];
+    }
+    if (grads != nullptr) {
+      for (size_t k = 0; k < count; ++k) {
+        grads[start + k] = vec2f{dx[k], dz[k]};
+      }
+    }
+  }
+}
+
+void
+init_height_pyramid(HeightPyramid *pyramid, int width) {
+  *pyramid = HeightPyramid{};
+  pyramid->width = width;
+
+  size_t total = 0;
+  int level_width = width;
+  int n_levels = 1;
+  while (level_width > 1 && n_levels < max_pyramid_levels) {
+    level_width = (level_width + 1) / 2;
+    pyramid->level_widths[n_levels++] = level_width;
+    total += (size_t)level_width * level_width;
+  }
+  pyramid->level_widths[0] = width;
+  pyramid->n_levels = n_levels;
+
+  // Level 0 is the heightfield, one allocation for the rest
+  float *data = (float *)malloc(sizeof(float) * total * 2);
+  for (int level = 1; level < n_levels; ++level) {
+    size_t size = (size_t)pyramid->level_widths[level] *
+                  pyramid->level_widths[level];
+    pyramid->mins[level] = data;
+    pyramid->maxs[level] = data + size;
+    data += size * 2;
+  }
+}
+
+void
+free_height_pyramid(HeightPyramid *pyramid) {
+  if (pyramid->n_levels > 1) {
+    free(pyramid->mins[1]);
+  }
+  *pyramid = HeightPyramid{};
+}
+
+bool
+changed_cells(const float *a, const float *b, int width, int *row0, int *col0,
+              int *row1, int *col1) {
+  *row0 = width;
+  *col0 = width;
+  *row1 = 0;
+  *col1 = 0;
+  for (int row = 0; row < width; ++row) {
+    for (int col = 0; col < width; ++col) {
+      if (a[row * width + col] != b[row * width + col]) {
+        *row0 = std::min(*row0, row);
+        *col0 = std::min(*col0, col);
+        *row1 = row + 1;
+        *col1 = std::max(*col1, col + 1);
+      }
+    }
+  }
+  return *row1 > 0;
+}
+
+void
+update_height_pyramid(HeightPyramid *pyramid, const Heightfield *hf, int row0,
+                      int col0, int row1, int col1) {
+  for (int level = 1; level < pyramid->n_levels; ++level) {
+    // Blocks of this level touching the dirty rect
+    row0 /= 2;
+    col0 /= 2;
+    row1 = (row1 + 1) / 2;
+    col1 = (col1 + 1) / 2;
+
+    int src_width = pyramid->level_widths[level - 1];
+    int dst_width = pyramid->level_widths[level];
+    const float *src_min =
+        level == 1 ? hf->vals : pyramid->mins[level - 1];
+    const float *src_max =
+        level == 1 ? hf->vals : pyramid->maxs[level - 1];
+    float *dst_min = pyramid->mins[level];
+    float *dst_max = pyramid->maxs[level];
+
+    for (int row = row0; row < row1; ++row) {
+      for (int col = col0; col < col1; ++col) {
+        float min_v = src_min[(2 * row) * src_width + 2 * col];
+        float max_v = src_max[(2 * row) * src_width + 2 * col];
+        for (int i = 0; i < 2; ++i) {
+          for (int j = 0; j < 2; ++j) {
+            int src_row = 2 * row + i;
+            int src_col = 2 * col + j;
+            if (src_row < src_width && src_col < src_width) {
+              int idx = src_row * src_width + src_col;
+              min_v = fminf(min_v, src_min[idx]);
+              max_v = fmaxf(max_v, src_max[idx]);
+            }
+          }
+        }
+        dst_min[row * dst_width + col] = min_v;
+        dst_max[row * dst_width + col] = max_v;
+      }
+    }
+  }
+}
+
+// The cell along one axis the plain walk is in at time t, it was in cell
+// before and stays in [lo, hi). Boundaries crossed exactly at t count when
+// at_tie is set, the walk crosses col boundaries before row ones.
+static int
+walk_cell_at(float o, float d, float inv_d, int step, int cell, int lo, int hi,
+             float t, bool at_tie) {
+  if (step == 0) {
+    return cell;
+  }
+  auto crossed = [&](int c) {
+    float t_cross = ((step > 0 ? c : c + 1) - o) * inv_d;
+    return at_tie ? t_cross <= t : t_cross < t;
+  };
+  // Start from the rounded position and correct it with the exact times
+  int c = (int)clamp(floorf(o + d * t), lo, hi - 1);
+  c = step > 0 ? std::max(c, cell) : std::min(c, cell);
+  while (c != cell && !crossed(c)) {
+    c -= step;
+  }
+  while (lo <= c + step && c + step < hi && crossed(c + step)) {
+    c += step;
+  }
+  return c;
+}
+
+RayHit
+raycast_heightfield(const Heightfield *hf, const HeightPyramid *pyramid,
+                    vec3f origin, vec3f dir, float max_t) {
+  RayHit res{};
+  int width = hf->width;
+
+  float to_grid = width / hf->scale;
+  float o[2] = {(origin.x / hf->scale + 0.5F) * width + 0.5F,
+                (origin.z / hf->scale + 0.5F) * width + 0.5F};
+  float d[2] = {dir.x * to_grid, dir.z * to_grid};
+
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  float t_enter = 0;
+  float t_exit = max_t;
+  for (int axis = 0; axis < 2; ++axis) {
+    if (d[axis] == 0) {
+      if (o[axis] < 0 || o[axis] >= width) {
+        return res;
+      }
+      continue;
+    }
+    float t0 = (0 - o[axis]) / d[axis];
+    float t1 = (width - o[axis]) / d[axis];
+    t_enter = fmaxf(t_enter, fminf(t0, t1));
+    t_exit = fminf(t_exit, fmaxf(t0, t1));
+  }
+  if (t_enter > t_exit) {
+    return res;
+  }
+
+  // The cells and the boundary times are the ones of the plain walk, so
+  // leaving a block lands in the cell the walk would be in
+  int cell[2];
+  int step[2];
+  float inv_d[2];
+  for (int axis = 0; axis < 2; ++axis) {
+    float p = o[axis] + d[axis] * t_enter;
+    cell[axis] = (int)clamp(floorf(p), 0, width - 1);
+    step[axis] = d[axis] > 0 ? 1 : (d[axis] < 0 ? -1 : 0);
+    inv_d[axis] = 1 / d[axis];
+  }
+
+  int top = pyramid->n_levels - 1;
+  int level = top;
+  float t = t_enter;
+  int last_axis = -1;
+  while (true) {
+    int size = 1 << level;
+    int node[2] = {cell[0] >> level, cell[1] >> level};
+
+    float t_leave_axis[2];
+    for (int axis = 0; axis < 2; ++axis) {
+      if (step[axis] > 0) {
+        int bound = (node[axis] + 1) * size;
+        bound = bound < width ? bound : width;
+        t_leave_axis[axis] = (bound - o[axis]) * inv_d[axis];
+      } else if (step[axis] < 0) {
+        t_leave_axis[axis] = (node[axis] * size - o[axis]) * inv_d[axis];
+      } else {
+        t_leave_axis[axis] = inf;
+      }
+    }
+    int exit_axis = t_leave_axis[0] < t_leave_axis[1] ? 0 : 1;
+    float t_leave = fminf(t_leave_axis[exit_axis], t_exit);
+
+    float y_in = origin.y + dir.y * t;
+    float y_out = origin.y + dir.y * t_leave;
+    float max_h;
+    float min_h;
+    if (level == 0) {
+      max_h = hf->vals[cell[0] * width + cell[1]];
+      min_h = max_h;
+    } else {
+      int idx = node[0] * pyramid->level_widths[level] + node[1];
+      max_h = pyramid->maxs[level][idx];
+      min_h = pyramid->mins[level][idx];
+    }
+
+    if (fminf(y_in, y_out) > max_h) {
+      // Above the whole block, step to the next one
+      if (t_leave_axis[exit_axis] > t_exit) {
+        return res;
+      }
+      t = t_leave_axis[exit_axis];
+      int other = 1 - exit_axis;
+      cell[exit_axis] = step[exit_axis] > 0 ? (node[exit_axis] + 1) * size
+                                            : node[exit_axis] * size - 1;
+      if (cell[exit_axis] < 0 || cell[exit_axis] >= width) {
+        return res;
+      }
+      int lo = node[other] * size;
+      int hi = lo + size < width ? lo + size : width;
+      cell[other] = walk_cell_at(o[other], d[other], inv_d[other],
+                                 step[other], cell[other], lo, hi, t,
+                                 exit_axis == 0);
+      last_axis = exit_axis;
+      level = level < top ? level + 1 : top;
+      continue;
+    }
+
+    if (level > 0 && y_in > min_h) {
+      level--;
+      continue;
+    }
+
+    // Either a single column or the ray is already below every column of
+    // the block, in both cases the current cell is hit
+    res.hit = true;
+    res.row = cell[0];
+    res.col = cell[1];
+    float h = hf->vals[cell[0] * width + cell[1]];
+    if (y_in <= h) {
+      res.t = t;
+      res.normal = vec3f{0, 1, 0};
+      if (last_axis == 0) {
+        res.normal = vec3f{(float)-step[0], 0, 0};
+      } else if (last_axis == 1) {
+        res.normal = vec3f{0, 0, (float)-step[1]};
+      }
+    } else {
+      res.t = t + (h - y_in) / dir.y;
+      res.normal = vec3f{0, 1, 0};
+    }
+    return res;
+  }
+}
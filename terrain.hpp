@@ -0,0 +1,94 @@
+#pragma once
+
+#include "math.hpp"
+
+#include <cstddef>
+
+struct Wave {
+  float x;
+  float y;
+  float speed;
+  float size;
+  float time;
+};
+
+// Sums the waves, and their mirror images around mirror_row, into the
+// width x width grid vals. Rows from mirror_row on are flat. This is the
+// reference for the compute shader.
+void
+eval_waves(float *vals, int width, int mirror_row, const Wave *waves,
+           int n_waves);
+
+/*
+   Cell (row, col) is a column centered at x = (row / width - 0.5) * scale,
+   z = (col / width - 0.5) * scale with its top at vals[row * width + col].
+*/
+struct Heightfield {
+  float *vals;
+  int width;
+  float scale;
+};
+
+struct RayHit {
+  bool hit;
+  int row;
+  int col;
+  float t;
+  vec3f normal;
+};
+
+// First column hit by origin + t * dir for t in [0, max_t], walks the cells
+// the ray crosses in order
+RayHit
+raycast_heightfield(const Heightfield *hf, vec3f origin, vec3f dir,
+                    float max_t);
+
+enum class SampleMode { Nearest, Bilinear };
+
+/*
+   Heights at the world positions xz (x, z), clamped to the terrain. Nearest
+   returns the top of the column the point is over, Bilinear interpolates
+   between the column centers. grads, when not null, gets the height
+   derivatives along x and z, zero for Nearest and where clamped. Queries
+   are processed 8 at a time.
+*/
+void
+sample_heights(const Heightfield *hf, const vec2f *xz, float *out, size_t n,
+               SampleMode mode, vec2f *grads = nullptr);
+
+constexpr int max_pyramid_levels = 16;
+
+/*
+   Min/max heights of 2^level x 2^level blocks of cells, level 0 is the
+   heightfield itself. Ray queries skip whole blocks the ray passes above.
+*/
+struct HeightPyramid {
+  int width;
+  int n_levels;
+  int level_widths[max_pyramid_levels];
+  float *mins[max_pyramid_levels];
+  float *maxs[max_pyramid_levels];
+};
+
+void
+init_height_pyramid(HeightPyramid *pyramid, int width);
+
+void
+free_height_pyramid(HeightPyramid *pyramid);
+
+// Recomputes the blocks covering rows [row0, row1) and cols [col0, col1)
+void
+update_height_pyramid(HeightPyramid *pyramid, const Heightfield *hf, int row0,
+                      int col0, int row1, int col1);
+
+// Bounds of the cells that differ between the width x width grids a and b,
+// rows [row0, row1) and cols [col0, col1). False when none do.
+bool
+changed_cells(const float *a, const float *b, int width, int *row0, int *col0,
+              int *row1, int *col1);
+
+// Exactly the hit cell, t and normal of the plain walk, descends the pyramid
+// instead of visiting every cell under the ray
+RayHit
+raycast_heightfield(const Heightfield *hf, const HeightPyramid *pyramid,
+                    vec3f origin, vec3f dir, float max_t);
@@ -0,0 +1,520 @@
+#include "bench.hpp"
+#include "crowd.hpp"
+#include "hero.hpp"
+#include "jobs.hpp"
+#include "math.hpp"
+#include "noise.hpp"
+#include "particles.hpp"
+#include "path.hpp"
+#include "terrain.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <utility>
+#include <vector>
+
+/*
+   Times the terrain queries, paths, crowds, particles and noise. The ray,
+   path and distance field checks compare the fast versions with plain ones,
+   the exit code is 1 when any of them differs.
+*/
+
+using time_point = std::chrono::high_resolution_clock::time_point;
+
+time_point
+now() {
+  return std::chrono::high_resolution_clock::now();
+}
+
+float
+ms_since(time_point start) {
+  return std::chrono::duration<float, std::milli>(now() - start).count();
+}
+
+float
+rand_float(float min_v, float max_v) {
+  return min_v + (max_v - min_v) * ((float)rand() / (float)RAND_MAX);
+}
+
+static bool
+same_hit(const RayHit &a, const RayHit &b) {
+  if (a.hit != b.hit) {
+    return false;
+  }
+  return !a.hit || (a.row == b.row && a.col == b.col && a.t == b.t &&
+                    a.normal.x == b.normal.x && a.normal.y == b.normal.y &&
+                    a.normal.z == b.normal.z);
+}
+
+// Compares the plain cell walk with the pyramid descent on rolling terrain,
+// rays start above it and look down at a shallow angle like the camera does.
+// Half of them are grid aligned or diagonal, through cell corners. Returns
+// whether every hit cell, t and normal is the same.
+bool
+bench(int width, int n_rays) {
+  float scale = 6;
+  float *vals = (float *)malloc(sizeof(float) * width * width);
+  for (int row = 0; row < width; ++row) {
+    for (int col = 0; col < width; ++col) {
+      float x = (float)row / width;
+      float z = (float)col / width;
+      vals[row * width + col] = 0.2F * sinf(9 * x) * cosf(7 * z) +
+                                0.05F * sinf(61 * x + 37 * z);
+    }
+  }
+  Heightfield hf{.vals = vals, .width = width, .scale = scale};
+
+  time_point start = now();
+  HeightPyramid pyramid;
+  init_height_pyramid(&pyramid, width);
+  update_height_pyramid(&pyramid, &hf, 0, 0, width, width);
+  float build_ms = ms_since(start);
+
+  vec3f *origins = (vec3f *)malloc(sizeof(vec3f) * n_rays);
+  vec3f *dirs = (vec3f *)malloc(sizeof(vec3f) * n_rays);
+  srand(width);
+  for (int i = 0; i < n_rays; ++i) {
+    origins[i] = vec3f{rand_float(-3, 3), rand_float(0.5, 2), rand_float(-3, 3)};
+    float a = rand_float(0, 2 * pi);
+    if (i % 2 == 1) {
+      // From a cell corner along a multiple of 45 degrees
+      float cell = scale / width;
+      origins[i].x = roundf(origins[i].x / cell) * cell;
+      origins[i].z = roundf(origins[i].z / cell) * cell;
+      a = (float)(rand() % 8) * 0.25F * pi;
+    }
+    dirs[i] = normalized(vec3f{cosf(a), rand_float(-0.3, -0.05), sinf(a)});
+  }
+
+  int hits[2] = {0, 0};
+  int mismatches = 0;
+  float ms[2];
+  for (int method = 0; method < 2; ++method) {
+    start = now();
+    for (int i = 0; i < n_rays; ++i) {
+      RayHit hit =
+          method == 0
+              ? raycast_heightfield(&hf, origins[i], dirs[i], 20)
+              : raycast_heightfield(&hf, &pyramid, origins[i], dirs[i], 20);
+      hits[method] += hit.hit;
+    }
+    ms[method] = ms_since(start);
+  }
+  for (int i = 0; i < n_rays; ++i) {
+    RayHit a = raycast_heightfield(&hf, origins[i], dirs[i], 20);
+    RayHit b = raycast_heightfield(&hf, &pyramid, origins[i], dirs[i], 20);
+    mismatches += !same_hit(a, b);
+  }
+
+  // Height queries, as many as the rays
+  vec2f *xz = (vec2f *)malloc(sizeof(vec2f) * n_rays);
+  float *heights = (float *)malloc(sizeof(float) * n_rays);
+  vec2f *grads = (vec2f *)malloc(sizeof(vec2f) * n_rays);
+  for (int i = 0; i < n_rays; ++i) {
+    xz[i] = vec2f{origins[i].x, origins[i].z};
+  }
+  float sample_ms[2];
+  start = now();
+  sample_heights(&hf, xz, heights, n_rays, SampleMode::Nearest);
+  sample_ms[0] = ms_since(start);
+  start = now();
+  sample_heights(&hf, xz, heights, n_rays, SampleMode::Bilinear, grads);
+  sample_ms[1] = ms_since(start);
+
+  printf("%5d^2  walk %8.1f ns/ray  pyramid %8.1f ns/ray  (build %.2f ms, "
+         "hits %d/%d, mismatches %d)\n",
+         width, 1e6F * ms[0] / n_rays, 1e6F * ms[1] / n_rays, build_ms,
+         hits[1], n_rays, mismatches);
+  printf("        nearest %5.2f ns/sample  bilinear+grad %5.2f ns/sample\n",
+         1e6F * sample_ms[0] / n_rays, 1e6F * sample_ms[1] / n_rays);
+
+  free(xz);
+  free(heights);
+  free(grads);
+  free(origins);
+  free(dirs);
+  free_height_pyramid(&pyramid);
+  free(vals);
+  return mismatches == 0;
+}
+
+// Many heroes walking over a traveling wave, the time per hero per tick
+void
+bench_heroes(int width, int n_heroes, int n_ticks) {
+  float scale = 6;
+  size_t size = sizeof(float) * width * width;
+  float *prev_vals = (float *)calloc(1, size);
+  float *vals = (float *)calloc(1, size);
+  Heightfield prev{.vals = prev_vals, .width = width, .scale = scale};
+  Heightfield cur{.vals = vals, .width = width, .scale = scale};
+
+  Hero *heroes = (Hero *)malloc(sizeof(Hero) * n_heroes);
+  vec2f *moves = (vec2f *)malloc(sizeof(vec2f) * n_heroes);
+  srand(n_heroes);
+  for (int i = 0; i < n_heroes; ++i) {
+    init_hero(&heroes[i], vec3f{rand_float(-3, 3), 0.5, rand_float(-3, 3)},
+              0.1F);
+    float a = rand_float(0, 2 * pi);
+    moves[i] = vec2f{cosf(a), sinf(a)};
+  }
+
+  float dt = 1.0F / 60;
+  float ms = 0;
+  for (int tick = 0; tick < n_ticks; ++tick) {
+    memcpy(prev_vals, vals, size);
+    for (int row = 0; row < width; ++row) {
+      for (int col = 0; col < width; ++col) {
+        float x = (float)row / width;
+        vals[row * width + col] =
+            0.4F * fmaxf(0, sinf(20 * x - 6 * dt * tick));
+      }
+    }
+    time_point start = now();
+    for (int i = 0; i < n_heroes; ++i) {
+      update_hero(&heroes[i], &prev, &cur, moves[i], tick % 60 == i % 60, dt);
+    }
+    ms += ms_since(start);
+  }
+  printf("heroes %d on %d^2: %.2f us per hero tick\n", n_heroes, width,
+         1e3F * ms / ((float)n_heroes * n_ticks));
+
+  free(heroes);
+  free(moves);
+  free(prev_vals);
+  free(vals);
+}
+
+// Plain A* over the 8 neighbours, diagonals need both cells beside them
+// free like in path.cpp. The length of the shortest path from start to goal,
+// infinity when there is none.
+static double
+plain_path_length(const PassGrid *grid, int start, int goal) {
+  int width = grid->width;
+  auto free_cell = [&](int r, int c) {
+    return 0 <= r && r < width && 0 <= c && c < width &&
+           grid->passable[r * width + c];
+  };
+  auto octile = [&](int a, int b) {
+    int dr = abs(a / width - b / width);
+    int dc = abs(a % width - b % width);
+    return std::max(dr, dc) + (sqrt(2.0) - 1) * std::min(dr, dc);
+  };
+  constexpr double inf = INFINITY;
+  std::vector<double> g((size_t)width * width, inf);
+  std::vector<uint8_t> closed((size_t)width * width);
+  using Entry = std::pair<double, int>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> open;
+  g[start] = 0;
+  open.push({octile(start, goal), start});
+  while (!open.empty()) {
+    int i = open.top().second;
+    open.pop();
+    if (i == goal) {
+      return g[i];
+    }
+    if (closed[i]) {
+      continue;
+    }
+    closed[i] = 1;
+    int row = i / width;
+    int col = i % width;
+    for (int dir = 0; dir < 8; ++dir) {
+      int r = row + dir_rows[dir];
+      int c = col + dir_cols[dir];
+      if (!free_cell(r, c) ||
+          (dir >= 4 && !(free_cell(r, col) && free_cell(row, c)))) {
+        continue;
+      }
+      int j = r * width + c;
+      double cost = g[i] + (dir < 4 ? 1 : sqrt(2.0));
+      if (cost < g[j]) {
+        g[j] = cost;
+        open.push({cost + octile(j, goal), j});
+      }
+    }
+  }
+  return inf;
+}
+
+// Length of the jump points path, its segments are straight or diagonal
+static double
+jump_path_length(const int *path, int n, int width) {
+  int straight = 0;
+  int diagonal = 0;
+  for (int k = 0; k + 1 < n; ++k) {
+    int dr = abs(path[k] / width - path[k + 1] / width);
+    int dc = abs(path[k] % width - path[k + 1] % width);
+    diagonal += std::min(dr, dc);
+    straight += std::max(dr, dc) - std::min(dr, dc);
+  }
+  return straight + sqrt(2.0) * diagonal;
+}
+
+// Jump point search between random cells and distance field repairs after
+// a local change, on hills whose tops are impassable. Every check_every-th
+// path is compared with plain A*, and the repaired field with one built
+// from scratch. Returns whether all of them are the same.
+bool
+bench_paths(int width, int n_queries, int check_every) {
+  float *vals = (float *)malloc(sizeof(float) * width * width);
+  for (int row = 0; row < width; ++row) {
+    for (int col = 0; col < width; ++col) {
+      float x = (float)row / width;
+      float z = (float)col / width;
+      vals[row * width + col] = 0.2F * sinf(31 * x) * cosf(23 * z);
+    }
+  }
+  Heightfield hf{.vals = vals, .width = width, .scale = 6};
+
+  PassGrid grid;
+  init_pass_grid(&grid, width, PassParams{.max_height = 0.1F});
+  time_point start = now();
+  update_pass_grid(&grid, &hf);
+  float grid_ms = ms_since(start);
+
+  PathSearch search;
+  init_path_search(&search, width);
+  int *path = (int *)malloc(sizeof(int) * width * width);
+  srand(width);
+  int found = 0;
+  int path_mismatches = 0;
+  std::vector<double> query_ms(n_queries);
+  for (int q = 0; q < n_queries; ++q) {
+    int a;
+    int b;
+    do {
+      a = rand() % (width * width);
+      b = rand() % (width * width);
+    } while (!grid.passable[a] || !grid.passable[b]);
+    time_point query_start = now();
+    int n = find_path(&grid, &search, a, b, path, width * width);
+    query_ms[q] = ms_since(query_start);
+    found += n > 0;
+    if (q % check_every == 0) {
+      double len = n > 0 ? jump_path_length(path, n, width) : INFINITY;
+      double plain = plain_path_length(&grid, a, b);
+      path_mismatches += !(len == plain || fabs(len - plain) < 1e-9 * plain);
+    }
+  }
+  std::sort(query_ms.begin(), query_ms.end());
+
+  DistanceField field;
+  init_distance_field(&field, &grid);
+  int goals[16];
+  for (int &goal : goals) {
+    goal = rand() % (width * width);
+    set_goal(&field, goal, true);
+  }
+  start = now();
+  repair_distance_field(&field, &grid);
+  float build_ms = ms_since(start);
+
+  // A bump rises in one spot, only its tiles are revisited
+  for (int row = width / 2; row < width / 2 + 24; ++row) {
+    for (int col = width / 3; col < width / 3 + 24; ++col) {
+      vals[row * width + col] += 0.5F;
+    }
+  }
+  start = now();
+  update_pass_grid(&grid, &hf);
+  repair_distance_field(&field, &grid);
+  float repair_ms = ms_since(start);
+
+  DistanceField rebuilt;
+  init_distance_field(&rebuilt, &grid);
+  for (int goal : goals) {
+    set_goal(&rebuilt, goal, true);
+  }
+  repair_distance_field(&rebuilt, &grid);
+  int field_mismatches = 0;
+  for (int i = 0; i < width * width; ++i) {
+    field_mismatches += field.dist[i] != rebuilt.dist[i];
+  }
+
+  printf("paths %d^2: grid %.2f ms, jps median %.3f ms p99 %.3f ms worst "
+         "%.3f ms (%d/%d found), field %.2f ms, repair %.3f ms\n",
+         width, grid_ms, sorted_percentile(query_ms, 0.5),
+         sorted_percentile(query_ms, 0.99), query_ms.back(), found, n_queries,
+         build_ms, repair_ms);
+  printf("        path lengths != A* %d/%d, repaired cells != rebuilt %d\n",
+         path_mismatches, (n_queries + check_every - 1) / check_every,
+         field_mismatches);
+
+  free_distance_field(&rebuilt);
+  free_distance_field(&field);
+  free_path_search(&search);
+  free_pass_grid(&grid);
+  free(path);
+  free(vals);
+  return path_mismatches == 0 && field_mismatches == 0;
+}
+
+// Agents seeking a few goals while a wave rolls through them, the time per
+// tick with n_threads workers. The positions are compared with a serial run.
+void
+bench_crowd(int width, int n_agents, int n_ticks, int n_threads) {
+  float scale = 6;
+  size_t size = sizeof(float) * width * width;
+  float *prev_vals = (float *)calloc(1, size);
+  float *vals = (float *)calloc(1, size);
+  Heightfield prev{.vals = prev_vals, .width = width, .scale = scale};
+  Heightfield cur{.vals = vals, .width = width, .scale = scale};
+
+  PassGrid grid;
+  init_pass_grid(&grid, width, PassParams{});
+  DistanceField goals;
+  init_distance_field(&goals, &grid);
+  srand(width);
+  for (int i = 0; i < 8; ++i) {
+    set_goal(&goals, rand() % (width * width), true);
+  }
+  FlowField flow;
+  init_flow_field(&flow, width);
+
+  JobPool serial;
+  init_job_pool(&serial, 0);
+  JobPool pool;
+  init_job_pool(&pool, n_threads);
+  Crowd crowds[2];
+  for (Crowd &crowd : crowds) {
+    init_crowd(&crowd, n_agents, scale, CrowdParams{});
+    spawn_agents(&crowd, n_agents, 1);
+  }
+
+  float dt = 1.0F / 60;
+  float flow_ms = 0;
+  float crowd_ms = 0;
+  for (int tick = 0; tick < n_ticks; ++tick) {
+    memcpy(prev_vals, vals, size);
+    for (int row = 0; row < width; ++row) {
+      for (int col = 0; col < width; ++col) {
+        float x = (float)row / width;
+        vals[row * width + col] =
+            0.4F * fmaxf(0, sinf(20 * x - 6 * dt * tick));
+      }
+    }
+    update_pass_grid(&grid, &cur);
+    repair_distance_field(&goals, &grid);
+
+    time_point start = now();
+    update_flow_field(&flow, &pool, &goals, &prev, &cur, CrowdParams{});
+    flow_ms += ms_since(start);
+    start = now();
+    update_crowd(&crowds[0], &pool, &flow, &grid, &cur, dt);
+    crowd_ms += ms_since(start);
+    update_crowd(&crowds[1], &serial, &flow, &grid, &cur, dt);
+  }
+  bool same = memcmp(crowds[0].positions, crowds[1].positions,
+                     sizeof(float) * 3 * crowds[0].capacity) == 0;
+  printf("crowd %d agents on %d^2, %d workers: flow %.3f ms, agents %.3f ms "
+         "per tick, %s the serial run\n",
+         n_agents, width, pool.n_threads, flow_ms / n_ticks,
+         crowd_ms / n_ticks, same ? "same as" : "DIFFERENT from");
+
+  for (Crowd &crowd : crowds) {
+    free_crowd(&crowd);
+  }
+  free_job_pool(&pool);
+  free_job_pool(&serial);
+  free_flow_field(&flow);
+  free_distance_field(&goals);
+  free_pass_grid(&grid);
+  free(prev_vals);
+  free(vals);
+}
+
+// A million particles splashing over rolling terrain, new bursts reuse the
+// slots of the ones that died
+void
+bench_particles(int width, int n_particles, int n_ticks, int n_threads) {
+  float *vals = (float *)malloc(sizeof(float) * width * width);
+  for (int row = 0; row < width; ++row) {
+    for (int col = 0; col < width; ++col) {
+      float x = (float)row / width;
+      float z = (float)col / width;
+      vals[row * width + col] = 0.2F * sinf(9 * x) * cosf(7 * z);
+    }
+  }
+  Heightfield hf{.vals = vals, .width = width, .scale = 6};
+
+  JobPool pool;
+  init_job_pool(&pool, n_threads);
+  Particles ps;
+  init_particles(&ps, n_particles, ParticleParams{});
+  float *instances = (float *)malloc(sizeof(float) * 4 * ps.capacity);
+
+  float dt = 1.0F / 60;
+  float update_ms = 0;
+  float write_ms = 0;
+  int n_written = 0;
+  srand(n_particles);
+  for (int tick = 0; tick < n_ticks; ++tick) {
+    while (ps.n_alive < n_particles) {
+      vec3f pos{rand_float(-3, 3), 0.5, rand_float(-3, 3)};
+      if (emit_particles(&ps, pos, vec3f{0, 3, 0}, 1.5, 2, 4096) == 0) {
+        break;
+      }
+    }
+    time_point start = now();
+    update_particles(&ps, &pool, &hf, dt);
+    update_ms += ms_since(start);
+    start = now();
+    n_written = write_particle_instances(&ps, &pool, instances);
+    write_ms += ms_since(start);
+  }
+  printf("particles %d, %d workers: update %.3f ms, write %.3f ms per tick, "
+         "%d live %d written\n",
+         n_particles, pool.n_threads, update_ms / n_ticks, write_ms / n_ticks,
+         ps.n_alive, n_written);
+
+  free(instances);
+  free_particles(&ps);
+  free_job_pool(&pool);
+  free(vals);
+}
+
+// A base terrain from each kind of noise, 6 octaves
+void
+bench_noise(int width, int n_threads) {
+  float *vals = (float *)malloc(sizeof(float) * width * width);
+  JobPool pool;
+  init_job_pool(&pool, n_threads);
+  const char *names[] = {"value", "perlin", "simplex"};
+  NoiseKind kinds[] = {NoiseKind::Value, NoiseKind::Perlin,
+                       NoiseKind::Simplex};
+  for (int k = 0; k < 3; ++k) {
+    NoiseParams params{.kind = kinds[k]};
+    time_point start = now();
+    generate_base_terrain(vals, width, 1, params, &pool);
+    float fbm_ms = ms_since(start);
+    params.fractal = NoiseFractal::Ridged;
+    params.warp = 0.5F;
+    start = now();
+    generate_base_terrain(vals, width, 1, params, &pool);
+    float warped_ms = ms_since(start);
+    printf("noise %-7s %d^2, %d workers: fbm %.1f ms, ridged warped %.1f ms\n",
+           names[k], width, pool.n_threads, fbm_ms, warped_ms);
+  }
+  free_job_pool(&pool);
+  free(vals);
+}
+
+int
+main() {
+  bool ok = bench(90, 100000);
+  ok &= bench(1024, 20000);
+  ok &= bench(4096, 5000);
+  bench_heroes(256, 1000, 120);
+  ok &= bench_paths(90, 1000, 1);
+  ok &= bench_paths(1024, 200, 10);
+  bench_crowd(256, 100000, 120, 0);
+  bench_crowd(256, 100000, 120, -1);
+  bench_particles(256, 1 << 20, 120, -1);
+  bench_noise(4096, -1);
+  return ok ? 0 : 1;
+}
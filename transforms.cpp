@@ -0,0 +1,96 @@
+#include "transforms.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+Transform
+line_transform(vec3f p1, vec3f p2, float thickness) {
+  vec3f new_y = p2 - p1;
+  float new_len = len(new_y);
+  vec3f new_x = cross(normalized(new_y), vec3f{0, 1, 0});
+  vec3f new_z = cross(new_x, new_y);
+  new_y = cross(new_z, new_x);
+
+  Transform tr;
+  if (len(new_x) < 0.001) {
+    tr.axes[0] = vec3f{1, 0, 0};
+    tr.axes[1] = vec3f{0, 1, 0};
+    tr.axes[2] = vec3f{0, 0, 1};
+  } else {
+    tr.axes[0] = normalized(new_x);
+    tr.axes[1] = normalized(new_y);
+    tr.axes[2] = normalized(new_z);
+  }
+  tr.translation = p1 + 0.5 * (p2 - p1);
+  tr.scale = vec3f{thickness, new_len, thickness};
+  return tr;
+}
+
+void
+init_transform_tree(TransformTree *tree, int capacity) {
+  tree->n = 0;
+  tree->capacity = capacity;
+  tree->parents = (int *)malloc(sizeof(int) * capacity);
+  tree->locals = (Transform *)malloc(sizeof(Transform) * capacity);
+  tree->worlds = (affine3f *)malloc(sizeof(affine3f) * capacity);
+  tree->dirty = (bool *)malloc(sizeof(bool) * capacity);
+  tree->first_dirty = 0;
+}
+
+void
+free_transform_tree(TransformTree *tree) {
+  free(tree->parents);
+  free(tree->locals);
+  free(tree->worlds);
+  free(tree->dirty);
+  *tree = TransformTree{};
+}
+
+int
+add_transform(TransformTree *tree, int parent, Transform local) {
+  assert(tree->n < tree->capacity);
+  assert(parent < tree->n);
+  int node = tree->n++;
+  tree->parents[node] = parent;
+  tree->locals[node] = local;
+  tree->dirty[node] = true;
+  tree->first_dirty = std::min(tree->first_dirty, node);
+  return node;
+}
+
+void
+set_local(TransformTree *tree, int node, Transform local) {
+  tree->locals[node] = local;
+  tree->dirty[node] = true;
+  tree->first_dirty = std::min(tree->first_dirty, node);
+}
+
+void
+set_translation(TransformTree *tree, int node, vec3f t) {
+  tree->locals[node].translation = t;
+  tree->dirty[node] = true;
+  tree->first_dirty = std::min(tree->first_dirty, node);
+}
+
+int
+update_transforms(TransformTree *tree) {
+  int updated = 0;
+  for (int i = tree->first_dirty; i < tree->n; ++i) {
+    int parent = tree->parents[i];
+    // The parent is already updated, and still marked if it changed
+    if (parent >= 0 && tree->dirty[parent]) {
+      tree->dirty[i] = true;
+    }
+    if (tree->dirty[i]) {
+      affine3f local = to_affine(tree->locals[i]);
+      tree->worlds[i] = parent >= 0 ? tree->worlds[parent] * local : local;
+      ++updated;
+    }
+  }
+  for (int i = tree->first_dirty; i < tree->n; ++i) {
+    tree->dirty[i] = false;
+  }
+  tree->first_dirty = tree->n;
+  return updated;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "math.hpp"
+
+/*
+   A flat transform hierarchy. Nodes are indices, parents come before their
+   children so the world matrices update in one sweep over the arrays, and
+   only from the first node whose local changed since the last update. Nodes
+   nothing changed above cost nothing, moving a node moves all of its
+   children with it.
+*/
+
+// Scale, then rotate to the unit axes, then translate
+struct Transform {
+  vec3f translation;
+  vec3f axes[3];
+  vec3f scale;
+};
+
+struct TransformTree {
+  int n;
+  int capacity;
+  // -1 for roots
+  int *parents;
+  Transform *locals;
+  affine3f *worlds;
+  // The local changed since the last update
+  bool *dirty;
+  int first_dirty;
+};
+
+constexpr Transform
+translation_transform(vec3f t) {
+  return Transform{t, {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}, {1, 1, 1}};
+}
+
+constexpr affine3f
+to_affine(const Transform &tr) {
+  return affine3f{{tr.scale.x * tr.axes[0], tr.scale.y * tr.axes[1],
+                   tr.scale.z * tr.axes[2]},
+                  tr.translation};
+}
+
+// The box of a debug line from p1 to p2, thickness across and as long as
+// the line along its y axis
+Transform
+line_transform(vec3f p1, vec3f p2, float thickness);
+
+void
+init_transform_tree(TransformTree *tree, int capacity);
+
+void
+free_transform_tree(TransformTree *tree);
+
+// Returns the new node, parent is -1 or an existing node
+int
+add_transform(TransformTree *tree, int parent, Transform local);
+
+void
+set_local(TransformTree *tree, int node, Transform local);
+
+void
+set_translation(TransformTree *tree, int node, vec3f t);
+
+// Recomputes the world matrices of the changed nodes and their children,
+// returns how many
+int
+update_transforms(TransformTree *tree);